@@ -0,0 +1,360 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spe_bench.h"
+
+/* The largest record gen_record writes, without padding */
+#define	GEN_RECORD_MAX		96
+
+SPE_NORETURN void
+bench_errx(int rv, const char *fmt, ...)
+{
+	va_list args;
+
+	fprintf(stderr, "%s: ", bench_name);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+
+	exit(rv);
+}
+
+void
+gen_config_default(struct gen_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->seed = 1;
+	cfg->load_store_pct = 40;
+	cfg->branch_pct = 20;
+	cfg->padding_pct = 5;
+	cfg->max_padding = 64;
+	cfg->timestamp_pct = 50;
+	cfg->long_header_pct = 5;
+	cfg->pcs = 4096;
+	cfg->corrupt_rate = 0.0;
+}
+
+static unsigned long
+gen_number(const char *arg, unsigned long max, const char *what)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 0);
+	if (errno != 0 || *end != '\0' || val > max) {
+		bench_errx(1, "Invalid %s \"%s\"\n", what, arg);
+	}
+
+	return (val);
+}
+
+/*
+ * Parse a size with an optional K, M, or G suffix.
+ */
+uint64_t
+gen_size(const char *arg, const char *what)
+{
+	uint64_t val;
+	char *end;
+
+	errno = 0;
+	val = strtoull(arg, &end, 0);
+	if (errno != 0 || end == arg) {
+		bench_errx(1, "Invalid %s \"%s\"\n", what, arg);
+	}
+	switch (*end) {
+	case 'G':
+	case 'g':
+		val *= 1024;
+		/* FALLTHROUGH */
+	case 'M':
+	case 'm':
+		val *= 1024;
+		/* FALLTHROUGH */
+	case 'K':
+	case 'k':
+		val *= 1024;
+		end++;
+		break;
+	default:
+		break;
+	}
+	if (*end != '\0' || val == 0) {
+		bench_errx(1, "Invalid %s \"%s\"\n", what, arg);
+	}
+
+	return (val);
+}
+
+const char *
+gen_usage(void)
+{
+	return ("[--seed n] [--load-store pct] [--branch pct] "
+	    "[--padding pct]\n"
+	    "    [--max-padding bytes] [--timestamp pct] [--long pct] "
+	    "[--pcs count]\n"
+	    "    [--corrupt rate]");
+}
+
+/*
+ * Parse a generator option. Returns false if the argument isn't one.
+ */
+bool
+gen_option(int argc, char *argv[], int *ip, struct gen_config *cfg)
+{
+	const char *name, *arg;
+	char *end;
+
+	name = argv[*ip];
+	if (strncmp(name, "--", 2) != 0 || *ip + 1 == argc) {
+		return (false);
+	}
+	arg = argv[*ip + 1];
+
+	if (strcmp(name, "--seed") == 0) {
+		cfg->seed = gen_number(arg, ULONG_MAX, "seed");
+	} else if (strcmp(name, "--load-store") == 0) {
+		cfg->load_store_pct = gen_number(arg, 100, "percentage");
+	} else if (strcmp(name, "--branch") == 0) {
+		cfg->branch_pct = gen_number(arg, 100, "percentage");
+	} else if (strcmp(name, "--padding") == 0) {
+		cfg->padding_pct = gen_number(arg, 100, "percentage");
+	} else if (strcmp(name, "--max-padding") == 0) {
+		cfg->max_padding = gen_number(arg, 65536, "padding size");
+	} else if (strcmp(name, "--timestamp") == 0) {
+		cfg->timestamp_pct = gen_number(arg, 100, "percentage");
+	} else if (strcmp(name, "--long") == 0) {
+		cfg->long_header_pct = gen_number(arg, 100, "percentage");
+	} else if (strcmp(name, "--pcs") == 0) {
+		cfg->pcs = gen_number(arg, UINT32_MAX, "PC count");
+		if (cfg->pcs == 0) {
+			bench_errx(1, "Invalid PC count \"%s\"\n", arg);
+		}
+	} else if (strcmp(name, "--corrupt") == 0) {
+		errno = 0;
+		cfg->corrupt_rate = strtod(arg, &end);
+		if (errno != 0 || *end != '\0' || cfg->corrupt_rate < 0.0 ||
+		    cfg->corrupt_rate > 1.0) {
+			bench_errx(1, "Invalid corruption rate \"%s\"\n", arg);
+		}
+	} else {
+		return (false);
+	}
+
+	if (cfg->load_store_pct + cfg->branch_pct > 100) {
+		bench_errx(1,
+		    "More than 100%% of records are load/store or branch\n");
+	}
+
+	(*ip)++;
+	return (true);
+}
+
+/* splitmix64, fast and good enough for test data */
+static inline uint64_t
+gen_rand(struct gen *gen)
+{
+	uint64_t z;
+
+	z = (gen->rng += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return (z ^ (z >> 31));
+}
+
+static inline bool
+gen_pct(struct gen *gen, unsigned int pct)
+{
+	return (gen_rand(gen) % 100 < pct);
+}
+
+/* Bytes until the next corrupt byte, a geometric distribution */
+static uint64_t
+gen_corrupt_gap(struct gen *gen)
+{
+	double u;
+
+	if (gen->cfg.corrupt_rate <= 0.0) {
+		return (UINT64_MAX);
+	}
+	if (gen->cfg.corrupt_rate >= 1.0) {
+		return (0);
+	}
+
+	u = ((double)(gen_rand(gen) >> 11) + 1.0) / 9007199254740993.0;
+	return ((uint64_t)(log(u) / log(1.0 - gen->cfg.corrupt_rate)));
+}
+
+void
+gen_init(struct gen *gen, const struct gen_config *cfg)
+{
+	gen->cfg = *cfg;
+	gen->rng = cfg->seed;
+	gen->timestamp = 1000;
+	gen->next_corrupt = gen_corrupt_gap(gen);
+}
+
+static uint8_t *
+gen_header(struct gen *gen, uint8_t *p, uint8_t header, unsigned int idx)
+{
+	/* Address and counter packets may use the long form for any index */
+	if (idx > 7 || gen_pct(gen, gen->cfg.long_header_pct)) {
+		*p++ = 0x20 | ((idx >> 3) & 0x3);
+	}
+	*p++ = header | (idx & 0x7);
+	return (p);
+}
+
+static uint8_t *
+gen_data(uint8_t *p, uint64_t val, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		*p++ = (uint8_t)(val >> (i * 8));
+	}
+	return (p);
+}
+
+/*
+ * Write a record like those from a Neoverse core: the PC, the operation,
+ * the events, the counters, any data or branch addresses, and the data
+ * source, ended by an end or timestamp packet.
+ */
+static uint8_t *
+gen_record(struct gen *gen, uint8_t *p)
+{
+	uint64_t pc, va, r;
+	unsigned int class;
+
+	/* Skew the PCs so a few are hot */
+	r = gen_rand(gen);
+	pc = ((r & 0xffffffff) % gen->cfg.pcs) *
+	    ((r >> 32) % gen->cfg.pcs) / gen->cfg.pcs;
+	pc = 0x400000 + pc * 4;
+	/* EL0 or EL2, with NS set */
+	pc |= (gen_pct(gen, 50) ? 2ull : 0ull) << 61 | 1ull << 63;
+	p = gen_header(gen, p, 0xb0, 0);
+	p = gen_data(p, pc, 8);
+
+	r = gen_rand(gen) % 100;
+	if (r < gen->cfg.load_store_pct) {
+		class = 1;
+	} else if (r < gen->cfg.load_store_pct + gen->cfg.branch_pct) {
+		class = 2;
+	} else {
+		class = 0;
+	}
+	*p++ = 0x48 | class;
+	*p++ = (uint8_t)gen_rand(gen);
+
+	*p++ = 0x52;
+	p = gen_data(p, gen_rand(gen) & 0x0ffe, 2);
+
+	p = gen_header(gen, p, 0x98, 0);
+	p = gen_data(p, 1 + gen_rand(gen) % 2000, 2);
+	p = gen_header(gen, p, 0x98, 1);
+	p = gen_data(p, 1 + gen_rand(gen) % 100, 2);
+
+	if (class == 1) {
+		va = 0x7f0000000000ull + (gen_rand(gen) % (1 << 24) & ~7ull);
+		p = gen_header(gen, p, 0xb0, 2);
+		p = gen_data(p, va, 8);
+		p = gen_header(gen, p, 0xb0, 3);
+		p = gen_data(p, (va & 0xffffff) | 0x80000000, 8);
+		p = gen_header(gen, p, 0x98, 2);
+		p = gen_data(p, gen_rand(gen) % 500, 2);
+		*p++ = 0x43;
+		*p++ = (uint8_t)(gen_rand(gen) % 16);
+	} else if (class == 2) {
+		p = gen_header(gen, p, 0xb0, 1);
+		p = gen_data(p, 0x500000 +
+		    (gen_rand(gen) % 4096) * 4, 8);
+	}
+
+	*p++ = 0x65;
+	p = gen_data(p, gen_rand(gen) % 128, 4);
+
+	if (gen_pct(gen, gen->cfg.timestamp_pct)) {
+		gen->timestamp += 1 + gen_rand(gen) % 100;
+		*p++ = 0x71;
+		p = gen_data(p, gen->timestamp, 8);
+	} else {
+		*p++ = 0x01;
+	}
+
+	return (p);
+}
+
+/*
+ * Fill the buffer with whole records then padding, and corrupt it. Adds
+ * the number of records to *recordsp.
+ */
+void
+gen_fill(struct gen *gen, uint8_t *buf, size_t len, uint64_t *recordsp)
+{
+	uint8_t *p, *end;
+	size_t pad;
+
+	p = buf;
+	end = buf + len;
+	while ((size_t)(end - p) >= GEN_RECORD_MAX + gen->cfg.max_padding) {
+		p = gen_record(gen, p);
+		(*recordsp)++;
+
+		if (gen->cfg.max_padding > 0 &&
+		    gen_pct(gen, gen->cfg.padding_pct)) {
+			pad = 1 + gen_rand(gen) % gen->cfg.max_padding;
+			memset(p, 0, pad);
+			p += pad;
+		}
+	}
+	memset(p, 0, (size_t)(end - p));
+
+	/* Skip directly to each corrupt byte */
+	while (gen->next_corrupt < len) {
+		buf += gen->next_corrupt;
+		len -= gen->next_corrupt;
+		*buf = (uint8_t)gen_rand(gen);
+		buf++;
+		len--;
+		gen->next_corrupt = gen_corrupt_gap(gen);
+	}
+	if (gen->next_corrupt != UINT64_MAX) {
+		gen->next_corrupt -= len;
+	}
+}
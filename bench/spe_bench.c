@@ -0,0 +1,390 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <spedecode.h>
+
+#include "spe_bench.h"
+
+/* Generate up to this much data, larger buffers repeat it */
+#define	BENCH_GEN_MAX		(64ull * 1024 * 1024)
+#define	BENCH_SIZE_MIN		(16 * 1024)
+#define	BENCH_BATCH		256
+
+const char *bench_name = "spe_bench";
+
+struct bench_path {
+	const char *name;
+	uint64_t (*run)(uint8_t *, size_t);
+};
+
+static unsigned int nthreads = 2;
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "spe_bench [-m max-size] [-t seconds] [-j threads] [-p path]\n"
+	    "          %s\n", gen_usage());
+	fprintf(stderr, "Paths: packet raw batch record scan parallel\n");
+	exit(1);
+}
+
+static double
+bench_time(void)
+{
+	struct timespec ts;
+
+#if defined(_MSC_VER)
+	timespec_get(&ts, TIME_UTC);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+static struct spe_decode_ctx *
+bench_ctx(uint8_t *buf, size_t len)
+{
+	struct spe_decode_ctx *ctx;
+
+	ctx = spe_decode_ctx_alloc();
+	if (ctx == NULL) {
+		bench_errx(1, "Unable to allocate a decode context\n");
+	}
+	if (!spe_decode_ctx_add(ctx, 0, buf, len)) {
+		bench_errx(1, "Unable to add the data\n");
+	}
+	return (ctx);
+}
+
+static void
+packet_cb(struct spe_decode_ctx *ctx, void *data, spe_packet_type type,
+    uint16_t header, uint64_t payload)
+{
+	uint64_t *countp = data;
+
+	(void)ctx;
+	(void)type;
+	(void)header;
+	(void)payload;
+
+	(*countp)++;
+}
+
+/* The callback API, with a callback for each packet type */
+static uint64_t
+bench_packet(uint8_t *buf, size_t len)
+{
+	struct spe_decode_ctx *ctx;
+	uint64_t count;
+	int type;
+
+	ctx = bench_ctx(buf, len);
+	count = 0;
+	spe_packet_decode_set_callback_data(ctx, &count);
+	for (type = SPE_PKT_INVALID; type < SPE_PKT_MAX; type++) {
+		spe_packet_decode_set_callback(ctx, (spe_packet_type)type,
+		    packet_cb);
+	}
+	while (spe_packet_decode_next(ctx, SPE_PACKET_DECODE_SKIP_PADDING))
+		;
+	spe_decode_ctx_free(ctx);
+
+	return (count);
+}
+
+/* The raw header and data API */
+static uint64_t
+bench_raw(uint8_t *buf, size_t len)
+{
+	struct spe_decode_ctx *ctx;
+	uint64_t count, data;
+	uint16_t header;
+	int hdr_len, data_len;
+
+	ctx = bench_ctx(buf, len);
+	count = 0;
+	while (spe_packet_get_header(ctx, SPE_HEADER_SKIP_PADDING, &header,
+	    &hdr_len)) {
+		if (!spe_packet_get_data(ctx, &data, &data_len)) {
+			break;
+		}
+		count += header + data;
+	}
+	spe_decode_ctx_free(ctx);
+
+	return (count);
+}
+
+static uint64_t
+bench_batch(uint8_t *buf, size_t len)
+{
+	struct spe_decode_ctx *ctx;
+	struct spe_packet_batch batch;
+	uint8_t type[BENCH_BATCH];
+	uint16_t header[BENCH_BATCH];
+	uint64_t data[BENCH_BATCH], offset[BENCH_BATCH];
+	uint64_t count;
+	size_t n;
+
+	batch.type = type;
+	batch.header = header;
+	batch.data = data;
+	batch.offset = offset;
+
+	ctx = bench_ctx(buf, len);
+	count = 0;
+	while ((n = spe_packet_decode_batch(ctx,
+	    SPE_PACKET_DECODE_SKIP_PADDING, &batch, BENCH_BATCH)) > 0) {
+		count += n;
+	}
+	spe_decode_ctx_free(ctx);
+
+	return (count);
+}
+
+static uint64_t
+bench_record(uint8_t *buf, size_t len)
+{
+	struct spe_decode_ctx *ctx;
+	struct spe_record recs[BENCH_BATCH];
+	uint64_t count;
+	size_t n;
+
+	ctx = bench_ctx(buf, len);
+	count = 0;
+	while ((n = spe_record_decode_batch(ctx, recs, BENCH_BATCH)) > 0) {
+		count += n;
+	}
+	while (spe_record_decode_flush(ctx, recs)) {
+		count++;
+	}
+	spe_decode_ctx_free(ctx);
+
+	return (count);
+}
+
+static uint64_t
+bench_scan(uint8_t *buf, size_t len)
+{
+	size_t offsets[BENCH_BATCH];
+	uint64_t count;
+	size_t off, n;
+
+	count = 0;
+	off = 0;
+	while ((n = spe_scan_records(buf, len, off, offsets,
+	    BENCH_BATCH)) > 0) {
+		count += n;
+		off = offsets[n - 1];
+	}
+
+	return (count);
+}
+
+static void *
+parallel_chunk_start(struct spe_decode_ctx *ctx, void *priv, size_t idx)
+{
+	(void)ctx;
+	(void)priv;
+	(void)idx;
+
+	return (calloc(1, sizeof(uint64_t)));
+}
+
+static void
+parallel_chunk_done(void *priv, size_t idx, void *data)
+{
+	uint64_t *countp = priv;
+
+	(void)idx;
+
+	*countp += *(uint64_t *)data;
+	free(data);
+}
+
+static void
+parallel_chunk_discard(void *priv, size_t idx, void *data)
+{
+	(void)priv;
+	(void)idx;
+
+	free(data);
+}
+
+static bool
+parallel_decode_next(struct spe_decode_ctx *ctx, void *data)
+{
+	struct spe_record rec;
+
+	if (!spe_record_decode_next(ctx, &rec)) {
+		return (false);
+	}
+	(*(uint64_t *)data)++;
+	return (true);
+}
+
+static const struct spe_parallel_ops parallel_ops = {
+	.chunk_start = parallel_chunk_start,
+	.chunk_done = parallel_chunk_done,
+	.chunk_discard = parallel_chunk_discard,
+	.decode_next = parallel_decode_next,
+};
+
+/* Records decoded in parallel, as with spe_decode -j */
+static uint64_t
+bench_parallel(uint8_t *buf, size_t len)
+{
+	struct spe_decode_ctx *ctx;
+	uint64_t count;
+
+	ctx = bench_ctx(buf, len);
+	count = 0;
+	spe_packet_decode_set_callback_data(ctx, &count);
+	if (!spe_decode_parallel(ctx, 0, nthreads, &parallel_ops, &count)) {
+		bench_errx(1, "Unable to decode in parallel\n");
+	}
+	spe_decode_ctx_free(ctx);
+
+	return (count);
+}
+
+static const struct bench_path paths[] = {
+	{ "packet", bench_packet },
+	{ "raw", bench_raw },
+	{ "batch", bench_batch },
+	{ "record", bench_record },
+	{ "scan", bench_scan },
+	{ "parallel", bench_parallel },
+};
+#define	NPATHS	(sizeof(paths) / sizeof(paths[0]))
+
+static uint8_t *
+bench_data(const struct gen_config *cfg, size_t size)
+{
+	struct gen gen;
+	uint64_t records;
+	uint8_t *buf;
+	size_t len, off;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		bench_errx(1, "Unable to allocate %zu bytes\n", size);
+	}
+
+	/* Generating the data is slower than decoding, repeat it */
+	gen_init(&gen, cfg);
+	records = 0;
+	len = size < BENCH_GEN_MAX ? size : (size_t)BENCH_GEN_MAX;
+	gen_fill(&gen, buf, len, &records);
+	for (off = len; off < size; off += len) {
+		if (len > size - off) {
+			len = size - off;
+		}
+		memcpy(buf + off, buf, len);
+	}
+
+	return (buf);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct gen_config cfg;
+	const char *path;
+	uint64_t max_size, records, iters;
+	uint8_t *buf;
+	double min_time, start, elapsed;
+	size_t size, p;
+	int i;
+
+	gen_config_default(&cfg);
+	max_size = 64 * 1024 * 1024;
+	min_time = 0.5;
+	path = NULL;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			max_size = gen_size(argv[++i], "size");
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			min_time = atof(argv[++i]);
+		} else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			nthreads = (unsigned int)atoi(argv[++i]);
+			if (nthreads == 0) {
+				usage();
+			}
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			path = argv[++i];
+		} else if (!gen_option(argc, argv, &i, &cfg)) {
+			usage();
+		}
+	}
+	if (max_size > SIZE_MAX || max_size < BENCH_SIZE_MIN) {
+		bench_errx(1, "Invalid maximum size\n");
+	}
+
+	buf = bench_data(&cfg, (size_t)max_size);
+
+	printf("%-8s %10s %10s %10s %10s\n", "Path", "Size", "Records",
+	    "MB/s", "Mrec/s");
+	/* From L1 resident up to the largest size, by a factor of 16 */
+	for (size = BENCH_SIZE_MIN; size <= max_size; size *= 16) {
+		records = bench_record(buf, size);
+		for (p = 0; p < NPATHS; p++) {
+			if (path != NULL && strcmp(path, paths[p].name) != 0) {
+				continue;
+			}
+
+			iters = 0;
+			start = bench_time();
+			do {
+				paths[p].run(buf, size);
+				iters++;
+				elapsed = bench_time() - start;
+			} while (elapsed < min_time);
+
+			printf("%-8s %9zuK %10" PRIu64 " %10.1f %10.2f\n",
+			    paths[p].name, size / 1024, records,
+			    (double)size * iters / elapsed / 1e6,
+			    (double)records * iters / elapsed / 1e6);
+		}
+		if (size > SIZE_MAX / 16) {
+			break;
+		}
+	}
+
+	free(buf);
+	return (0);
+}
@@ -0,0 +1,72 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SPE_BENCH_H_
+#define	_SPE_BENCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined(_MSC_VER)
+#define	SPE_NORETURN	__attribute__((__noreturn__))
+#else
+#define	SPE_NORETURN	__declspec(noreturn)
+#endif
+
+extern const char *bench_name;
+SPE_NORETURN void bench_errx(int, const char *, ...);
+
+/* What mix of records to generate */
+struct gen_config {
+	uint64_t seed;
+	unsigned int load_store_pct;	/* Load/store records */
+	unsigned int branch_pct;	/* Branch records, the rest are other */
+	unsigned int padding_pct;	/* Records followed by padding */
+	unsigned int max_padding;	/* Most padding bytes after a record */
+	unsigned int timestamp_pct;	/* Records ended by a timestamp */
+	unsigned int long_header_pct;	/* Packets with a 2 byte header */
+	unsigned int pcs;		/* How many different PCs to sample */
+	double corrupt_rate;		/* Chance each byte is replaced */
+};
+
+struct gen {
+	struct gen_config cfg;
+	uint64_t rng;
+	uint64_t timestamp;
+	uint64_t next_corrupt;		/* Bytes until the next corruption */
+};
+
+void gen_config_default(struct gen_config *);
+bool gen_option(int, char *[], int *, struct gen_config *);
+const char *gen_usage(void);
+void gen_init(struct gen *, const struct gen_config *);
+void gen_fill(struct gen *, uint8_t *, size_t, uint64_t *);
+uint64_t gen_size(const char *, const char *);
+
+#endif /* _SPE_BENCH_H_ */
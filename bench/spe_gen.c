@@ -0,0 +1,108 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spe_bench.h"
+
+/* Generate and write this much data at a time */
+#define	GEN_CHUNK_SIZE		(1024 * 1024)
+
+const char *bench_name = "spe_gen";
+
+static void
+usage(void)
+{
+	fprintf(stderr, "spe_gen [-s size] [-o file] %s\n", gen_usage());
+	fprintf(stderr, "Writes size bytes of SPE data, 64M by default\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct gen_config cfg;
+	struct gen gen;
+	const char *file;
+	uint8_t *buf;
+	uint64_t size, records;
+	size_t len;
+	FILE *fp;
+	int i;
+
+	gen_config_default(&cfg);
+	size = 64 * 1024 * 1024;
+	file = NULL;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			size = gen_size(argv[++i], "size");
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			file = argv[++i];
+		} else if (!gen_option(argc, argv, &i, &cfg)) {
+			usage();
+		}
+	}
+
+	if (file == NULL || strcmp(file, "-") == 0) {
+		fp = stdout;
+	} else {
+		fp = fopen(file, "wb");
+		if (fp == NULL) {
+			bench_errx(1, "Unable to open %s\n", file);
+		}
+	}
+
+	buf = malloc(GEN_CHUNK_SIZE);
+	if (buf == NULL) {
+		bench_errx(1, "Unable to allocate the buffer\n");
+	}
+
+	gen_init(&gen, &cfg);
+	records = 0;
+	while (size > 0) {
+		len = size < GEN_CHUNK_SIZE ? (size_t)size : GEN_CHUNK_SIZE;
+		gen_fill(&gen, buf, len, &records);
+		if (fwrite(buf, 1, len, fp) != len) {
+			bench_errx(1, "Unable to write the data\n");
+		}
+		size -= len;
+	}
+
+	if (fp != stdout && fclose(fp) != 0) {
+		bench_errx(1, "Unable to write the data\n");
+	}
+	free(buf);
+
+	fprintf(stderr, "%" PRIu64 " records\n", records);
+	return (0);
+}
@@ -0,0 +1,245 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <spedecode.h>
+
+#include "spe_decode.h"
+
+#define	ADDR_TABLE_INIT_BITS	10
+/*
+ * An empty slot. An address can also be this, e.g. a PC with all 56 bits
+ * set, so that key is kept outside the slots.
+ */
+#define	ADDR_TABLE_EMPTY	UINT64_MAX
+
+static void
+addr_table_alloc(struct addr_table *table, unsigned int bits)
+{
+	size_t nslots;
+
+	nslots = (size_t)1 << bits;
+	table->slots = malloc(nslots * sizeof(*table->slots));
+	if (table->slots == NULL) {
+		spe_errx(1, "Unable to allocate the address table\n");
+	}
+	for (size_t i = 0; i < nslots; i++) {
+		table->slots[i].key = ADDR_TABLE_EMPTY;
+	}
+	table->shift = 64 - bits;
+	table->mask = nslots - 1;
+}
+
+void
+addr_table_init(struct addr_table *table, size_t value_size)
+{
+	memset(table, 0, sizeof(*table));
+	/* Keep the key with the value for addr_table_key */
+	table->value_size = sizeof(uint64_t) + ((value_size + 7) & ~(size_t)7);
+	addr_table_alloc(table, ADDR_TABLE_INIT_BITS);
+}
+
+void
+addr_table_fini(struct addr_table *table)
+{
+	free(table->slots);
+	free(table->values);
+	memset(table, 0, sizeof(*table));
+}
+
+static inline size_t
+addr_table_hash(struct addr_table *table, uint64_t key)
+{
+	/* Fibonacci hashing spreads nearby addresses across the table */
+	return ((size_t)((key * 0x9e3779b97f4a7c15ull) >> table->shift));
+}
+
+static void
+addr_table_grow(struct addr_table *table)
+{
+	struct addr_slot *old;
+	size_t old_nslots, pos;
+
+	old = table->slots;
+	old_nslots = table->mask + 1;
+	addr_table_alloc(table, 64 - table->shift + 1);
+
+	for (size_t i = 0; i < old_nslots; i++) {
+		if (old[i].key == ADDR_TABLE_EMPTY) {
+			continue;
+		}
+		pos = addr_table_hash(table, old[i].key);
+		while (table->slots[pos].key != ADDR_TABLE_EMPTY) {
+			pos = (pos + 1) & table->mask;
+		}
+		table->slots[pos] = old[i];
+	}
+	free(old);
+}
+
+/* Add a new zeroed value for key */
+static void *
+addr_table_add(struct addr_table *table, uint64_t key)
+{
+	uint8_t *value;
+
+	if (table->count == table->values_size) {
+		size_t new_size;
+		void *tmp;
+
+		new_size = table->values_size == 0 ? 1024 :
+		    table->values_size * 2;
+		tmp = realloc(table->values, new_size * table->value_size);
+		if (tmp == NULL) {
+			spe_errx(1, "Unable to allocate the address table\n");
+		}
+		table->values = tmp;
+		table->values_size = new_size;
+	}
+
+	value = (uint8_t *)table->values + table->count * table->value_size;
+	memset(value, 0, table->value_size);
+	memcpy(value, &key, sizeof(key));
+	table->count++;
+
+	return (value + sizeof(uint64_t));
+}
+
+/*
+ * Find the value for an address, adding a new zeroed value if there is
+ * none. The pointer is valid until the next call.
+ */
+void *
+addr_table_get(struct addr_table *table, uint64_t key)
+{
+	struct addr_slot *slot;
+	size_t pos;
+
+	if (key == ADDR_TABLE_EMPTY) {
+		if (!table->has_empty_key) {
+			table->has_empty_key = true;
+			table->empty_key_idx = (uint32_t)table->count;
+			return (addr_table_add(table, key));
+		}
+		return (addr_table_value(table, table->empty_key_idx));
+	}
+
+	pos = addr_table_hash(table, key);
+	while (true) {
+		slot = &table->slots[pos];
+		if (slot->key == key) {
+			return ((uint8_t *)table->values +
+			    slot->idx * table->value_size + sizeof(uint64_t));
+		}
+		if (slot->key == ADDR_TABLE_EMPTY) {
+			break;
+		}
+		pos = (pos + 1) & table->mask;
+	}
+
+	/* Keep the load factor under 3/4 */
+	if ((table->count + 1) * 4 > (table->mask + 1) * 3) {
+		addr_table_grow(table);
+		return (addr_table_get(table, key));
+	}
+
+	slot->key = key;
+	slot->idx = (uint32_t)table->count;
+	return (addr_table_add(table, key));
+}
+
+/* Access the entries in the order they were added */
+uint64_t
+addr_table_key(struct addr_table *table, size_t idx)
+{
+	uint64_t key;
+
+	assert(idx < table->count);
+	memcpy(&key, (uint8_t *)table->values + idx * table->value_size,
+	    sizeof(key));
+	return (key);
+}
+
+void *
+addr_table_value(struct addr_table *table, size_t idx)
+{
+	assert(idx < table->count);
+	return ((uint8_t *)table->values + idx * table->value_size +
+	    sizeof(uint64_t));
+}
+
+/* qsort has no argument for the comparison function */
+static struct addr_table *addr_sort_table;
+static addr_table_cmp *addr_sort_cmp;
+
+static int
+addr_table_sort_cmp(const void *a, const void *b)
+{
+	size_t ia, ib;
+	int ret;
+
+	ia = *(const size_t *)a;
+	ib = *(const size_t *)b;
+	ret = addr_sort_cmp(addr_table_value(addr_sort_table, ia),
+	    addr_table_value(addr_sort_table, ib));
+	if (ret != 0) {
+		return (ret);
+	}
+	/* Keep the output stable */
+	return (ia < ib ? -1 : 1);
+}
+
+/*
+ * Return the indexes of the entries sorted by cmp, which is passed two
+ * values. Entries that compare equal stay in the order they were added.
+ * The caller frees the array.
+ */
+size_t *
+addr_table_sort(struct addr_table *table, addr_table_cmp *cmp)
+{
+	size_t *order;
+
+	order = malloc((table->count == 0 ? 1 : table->count) *
+	    sizeof(*order));
+	if (order == NULL) {
+		spe_errx(1, "Unable to allocate %zu entries\n", table->count);
+	}
+	for (size_t i = 0; i < table->count; i++) {
+		order[i] = i;
+	}
+	addr_sort_table = table;
+	addr_sort_cmp = cmp;
+	qsort(order, table->count, sizeof(*order), addr_table_sort_cmp);
+
+	return (order);
+}
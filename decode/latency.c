@@ -0,0 +1,219 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <spedecode.h>
+
+#include "spe_decode.h"
+
+static const char *latency_counters[SPE_RECORD_COUNTER_MAX] = {
+	[SPE_COUNTER_IDX_TOTAL_LAT] = "total",
+	[SPE_COUNTER_IDX_ISSUE_LAT] = "issue",
+	[SPE_COUNTER_IDX_TRANS_LAT] = "translation",
+};
+
+static const char *latency_classes[] = {
+	[SPE_OPERATION_TYPE_OTHER] = "other",
+	[SPE_OPERATION_TYPE_LOAD_STORE] = "load-store",
+	[SPE_OPERATION_TYPE_BRANCH] = "branch",
+	[3] = "class-3",
+};
+
+static const double latency_pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+#define	LATENCY_PCTS	(sizeof(latency_pcts) / sizeof(latency_pcts[0]))
+
+static void
+latency_group_init(struct latency_group *group)
+{
+	for (size_t i = 0; i < SPE_RECORD_COUNTER_MAX; i++) {
+		spe_hist_init(&group->counter[i]);
+	}
+}
+
+void
+latency_init(struct latency *lat, int by)
+{
+	memset(lat, 0, sizeof(*lat));
+	lat->by = by;
+	latency_group_init(&lat->all);
+}
+
+void
+latency_fini(struct latency *lat)
+{
+	for (size_t i = 0; i < LATENCY_GROUPS; i++) {
+		free(lat->groups[i]);
+	}
+	memset(lat, 0, sizeof(*lat));
+}
+
+/* The groups are allocated when first used as each is ~23KiB */
+static struct latency_group *
+latency_group(struct latency *lat, size_t idx)
+{
+	struct latency_group *group;
+
+	group = lat->groups[idx];
+	if (group == NULL) {
+		group = malloc(sizeof(*group));
+		if (group == NULL) {
+			spe_errx(1, "Unable to allocate a latency histogram\n");
+		}
+		latency_group_init(group);
+		lat->groups[idx] = group;
+	}
+
+	return (group);
+}
+
+static void
+latency_group_add(struct latency_group *group, const struct spe_record *rec)
+{
+	for (size_t i = 0; i < SPE_RECORD_COUNTER_MAX; i++) {
+		if ((rec->present & SPE_RECORD_COUNTER(i)) != 0) {
+			spe_hist_add(&group->counter[i], rec->counter[i]);
+		}
+	}
+}
+
+void
+latency_add(struct latency *lat, const struct spe_record *rec)
+{
+	size_t idx;
+
+	latency_group_add(&lat->all, rec);
+
+	switch (lat->by) {
+	case LATENCY_BY_CLASS:
+		if ((rec->present & SPE_RECORD_OPERATION_TYPE) == 0) {
+			return;
+		}
+		idx = rec->op_class;
+		break;
+	case LATENCY_BY_SOURCE:
+		if ((rec->present & SPE_RECORD_DATA_SOURCE) == 0) {
+			return;
+		}
+		idx = rec->data_source < LATENCY_SOURCES ?
+		    (size_t)rec->data_source : LATENCY_SOURCES;
+		break;
+	default:
+		return;
+	}
+
+	latency_group_add(latency_group(lat, idx), rec);
+}
+
+static void
+latency_group_merge(struct latency_group *dst,
+    const struct latency_group *src)
+{
+	for (size_t i = 0; i < SPE_RECORD_COUNTER_MAX; i++) {
+		spe_hist_merge(&dst->counter[i], &src->counter[i]);
+	}
+}
+
+/*
+ * Add the histograms in src to dst, e.g. from a chunk decoded on another
+ * thread.
+ */
+void
+latency_merge(struct latency *dst, const struct latency *src)
+{
+	latency_group_merge(&dst->all, &src->all);
+	for (size_t i = 0; i < LATENCY_GROUPS; i++) {
+		if (src->groups[i] != NULL) {
+			latency_group_merge(latency_group(dst, i),
+			    src->groups[i]);
+		}
+	}
+}
+
+static void
+latency_print_group(const struct latency_group *group, const char *name,
+    FILE *fp)
+{
+	const struct spe_hist *hist;
+
+	for (size_t i = 0; i < SPE_RECORD_COUNTER_MAX; i++) {
+		hist = &group->counter[i];
+		if (hist->count == 0) {
+			continue;
+		}
+
+		fprintf(fp, "%-11s %-10s %10"PRIu64" %8.1f %6"PRIu64,
+		    latency_counters[i], name, hist->count,
+		    (double)hist->sum / (double)hist->count, hist->min);
+		for (size_t j = 0; j < LATENCY_PCTS; j++) {
+			fprintf(fp, " %6"PRIu64,
+			    spe_hist_percentile(hist, latency_pcts[j]));
+		}
+		fprintf(fp, " %6"PRIu64"\n", hist->max);
+	}
+}
+
+/*
+ * Print the percentiles of each counter. The percentiles are the upper
+ * bound of the histogram bucket. A bucket can be up to 1/16th of its value
+ * wide so these are within ~6% of the exact value.
+ */
+void
+latency_print(const struct latency *lat, FILE *fp)
+{
+	char name[16];
+
+	fprintf(fp, "%-11s %-10s %10s %8s %6s", "Latency", "Group", "Count",
+	    "Mean", "Min");
+	for (size_t i = 0; i < LATENCY_PCTS; i++) {
+		snprintf(name, sizeof(name), "p%g", latency_pcts[i]);
+		fprintf(fp, " %6s", name);
+	}
+	fprintf(fp, " %6s\n", "Max");
+
+	latency_print_group(&lat->all, "all", fp);
+	for (size_t i = 0; i < LATENCY_GROUPS; i++) {
+		if (lat->groups[i] == NULL) {
+			continue;
+		}
+
+		if (lat->by == LATENCY_BY_CLASS) {
+			snprintf(name, sizeof(name), "%s", latency_classes[i]);
+		} else if (i < LATENCY_SOURCES) {
+			snprintf(name, sizeof(name), "source-%zu", i);
+		} else {
+			snprintf(name, sizeof(name), "source-%d+",
+			    LATENCY_SOURCES);
+		}
+		latency_print_group(lat->groups[i], name, fp);
+	}
+}
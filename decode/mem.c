@@ -0,0 +1,263 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <spedecode.h>
+
+#include "spe_decode.h"
+
+/* The sizes the data addresses are grouped by */
+static const struct {
+	const char *name;
+	unsigned int shift;
+} mem_granules[MEM_GRANULES] = {
+	{ "64B line", 6 },
+	{ "4K page", 12 },
+	{ "2M page", 21 },
+};
+
+/* How many of the most common data sources to print */
+#define	MEM_PRINT_SOURCES	2
+
+struct mem_entry {
+	uint64_t samples;
+	uint64_t latency;		/* Sum of the total latency */
+	uint64_t latency_samples;	/* Samples with a total latency */
+	uint64_t latency_max;
+	uint64_t trans;			/* Sum of the translation latency */
+	uint64_t trans_samples;
+	/* Data sources above MEM_SOURCES are counted in the last entry */
+	uint32_t sources[MEM_SOURCES + 1];
+};
+
+void
+mem_init(struct mem *mem, bool pa)
+{
+	mem->pa = pa;
+	mem->samples = 0;
+	for (size_t i = 0; i < MEM_GRANULES; i++) {
+		addr_table_init(&mem->tables[i], sizeof(struct mem_entry));
+	}
+}
+
+void
+mem_fini(struct mem *mem)
+{
+	for (size_t i = 0; i < MEM_GRANULES; i++) {
+		addr_table_fini(&mem->tables[i]);
+	}
+}
+
+void
+mem_add(struct mem *mem, const struct spe_record *rec)
+{
+	struct mem_entry *entry;
+	uint64_t addr, ds;
+	int idx;
+
+	idx = mem->pa ? SPE_ADDRESS_IDX_DATA_PA : SPE_ADDRESS_IDX_DATA_VA;
+	if ((rec->present & SPE_RECORD_ADDR(idx)) == 0) {
+		return;
+	}
+	/* The physical address has the NS bit in the top byte */
+	addr = mem->pa ? SPE_ADDRESS_ADDR(rec->addr[idx]) :
+	    SPE_ADDRESS_ADDR_SE(rec->addr[idx]);
+	mem->samples++;
+
+	for (size_t i = 0; i < MEM_GRANULES; i++) {
+		entry = addr_table_get(&mem->tables[i],
+		    addr & ~(((uint64_t)1 << mem_granules[i].shift) - 1));
+		entry->samples++;
+
+		if ((rec->present &
+		    SPE_RECORD_COUNTER(SPE_COUNTER_IDX_TOTAL_LAT)) != 0) {
+			entry->latency +=
+			    rec->counter[SPE_COUNTER_IDX_TOTAL_LAT];
+			entry->latency_samples++;
+			if (rec->counter[SPE_COUNTER_IDX_TOTAL_LAT] >
+			    entry->latency_max) {
+				entry->latency_max =
+				    rec->counter[SPE_COUNTER_IDX_TOTAL_LAT];
+			}
+		}
+		if ((rec->present &
+		    SPE_RECORD_COUNTER(SPE_COUNTER_IDX_TRANS_LAT)) != 0) {
+			entry->trans +=
+			    rec->counter[SPE_COUNTER_IDX_TRANS_LAT];
+			entry->trans_samples++;
+		}
+		if ((rec->present & SPE_RECORD_DATA_SOURCE) != 0) {
+			ds = rec->data_source;
+			entry->sources[ds < MEM_SOURCES ? ds : MEM_SOURCES]++;
+		}
+	}
+}
+
+/*
+ * Add the samples in src to dst.
+ */
+void
+mem_merge(struct mem *dst, struct mem *src)
+{
+	struct mem_entry *from, *to;
+	struct addr_table *table;
+
+	for (size_t i = 0; i < MEM_GRANULES; i++) {
+		table = &src->tables[i];
+		for (size_t j = 0; j < table->count; j++) {
+			from = addr_table_value(table, j);
+			to = addr_table_get(&dst->tables[i],
+			    addr_table_key(table, j));
+			to->samples += from->samples;
+			to->latency += from->latency;
+			to->latency_samples += from->latency_samples;
+			if (from->latency_max > to->latency_max) {
+				to->latency_max = from->latency_max;
+			}
+			to->trans += from->trans;
+			to->trans_samples += from->trans_samples;
+			for (size_t k = 0; k <= MEM_SOURCES; k++) {
+				to->sources[k] += from->sources[k];
+			}
+		}
+	}
+	dst->samples += src->samples;
+}
+
+/* Sort by the total latency, i.e. the time spent waiting on the memory */
+static int
+mem_cmp(const void *a, const void *b)
+{
+	const struct mem_entry *ea, *eb;
+
+	ea = a;
+	eb = b;
+	if (ea->latency != eb->latency) {
+		return (ea->latency < eb->latency ? 1 : -1);
+	}
+	if (ea->samples != eb->samples) {
+		return (ea->samples < eb->samples ? 1 : -1);
+	}
+	return (0);
+}
+
+/*
+ * Print the most common data sources as source:percent.
+ */
+static void
+mem_print_sources(const struct mem_entry *entry, FILE *fp)
+{
+	char buf[64];
+	uint64_t total;
+	size_t len, best;
+	bool used[MEM_SOURCES + 1] = { false };
+
+	total = 0;
+	for (size_t i = 0; i <= MEM_SOURCES; i++) {
+		total += entry->sources[i];
+	}
+
+	len = 0;
+	buf[0] = '\0';
+	for (size_t n = 0; n < MEM_PRINT_SOURCES && total > 0; n++) {
+		best = MEM_SOURCES + 1;
+		for (size_t i = 0; i <= MEM_SOURCES; i++) {
+			if (!used[i] && entry->sources[i] > 0 &&
+			    (best > MEM_SOURCES ||
+			    entry->sources[i] > entry->sources[best])) {
+				best = i;
+			}
+		}
+		if (best > MEM_SOURCES) {
+			break;
+		}
+		used[best] = true;
+
+		len += (size_t)snprintf(buf + len, sizeof(buf) - len,
+		    "%s%zu%s:%.0f%%", len == 0 ? "" : " ", best,
+		    best == MEM_SOURCES ? "+" : "",
+		    100.0 * entry->sources[best] / (double)total);
+	}
+
+	fprintf(fp, " %-17s", len == 0 ? "-" : buf);
+}
+
+static void
+mem_print_table(struct mem *mem, size_t granule, FILE *fp,
+    unsigned int count)
+{
+	struct addr_table *table;
+	struct mem_entry *entry;
+	size_t *order;
+
+	fprintf(fp, "%s\n", mem_granules[granule].name);
+	fprintf(fp, "%10s %6s %8s %7s %8s %-17s %s\n", "Samples", "Pct",
+	    "Avg-lat", "Max-lat", "Avg-xlat", "Sources", "Address");
+
+	table = &mem->tables[granule];
+	if (table->count == 0) {
+		return;
+	}
+
+	order = addr_table_sort(table, mem_cmp);
+
+	for (size_t i = 0; i < table->count && i < count; i++) {
+		entry = addr_table_value(table, order[i]);
+		fprintf(fp, "%10"PRIu64" %5.2f%% %8.1f %7"PRIu64" %8.1f",
+		    entry->samples,
+		    100.0 * (double)entry->samples / (double)mem->samples,
+		    entry->latency_samples == 0 ? 0.0 :
+		    (double)entry->latency / (double)entry->latency_samples,
+		    entry->latency_max,
+		    entry->trans_samples == 0 ? 0.0 :
+		    (double)entry->trans / (double)entry->trans_samples);
+		mem_print_sources(entry, fp);
+		fprintf(fp, " %"PRIx64"\n", addr_table_key(table, order[i]));
+	}
+
+	free(order);
+}
+
+/*
+ * Print the lines and pages with the highest total latency.
+ */
+void
+mem_print(struct mem *mem, FILE *fp, unsigned int count)
+{
+	for (size_t i = 0; i < MEM_GRANULES; i++) {
+		if (i > 0) {
+			fprintf(fp, "\n");
+		}
+		mem_print_table(mem, i, fp, count);
+	}
+}
@@ -0,0 +1,204 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <spedecode.h>
+
+#include "spe_decode.h"
+
+/*
+ * Merge the records from a number of sources, e.g. one per CPU, into a
+ * single stream ordered by timestamp. Each source only decodes a small
+ * window of records ahead so the memory used doesn't depend on the size
+ * of the data. The sources are kept in a binary min-heap keyed on the
+ * timestamp of the next record from each source.
+ */
+
+void
+merge_init(struct merge *merge, merge_fill_cb *fill, size_t nsources)
+{
+	memset(merge, 0, sizeof(*merge));
+	merge->fill = fill;
+	merge->nsources = nsources;
+	merge->sources = calloc(nsources, sizeof(*merge->sources));
+	merge->heap = calloc(nsources, sizeof(*merge->heap));
+	if (merge->sources == NULL || merge->heap == NULL) {
+		spe_errx(1, "Unable to allocate %zu merge sources\n",
+		    nsources);
+	}
+}
+
+void
+merge_fini(struct merge *merge)
+{
+	free(merge->sources);
+	free(merge->heap);
+}
+
+void
+merge_set_source(struct merge *merge, size_t idx, struct spe_decode_ctx *ctx,
+    void *data)
+{
+	merge->sources[idx].ctx = ctx;
+	merge->sources[idx].data = data;
+}
+
+/*
+ * Decode the next window of records from a source. Returns false once
+ * there are no more records.
+ */
+static bool
+merge_refill(struct merge *merge, struct merge_source *src)
+{
+	size_t count;
+
+	src->head = 0;
+	src->count = 0;
+	while (!src->eof) {
+		count = spe_record_decode_batch(src->ctx, src->recs,
+		    MERGE_WINDOW);
+		if (count > 0) {
+			src->count = count;
+			break;
+		}
+		if (!merge->fill(src->ctx, src->data)) {
+			src->eof = true;
+		}
+	}
+	/* The records left at the end, the last may not have an end packet */
+	if (src->eof) {
+		while (src->count < MERGE_WINDOW &&
+		    spe_record_decode_flush(src->ctx, &src->recs[src->count])) {
+			src->count++;
+		}
+	}
+
+	/* A record without a timestamp stays after the one before it */
+	for (size_t i = 0; i < src->count; i++) {
+		if ((src->recs[i].present & SPE_RECORD_TIMESTAMP) != 0) {
+			src->timestamp = src->recs[i].timestamp;
+		}
+		src->keys[i] = src->timestamp;
+	}
+
+	return (src->count > 0);
+}
+
+/* Order by timestamp, then by source to keep the output stable */
+static bool
+merge_less(const struct merge *merge, size_t a, size_t b)
+{
+	const struct merge_source *sa, *sb;
+
+	sa = &merge->sources[a];
+	sb = &merge->sources[b];
+	if (sa->keys[sa->head] != sb->keys[sb->head]) {
+		return (sa->keys[sa->head] < sb->keys[sb->head]);
+	}
+	return (a < b);
+}
+
+static void
+merge_sift_up(struct merge *merge, size_t pos)
+{
+	size_t idx, parent;
+
+	idx = merge->heap[pos];
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!merge_less(merge, idx, merge->heap[parent])) {
+			break;
+		}
+		merge->heap[pos] = merge->heap[parent];
+		pos = parent;
+	}
+	merge->heap[pos] = idx;
+}
+
+static void
+merge_sift_down(struct merge *merge, size_t pos)
+{
+	size_t child, idx;
+
+	idx = merge->heap[pos];
+	while ((child = pos * 2 + 1) < merge->heap_len) {
+		if (child + 1 < merge->heap_len &&
+		    merge_less(merge, merge->heap[child + 1],
+		    merge->heap[child])) {
+			child++;
+		}
+		if (!merge_less(merge, merge->heap[child], idx)) {
+			break;
+		}
+		merge->heap[pos] = merge->heap[child];
+		pos = child;
+	}
+	merge->heap[pos] = idx;
+}
+
+/*
+ * Return the record with the lowest timestamp and the index of its
+ * source. Returns false when all sources have ended.
+ */
+bool
+merge_next(struct merge *merge, struct spe_record *rec, size_t *idxp)
+{
+	struct merge_source *src;
+	size_t idx;
+
+	if (!merge->started) {
+		merge->started = true;
+		for (size_t i = 0; i < merge->nsources; i++) {
+			if (merge_refill(merge, &merge->sources[i])) {
+				merge->heap[merge->heap_len++] = i;
+				merge_sift_up(merge, merge->heap_len - 1);
+			}
+		}
+	}
+
+	if (merge->heap_len == 0) {
+		return (false);
+	}
+
+	idx = merge->heap[0];
+	src = &merge->sources[idx];
+	*rec = src->recs[src->head++];
+	*idxp = idx;
+
+	if (src->head == src->count && !merge_refill(merge, src)) {
+		merge->heap[0] = merge->heap[--merge->heap_len];
+	}
+	if (merge->heap_len > 0) {
+		merge_sift_down(merge, 0);
+	}
+
+	return (true);
+}
@@ -28,21 +28,23 @@
 
 #if defined(SPE_MMAP)
 #include <sys/mman.h>
-#endif
 #include <sys/stat.h>
+#endif
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #if !defined(_MSC_VER)
 #include <unistd.h>
 typedef	ssize_t read_t;
-#define	SPE_NORETURN	__attribute__((__noreturn__))
 #else
 /* No unistd.h on MSVC, use io.h for close */
 #include <io.h>
@@ -50,21 +52,133 @@ typedef	ssize_t read_t;
 #define	open		_open
 #define	close		_close
 #define	read		_read
+#define	fileno		_fileno
 #define	O_CLOEXEC	0
 typedef	int read_t;
-#define	SPE_NORETURN	__declspec(noreturn)
 #endif
 
 #include <spedecode.h>
 
+#include "spe_decode.h"
+
+/*
+ * Where the packet callbacks write to. This is either a file, or when
+ * decoding in parallel a buffer that is written out once the chunk is
+ * complete.
+ */
+struct output {
+	FILE *fp;
+	char *buf;
+	size_t len;
+	size_t size;
+	struct sym_cache cache;
+};
+
+static struct output stdout_output;
+
+/* Decode records rather than printing each packet */
+static bool record_mode;
+static unsigned int top_count;
+static bool latency_mode;
+static int latency_by;
+static unsigned int mem_count;
+static bool mem_pa;
+static const char *recfile_name;
+static FILE *recfile_fp;
+static FILE *report_fp;		/* Where --top, --latency and --mem print */
+static struct spe_recfile_writer *recfile;
+static struct spe_filter *filter;
+/* Print the records that match the filter */
+static bool print_records;
+
+/* Symbols to resolve the instruction addresses with */
+static struct sym_table symbols;
+static bool have_symbols;
+
+/* Print the decoder counters and throughput at the end */
+static bool stats_mode;
+
+/*
+ * Library log messages are kept here and printed as the data is decoded,
+ * every LOG_DRAIN_PACKETS packets when printing packets.
+ */
+#define	LOG_RING_SIZE		4096
+#define	LOG_DRAIN_PACKETS	1024
+static struct spe_log_ring *log_ring;
+static int log_level;
+
+/*
+ * How many blocks to read ahead of the decoder when not mapping the file,
+ * and the block size when set.
+ */
+#define	STREAM_DEPTH		4
+static size_t io_depth = STREAM_DEPTH;
+static size_t io_block;
+
+#if defined(SPE_MMAP)
+/*
+ * The size of the window when mapping a file. Windows are aligned to
+ * MAP_ALIGN so they can use huge pages.
+ */
+#define	MAP_WINDOW_SIZE		(64 * 1024 * 1024)
+#define	MAP_ALIGN		(2 * 1024 * 1024)
+static size_t map_window_size = MAP_WINDOW_SIZE;
+#endif
+
+/* Skip corrupt data when decoding records */
+static bool resync_mode;
+
+/*
+ * Merge the records from each file by timestamp. The source of each record
+ * is set to the index of the file it's from.
+ */
+static bool merge_mode;
+
+/* A range of bytes skipped as they didn't hold valid records */
+struct skip {
+	uint64_t start;
+	uint64_t end;
+};
+
+/*
+ * What is gathered from the records. When decoding in parallel each chunk
+ * has its own summary that is merged once the chunk is complete. When the
+ * records are written out the chunks keep them until they can be written
+ * in order.
+ */
+struct summary {
+	struct top top;
+	struct latency latency;
+	struct mem mem;
+	bool chunk;
+	struct spe_record *recs;
+	size_t nrecs;
+	size_t recs_size;
+	struct skip *skips;
+	size_t nskips;
+	size_t skips_size;
+};
+
+static struct summary summary;
+
 static void
 usage(void)
 {
-	fprintf(stderr, "spe_decode file [file ...]\n");
+	fprintf(stderr,
+	    "spe_decode [-j threads] [--top count] [--latency] "
+	    "[--latency-by class|source]\n"
+	    "           [--mem count] [--mem-pa] [--sym elf] [--maps maps] "
+	    "[-o records]\n"
+	    "           [--filter expr] [--resync] [--merge] [--stats] "
+	    "[--log level]\n"
+	    "           [--io-depth count] [--io-block bytes] "
+	    "[--map-window bytes]\n"
+	    "           file [file ...]\n");
+	fprintf(stderr, "Use - as the file to read from stdin\n");
 	exit(1);
 }
 
-SPE_NORETURN static void
+SPE_NORETURN void
 spe_errx(int rv, const char *fmt, ...)
 {
 	va_list args;
@@ -77,7 +191,7 @@ spe_errx(int rv, const char *fmt, ...)
 	exit(rv);
 }
 
-SPE_NORETURN static void
+SPE_NORETURN void
 spe_err(int rv, const char *fmt, ...)
 {
 	va_list args;
@@ -94,17 +208,71 @@ spe_err(int rv, const char *fmt, ...)
 	exit(rv);
 }
 
+static void
+out_printf(struct output *out, const char *fmt, ...)
+{
+	va_list args;
+	size_t new_size;
+	int len;
+	char *tmp;
+
+	if (out->fp != NULL) {
+		va_start(args, fmt);
+		vfprintf(out->fp, fmt, args);
+		va_end(args);
+		return;
+	}
+
+	va_start(args, fmt);
+	len = vsnprintf(out->buf + out->len, out->size - out->len, fmt, args);
+	va_end(args);
+	if (len < 0) {
+		spe_errx(1, "Unable to format output\n");
+	}
+
+	if ((size_t)len >= out->size - out->len) {
+		new_size = out->size * 2;
+		if (new_size < out->len + len + 1) {
+			new_size = out->len + len + 1;
+		}
+		tmp = realloc(out->buf, new_size);
+		if (tmp == NULL) {
+			spe_errx(1, "Unable to allocate %zu bytes\n", new_size);
+		}
+		out->buf = tmp;
+		out->size = new_size;
+
+		va_start(args, fmt);
+		vsnprintf(out->buf + out->len, out->size - out->len, fmt, args);
+		va_end(args);
+	}
+	out->len += len;
+}
+
+static void
+address_symbol(struct output *out, uint64_t addr)
+{
+	struct sym_result res;
+	char name[512];
+
+	if (sym_lookup(&symbols, &out->cache, addr, &res)) {
+		sym_format(&res, addr, name, sizeof(name));
+		out_printf(out, "Sym: %s ", name);
+	}
+}
+
 static void
 address_packet(struct spe_decode_ctx *ctx, void *priv, spe_packet_type type,
     uint16_t header, uint64_t data)
 {
+	struct output *out;
 	int index;
 
 	(void)ctx;
-	(void)priv;
 	(void)type;
 
-	printf("Address ");
+	out = priv;
+	out_printf(out, "Address ");
 
 	index = SPE_ADDRESS_INDEX(header);
 	switch (index) {
@@ -113,24 +281,29 @@ address_packet(struct spe_decode_ctx *ctx, void *priv, spe_packet_type type,
 	case SPE_ADDRESS_IDX_DATA_VA:
 	case SPE_ADDRESS_IDX_DATA_PA:
 	case SPE_ADDRESS_IDX_PREV_B_TARGET:
-		printf("Index: %x ", index);
-		printf("Addr: %"PRIx64" ", SPE_ADDRESS_ADDR_SE(data));
+		out_printf(out, "Index: %x ", index);
+		out_printf(out, "Addr: %"PRIx64" ", SPE_ADDRESS_ADDR_SE(data));
 		if (index == SPE_ADDRESS_IDX_DATA_VA) {
-			printf("Tag: %"PRIx64" ", SPE_ADDRESS_TAG(data));
+			out_printf(out, "Tag: %"PRIx64" ",
+			    SPE_ADDRESS_TAG(data));
 		} else if (index == SPE_ADDRESS_IDX_DATA_PA) {
-			printf("NS: %"PRIx64" Checked: %s Phys tag: %"PRIx64" ",
+			out_printf(out,
+			    "NS: %"PRIx64" Checked: %s Phys tag: %"PRIx64" ",
 			    SPE_ADDRESS_NS(data),
 			    (SPE_ADDRESS_CH(data) != 0) ? "true" : "false",
 			    SPE_ADDRESS_PAT(data));
 		} else {
-			printf("NS: %"PRIx64" EL: %"PRIx64" ",
+			out_printf(out, "NS: %"PRIx64" EL: %"PRIx64" ",
 			    SPE_ADDRESS_NS(data),
 			    SPE_ADDRESS_EL(data));
+			if (have_symbols) {
+				address_symbol(out, SPE_ADDRESS_ADDR_SE(data));
+			}
 		}
-		printf("\n");
+		out_printf(out, "\n");
 		break;
 	default:
-		printf("Unknown Index: %x\n", index);
+		out_printf(out, "Unknown Index: %x\n", index);
 		break;
 	};
 }
@@ -140,11 +313,10 @@ context_packet(struct spe_decode_ctx *ctx, void *priv, spe_packet_type type,
     uint16_t header, uint64_t data)
 {
 	(void)ctx;
-	(void)priv;
 	(void)type;
 	(void)header;
 
-	printf("Context: %"PRIx64"\n", data);
+	out_printf(priv, "Context: %"PRIx64"\n", data);
 }
 
 static void
@@ -152,11 +324,10 @@ counter_packet(struct spe_decode_ctx *ctx, void *priv, spe_packet_type type,
     uint16_t header, uint64_t data)
 {
 	(void)ctx;
-	(void)priv;
 	(void)type;
 
-	printf("Counter: %"PRIx16" %"PRIu64"\n", SPE_COUNTER_INDEX(header),
-	    data);
+	out_printf(priv, "Counter: %"PRIx16" %"PRIu64"\n",
+	    SPE_COUNTER_INDEX(header), data);
 }
 
 static void
@@ -164,11 +335,10 @@ data_source_packet(struct spe_decode_ctx *ctx, void *priv, spe_packet_type type,
     uint16_t header, uint64_t data)
 {
 	(void)ctx;
-	(void)priv;
 	(void)type;
 	(void)header;
 
-	printf("Data source: %"PRIx64"\n", data);
+	out_printf(priv, "Data source: %"PRIx64"\n", data);
 }
 
 static void
@@ -176,12 +346,11 @@ end_packet(struct spe_decode_ctx *ctx, void *priv, spe_packet_type type,
     uint16_t header, uint64_t data)
 {
 	(void)ctx;
-	(void)priv;
 	(void)type;
 	(void)header;
 	(void)data;
 
-	printf("===\n");
+	out_printf(priv, "===\n");
 }
 
 static void
@@ -189,11 +358,10 @@ events_packet(struct spe_decode_ctx *ctx, void *priv, spe_packet_type type,
     uint16_t header, uint64_t data)
 {
 	(void)ctx;
-	(void)priv;
 	(void)type;
 	(void)header;
 
-	printf("Events: %"PRIx64"\n", data);
+	out_printf(priv, "Events: %"PRIx64"\n", data);
 }
 
 static void
@@ -201,10 +369,9 @@ operation_packet(struct spe_decode_ctx *ctx, void *priv, spe_packet_type type,
     uint16_t header, uint64_t data)
 {
 	(void)ctx;
-	(void)priv;
 	(void)type;
 
-	printf("Operation type: Class: %"PRIx16" Subclass: %"PRIx64"\n",
+	out_printf(priv, "Operation type: Class: %"PRIx16" Subclass: %"PRIx64"\n",
 	    SPE_OPERATION_TYPE_CLASS(header),
 	    data);
 }
@@ -214,13 +381,12 @@ timestamp_packet(struct spe_decode_ctx *ctx, void *priv, spe_packet_type type,
     uint16_t header, uint64_t data)
 {
 	(void)ctx;
-	(void)priv;
 	(void)type;
 	(void)header;
 
-	printf("Timestamp: %"PRId64"\n", data);
+	out_printf(priv, "Timestamp: %"PRId64"\n", data);
 	/* This is the last packet in this record (if enabled) */
-	printf("===\n");
+	out_printf(priv, "===\n");
 }
 
 static void
@@ -228,113 +394,1276 @@ packet(struct spe_decode_ctx *ctx, void *priv, spe_packet_type type,
     uint16_t header, uint64_t data)
 {
 	(void)ctx;
-	(void)priv;
 	(void)type;
 
-	printf("header: %"PRIx16" data: %"PRIx64"\n", header, data);
+	out_printf(priv, "header: %"PRIx16" data: %"PRIx64"\n", header, data);
 }
 
 static void
-process(struct spe_decode_ctx *ctx, const char *file)
+set_callbacks(struct spe_decode_ctx *ctx)
 {
+	spe_packet_decode_set_callback(ctx, SPE_PKT_INVALID, packet);
+	spe_packet_decode_set_callback(ctx, SPE_PKT_UNKNOWN, packet);
+	spe_packet_decode_set_callback(ctx, SPE_PKT_ADDRESS, address_packet);
+	spe_packet_decode_set_callback(ctx, SPE_PKT_CONTEXT, context_packet);
+	spe_packet_decode_set_callback(ctx, SPE_PKT_COUNTER, counter_packet);
+	spe_packet_decode_set_callback(ctx, SPE_PKT_DATA_SOURCE,
+	    data_source_packet);
+	spe_packet_decode_set_callback(ctx, SPE_PKT_END, end_packet);
+	spe_packet_decode_set_callback(ctx, SPE_PKT_EVENTS, events_packet);
+	spe_packet_decode_set_callback(ctx, SPE_PKT_OPERATION_TYPE,
+	    operation_packet);
+	spe_packet_decode_set_callback(ctx, SPE_PKT_PADDING, packet);
+	spe_packet_decode_set_callback(ctx, SPE_PKT_TIMESTAMP,
+	    timestamp_packet);
+}
+
+static void
+log_print(void)
+{
+	struct spe_log_entry entry;
+
+	if (log_ring == NULL) {
+		return;
+	}
+
+	while (spe_log_ring_read(log_ring, &entry)) {
+		fprintf(stderr, "%s\n", entry.msg);
+	}
+}
+
+static void *
+chunk_start(struct spe_decode_ctx *ctx, void *priv, size_t idx)
+{
+	(void)priv;
+	(void)idx;
+
+	set_callbacks(ctx);
+	return (calloc(1, sizeof(struct output)));
+}
+
+static void
+chunk_discard(void *priv, size_t idx, void *data)
+{
+	struct output *out;
+
+	(void)priv;
+	(void)idx;
+
+	out = data;
+	free(out->buf);
+	free(out);
+}
+
+static void
+chunk_done(void *priv, size_t idx, void *data)
+{
+	struct output *out;
+
+	out = data;
+	if (out->len > 0) {
+		fwrite(out->buf, 1, out->len, stdout);
+	}
+	chunk_discard(priv, idx, data);
+	log_print();
+}
+
+static const struct spe_parallel_ops parallel_ops = {
+	.chunk_start = chunk_start,
+	.chunk_done = chunk_done,
+	.chunk_discard = chunk_discard,
+};
+
+static void
+summary_init(struct summary *sum)
+{
+	if (top_count > 0) {
+		top_init(&sum->top);
+	}
+	if (latency_mode) {
+		latency_init(&sum->latency, latency_by);
+	}
+	if (mem_count > 0) {
+		mem_init(&sum->mem, mem_pa);
+	}
+}
+
+static void
+summary_fini(struct summary *sum)
+{
+	if (top_count > 0) {
+		top_fini(&sum->top);
+	}
+	if (latency_mode) {
+		latency_fini(&sum->latency);
+	}
+	if (mem_count > 0) {
+		mem_fini(&sum->mem);
+	}
+	free(sum->recs);
+	free(sum->skips);
+}
+
+/*
+ * Add a skipped range. Ranges are found in order, a range split between
+ * chunks is joined back together.
+ */
+static void
+summary_skip(struct summary *sum, uint64_t start, uint64_t end)
+{
+	struct skip *skips;
+	size_t size;
+
+	if (sum->nskips > 0 && sum->skips[sum->nskips - 1].end == start) {
+		sum->skips[sum->nskips - 1].end = end;
+		return;
+	}
+
+	if (sum->nskips == sum->skips_size) {
+		size = sum->skips_size == 0 ? 16 : sum->skips_size * 2;
+		skips = realloc(sum->skips, size * sizeof(*skips));
+		if (skips == NULL) {
+			spe_errx(1, "Unable to allocate %zu ranges\n", size);
+		}
+		sum->skips = skips;
+		sum->skips_size = size;
+	}
+
+	sum->skips[sum->nskips].start = start;
+	sum->skips[sum->nskips].end = end;
+	sum->nskips++;
+}
+
+static void
+resync_cb(struct spe_decode_ctx *ctx, void *data, uint64_t start,
+    uint64_t end)
+{
+	(void)ctx;
+
+	summary_skip(data, start, end);
+}
+
+static void
+skips_print(const struct summary *sum, FILE *fp)
+{
+	uint64_t total;
+
+	total = 0;
+	for (size_t i = 0; i < sum->nskips; i++) {
+		fprintf(fp, "Skipped %" PRIu64 " bytes at 0x%" PRIx64
+		    " - 0x%" PRIx64 "\n", sum->skips[i].end - sum->skips[i].start,
+		    sum->skips[i].start, sum->skips[i].end);
+		total += sum->skips[i].end - sum->skips[i].start;
+	}
+	if (sum->nskips > 0) {
+		fprintf(fp, "Skipped %" PRIu64 " bytes in %zu ranges\n", total,
+		    sum->nskips);
+	}
+}
+
+static bool
+recfile_write(void *data, const void *buf, size_t len)
+{
+	return (fwrite(buf, 1, len, data) == len);
+}
+
+/*
+ * Open the record file, - is stdout. The records are written in blocks so
+ * the file can be written to a pipe.
+ */
+static void
+recfile_open(void)
+{
+	FILE *fp;
+
+	if (strcmp(recfile_name, "-") == 0) {
+		fp = stdout;
+	} else {
+		fp = fopen(recfile_name, "wb");
+		if (fp == NULL) {
+			spe_err(1, "Unable to open \"%s\"", recfile_name);
+		}
+	}
+
+	recfile = spe_recfile_writer_alloc(recfile_write, fp);
+	if (recfile == NULL) {
+		spe_err(1, "Unable to write to \"%s\"", recfile_name);
+	}
+	recfile_fp = fp;
+}
+
+static void
+recfile_close(void)
+{
+	if (!spe_recfile_writer_free(recfile) ||
+	    (recfile_fp != stdout && fclose(recfile_fp) != 0)) {
+		spe_err(1, "Unable to write to \"%s\"", recfile_name);
+	}
+	recfile = NULL;
+}
+
+/*
+ * Print a record in the same format as the packets it was decoded from.
+ * The packets are printed in a fixed order rather than as they were found
+ * in the data, and only packets that are part of a record are printed.
+ */
+static void
+print_record(struct output *out, const struct spe_record *rec)
+{
+	static const int addrs[] = {
+		SPE_ADDRESS_IDX_PC_VA,
+		SPE_ADDRESS_IDX_B_TARGET,
+		SPE_ADDRESS_IDX_PREV_B_TARGET,
+		SPE_ADDRESS_IDX_DATA_VA,
+		SPE_ADDRESS_IDX_DATA_PA,
+	};
+
+	/* The headers passed are only used for the index or class */
+	for (size_t i = 0; i < sizeof(addrs) / sizeof(addrs[0]); i++) {
+		if ((rec->present & SPE_RECORD_ADDR(addrs[i])) != 0) {
+			address_packet(NULL, out, SPE_PKT_ADDRESS,
+			    0xb0 | addrs[i], rec->addr[addrs[i]]);
+		}
+	}
+	if ((rec->present & SPE_RECORD_CONTEXT) != 0) {
+		context_packet(NULL, out, SPE_PKT_CONTEXT, 0x64,
+		    rec->context);
+	}
+	if ((rec->present & SPE_RECORD_OPERATION_TYPE) != 0) {
+		operation_packet(NULL, out, SPE_PKT_OPERATION_TYPE,
+		    0x48 | rec->op_class, rec->op_subclass);
+	}
+	if ((rec->present & SPE_RECORD_EVENTS) != 0) {
+		events_packet(NULL, out, SPE_PKT_EVENTS, 0x62, rec->events);
+	}
+	for (int i = 0; i < SPE_RECORD_COUNTER_MAX; i++) {
+		if ((rec->present & SPE_RECORD_COUNTER(i)) != 0) {
+			counter_packet(NULL, out, SPE_PKT_COUNTER, 0x98 | i,
+			    rec->counter[i]);
+		}
+	}
+	if ((rec->present & SPE_RECORD_DATA_SOURCE) != 0) {
+		data_source_packet(NULL, out, SPE_PKT_DATA_SOURCE, 0x43,
+		    rec->data_source);
+	}
+	if ((rec->present & SPE_RECORD_END) != 0) {
+		end_packet(NULL, out, SPE_PKT_END, 0x01, 0);
+	}
+	if ((rec->present & SPE_RECORD_TIMESTAMP) != 0) {
+		timestamp_packet(NULL, out, SPE_PKT_TIMESTAMP, 0x71,
+		    rec->timestamp);
+	}
+}
+
+/* Write or print a record, in the order they are in the data */
+static void
+emit_record(const struct spe_record *rec)
+{
+	if (recfile != NULL && !spe_recfile_write(recfile, rec)) {
+		spe_err(1, "Unable to write to \"%s\"", recfile_name);
+	}
+	if (print_records) {
+		if ((rec->present & SPE_RECORD_SOURCE) != 0) {
+			out_printf(&stdout_output, "CPU: %"PRIu32"\n",
+			    rec->source);
+		}
+		print_record(&stdout_output, rec);
+	}
+}
+
+static void
+summary_keep(struct summary *sum, const struct spe_record *rec)
+{
+	struct spe_record *recs;
+	size_t size;
+
+	if (sum->nrecs == sum->recs_size) {
+		size = sum->recs_size == 0 ? 1024 : sum->recs_size * 2;
+		recs = realloc(sum->recs, size * sizeof(*recs));
+		if (recs == NULL) {
+			spe_errx(1, "Unable to allocate %zu records\n", size);
+		}
+		sum->recs = recs;
+		sum->recs_size = size;
+	}
+
+	sum->recs[sum->nrecs++] = *rec;
+}
+
+static void
+handle_record(struct summary *sum, const struct spe_record *rec)
+{
+	if (filter != NULL && !spe_filter_match(filter, rec)) {
+		return;
+	}
+
+	if (top_count > 0) {
+		top_add(&sum->top, rec);
+	}
+	if (latency_mode) {
+		latency_add(&sum->latency, rec);
+	}
+	if (mem_count > 0) {
+		mem_add(&sum->mem, rec);
+	}
+	if (recfile_name != NULL || print_records) {
+		if (sum->chunk) {
+			summary_keep(sum, rec);
+		} else {
+			emit_record(rec);
+		}
+	}
+}
+
+static void
+decode_records(struct spe_decode_ctx *ctx, struct summary *sum)
+{
+	struct spe_record recs[64];
+	size_t count;
+
+	while ((count = spe_record_decode_batch(ctx, recs,
+	    sizeof(recs) / sizeof(recs[0]))) > 0) {
+		for (size_t i = 0; i < count; i++) {
+			handle_record(sum, &recs[i]);
+		}
+		log_print();
+	}
+}
+
+static void *
+record_chunk_start(struct spe_decode_ctx *ctx, void *priv, size_t idx)
+{
+	struct summary *sum;
+
+	(void)ctx;
+	(void)priv;
+	(void)idx;
+
+	sum = calloc(1, sizeof(*sum));
+	if (sum != NULL) {
+		summary_init(sum);
+		sum->chunk = true;
+	}
+	return (sum);
+}
+
+static void
+record_chunk_discard(void *priv, size_t idx, void *data)
+{
+	(void)priv;
+	(void)idx;
+
+	summary_fini(data);
+	free(data);
+}
+
+static void
+record_chunk_done(void *priv, size_t idx, void *data)
+{
+	struct summary *dst, *src;
+
+	dst = priv;
+	src = data;
+	if (top_count > 0) {
+		top_merge(&dst->top, &src->top);
+	}
+	if (latency_mode) {
+		latency_merge(&dst->latency, &src->latency);
+	}
+	if (mem_count > 0) {
+		mem_merge(&dst->mem, &src->mem);
+	}
+	for (size_t i = 0; i < src->nrecs; i++) {
+		emit_record(&src->recs[i]);
+	}
+	for (size_t i = 0; i < src->nskips; i++) {
+		summary_skip(dst, src->skips[i].start, src->skips[i].end);
+	}
+	record_chunk_discard(priv, idx, data);
+	log_print();
+}
+
+static bool
+record_decode_next(struct spe_decode_ctx *ctx, void *data)
+{
+	struct spe_record rec;
+
+	if (!spe_record_decode_next(ctx, &rec)) {
+		return (false);
+	}
+
+	handle_record(data, &rec);
+	return (true);
+}
+
+static const struct spe_parallel_ops record_parallel_ops = {
+	.chunk_start = record_chunk_start,
+	.chunk_done = record_chunk_done,
+	.chunk_discard = record_chunk_discard,
+	.decode_next = record_decode_next,
+};
+
+static struct spe_decode_ctx *
+decode_ctx_alloc(void)
+{
+	struct spe_decode_ctx *ctx;
+
+	ctx = spe_decode_ctx_alloc();
+	if (ctx == NULL) {
+		spe_errx(1, "Unable to allocate a decode context");
+	}
+
+	if (log_ring != NULL) {
+		spe_decode_ctx_set_log_level(ctx, log_level);
+		spe_decode_ctx_set_log_cb(ctx, spe_log_ring_cb, log_ring);
+	}
+
+	if (resync_mode) {
+		spe_decode_ctx_set_resync_cb(ctx, resync_cb);
+	}
+
+	if (record_mode) {
+		/* Passed to record_decode_next when decoding in parallel */
+		spe_packet_decode_set_callback_data(ctx, &summary);
+	} else {
+		spe_packet_decode_set_callback_data(ctx, &stdout_output);
+		set_callbacks(ctx);
+	}
+
+	return (ctx);
+}
+
+static void
+decode(struct spe_decode_ctx *ctx, const char *file, unsigned int nthreads)
+{
+	size_t count;
+
+	if (record_mode && nthreads > 1) {
+		if (!spe_decode_parallel(ctx, 0, nthreads,
+		    &record_parallel_ops, &summary)) {
+			spe_errx(1, "Unable to decode \"%s\"", file);
+		}
+	} else if (record_mode) {
+		decode_records(ctx, &summary);
+	} else if (nthreads > 1) {
+		if (!spe_decode_parallel(ctx, SPE_PACKET_DECODE_SKIP_PADDING,
+		    nthreads, &parallel_ops, NULL)) {
+			spe_errx(1, "Unable to decode \"%s\"", file);
+		}
+	} else {
+		count = 0;
+		while (spe_packet_decode_next(ctx,
+		    SPE_PACKET_DECODE_SKIP_PADDING)) {
+			if (++count % LOG_DRAIN_PACKETS == 0) {
+				log_print();
+			}
+		}
+	}
+}
+
+/*
+ * The block size when streaming data. The blocks are read, and if needed
+ * decompressed, on a separate thread while the previous block is decoded.
+ */
+#define	STREAM_BUF_SIZE		(1024 * 1024)
+#define	STREAM_BUF_SIZE_MAX	(256 * 1024 * 1024)
+
+/*
+ * Read the data in fixed size blocks, decoding each as it is read. This
+ * works on pipes and keeps the memory used independent of the file size.
+ */
+static void
+process_stream(struct spe_decode_ctx *ctx, int fd, const char *file,
+    unsigned int nthreads)
+{
+	struct spe_reader *reader;
+	size_t buf_size;
+
+	/* Give each thread a few chunks to decode */
+	buf_size = STREAM_BUF_SIZE;
+	if (io_block > 0) {
+		buf_size = io_block;
+	} else if (nthreads > 1) {
+		buf_size *= (size_t)nthreads * 4;
+		if (buf_size > STREAM_BUF_SIZE_MAX) {
+			buf_size = STREAM_BUF_SIZE_MAX;
+		}
+	}
+
+	reader = spe_reader_alloc_fd(fd, buf_size, io_depth);
+	if (reader == NULL) {
+		spe_errx(1, "Unable to allocate %zu byte buffers\n", buf_size);
+	}
+	while (spe_reader_add(reader, ctx)) {
+		decode(ctx, file, nthreads);
+	}
+	if (spe_reader_error(reader) != NULL) {
+		spe_errx(1, "Unable to read \"%s\": %s\n", file,
+		    spe_reader_error(reader));
+	}
+
+	/* Copy any incomplete packet so the buffers can be freed */
+	if (!spe_reader_free(reader, ctx)) {
+		spe_errx(1, "Unable to release buffer from the context");
+	}
+}
+
+#if defined(SPE_MMAP)
+/* The packets from each AUX buffer in a perf.data file */
+struct perf_stream {
+	uint32_t idx;
+	struct spe_decode_ctx *ctx;
+};
+
+/*
+ * Decode the AUX data in a mapped perf.data file. Each AUX buffer has its
+ * own context as a packet may continue into the next AUXTRACE record from
+ * the same buffer. The data is added to the contexts without copying it.
+ */
+static void
+process_perf(const void *buf, size_t len, const char *file,
+    unsigned int nthreads)
+{
+	struct spe_perf perf;
+	struct spe_perf_aux_data aux;
+	struct perf_stream *streams, *stream;
+	struct spe_record rec;
+	size_t nstreams;
+
+	if (!spe_perf_open(&perf, buf, len)) {
+		spe_errx(1, "Unsupported perf.data file \"%s\"", file);
+	}
+
+	streams = NULL;
+	nstreams = 0;
+	while (spe_perf_next_aux(&perf, &aux)) {
+		stream = NULL;
+		for (size_t i = 0; i < nstreams; i++) {
+			if (streams[i].idx == aux.idx) {
+				stream = &streams[i];
+				break;
+			}
+		}
+		if (stream == NULL) {
+			streams = realloc(streams,
+			    (nstreams + 1) * sizeof(*streams));
+			if (streams == NULL) {
+				spe_errx(1, "Unable to allocate a stream");
+			}
+			stream = &streams[nstreams++];
+			stream->idx = aux.idx;
+			stream->ctx = decode_ctx_alloc();
+		}
+
+		if (!record_mode) {
+			fprintf(stdout, "AUX idx %"PRIu32" cpu %"PRId32
+			    " offset %"PRIx64" size %zx\n", aux.idx,
+			    (int32_t)aux.cpu, aux.offset, aux.size);
+		}
+
+		/* The buffer is only read so won't be modified */
+		if (!spe_decode_ctx_add(stream->ctx, 0,
+		    (void *)(uintptr_t)aux.data, aux.size)) {
+			spe_errx(1,
+			    "Unable to add data from \"%s\" to the context",
+			    file);
+		}
+		decode(stream->ctx, file, nthreads);
+	}
+	/* Keep what was decoded, e.g. when perf was killed while writing */
+	if (perf.error) {
+		fprintf(stderr, "Stopped at an invalid perf.data record in "
+		    "\"%s\"\n", file);
+	}
+	if (perf.truncated > 0) {
+		fprintf(stderr, "%"PRIu64" AUX records in \"%s\" were "
+		    "truncated\n", perf.truncated, file);
+	}
+
+	/* Finish the last record from each buffer */
+	for (size_t i = 0; i < nstreams; i++) {
+		if (record_mode) {
+			decode_records(streams[i].ctx, &summary);
+			while (spe_record_decode_flush(streams[i].ctx, &rec)) {
+				handle_record(&summary, &rec);
+			}
+		}
+		spe_decode_ctx_free(streams[i].ctx);
+	}
+	free(streams);
+}
+#endif
+
+#if defined(SPE_MMAP)
+/*
+ * Files are mapped a window at a time so the memory used doesn't depend on
+ * the size of the file. The window after the one being decoded is mapped
+ * early so the kernel can read it in while the current window is decoded.
+ * When a file is larger than a window the pages are dropped from the page
+ * cache once decoded so a large trace doesn't push out everything else.
+ */
+/* The window held by the context, the one being decoded, and the next */
+#define	MAP_WINDOWS		3
+
+struct map_window {
+	void *buf;
+	uint64_t off;
+	size_t len;
+};
+
+struct map_stream {
+	int fd;
+	bool drop;
+	struct map_window windows[MAP_WINDOWS];
+	int nwindows;
+};
+
+static void *
+map_window(struct map_stream *ms, uint64_t off, size_t len, const char *file)
+{
+	uint8_t *buf;
+#if defined(MADV_HUGEPAGE)
+	uint8_t *base;
+	size_t page, pad, rlen, plen;
+
+	/* Reserve enough space to place the window on an aligned address */
+	rlen = (len + MAP_ALIGN - 1) / MAP_ALIGN * MAP_ALIGN + MAP_ALIGN;
+	base = mmap(NULL, rlen, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+	    0);
+	if (base == MAP_FAILED) {
+		spe_err(1, "Unable to mmap \"%s\"", file);
+	}
+	pad = (MAP_ALIGN - ((uintptr_t)base & (MAP_ALIGN - 1))) &
+	    (MAP_ALIGN - 1);
+	buf = mmap(base + pad, len, PROT_READ, MAP_SHARED | MAP_FIXED,
+	    ms->fd, (off_t)off);
+	if (buf == MAP_FAILED) {
+		spe_err(1, "Unable to mmap \"%s\"", file);
+	}
+	/* Unmap the rest of the reserved space */
+	page = (size_t)sysconf(_SC_PAGESIZE);
+	plen = (len + page - 1) / page * page;
+	if (pad > 0) {
+		munmap(base, pad);
+	}
+	if (rlen - pad - plen > 0) {
+		munmap(buf + plen, rlen - pad - plen);
+	}
+	/* Only a hint, this fails when huge pages aren't supported */
+	madvise(buf, len, MADV_HUGEPAGE);
+#else
+	buf = mmap(NULL, len, PROT_READ, MAP_SHARED, ms->fd, (off_t)off);
+	if (buf == MAP_FAILED) {
+		spe_err(1, "Unable to mmap \"%s\"", file);
+	}
+#endif
+	madvise(buf, len, MADV_SEQUENTIAL);
+
+	assert(ms->nwindows < MAP_WINDOWS);
+	ms->windows[ms->nwindows].buf = buf;
+	ms->windows[ms->nwindows].off = off;
+	ms->windows[ms->nwindows].len = len;
+	ms->nwindows++;
+
+	return (buf);
+}
+
+static void
+map_release(struct spe_decode_ctx *ctx, void *priv, void *buf, size_t len)
+{
+	struct map_stream *ms;
+	uint64_t off;
+
+	(void)ctx;
+
+	ms = priv;
+	off = 0;
+	for (int i = 0; i < ms->nwindows; i++) {
+		if (ms->windows[i].buf == buf) {
+			off = ms->windows[i].off;
+			ms->windows[i] = ms->windows[--ms->nwindows];
+			break;
+		}
+	}
+
+	munmap(buf, len);
+#if defined(POSIX_FADV_DONTNEED)
+	if (ms->drop) {
+		posix_fadvise(ms->fd, (off_t)off, (off_t)len,
+		    POSIX_FADV_DONTNEED);
+	}
+#else
+	(void)off;
+#endif
+}
+
+static void
+process_mapped(struct spe_decode_ctx *ctx, int fd, uint64_t size,
+    const char *file, unsigned int nthreads)
+{
+	struct map_stream ms;
+	size_t len, next_len;
+	uint64_t off;
+	void *buf, *next;
+
+	memset(&ms, 0, sizeof(ms));
+	ms.fd = fd;
+	ms.drop = size > map_window_size;
+	spe_decode_ctx_set_release_cb(ctx, map_release, &ms);
+
+	off = 0;
+	len = size < map_window_size ? (size_t)size : map_window_size;
+	buf = map_window(&ms, 0, len, file);
+	while (buf != NULL) {
+		/* Map the next window and start reading it in */
+		next = NULL;
+		next_len = 0;
+		if (size - off > len) {
+			next_len = size - off - len < map_window_size ?
+			    (size_t)(size - off - len) : map_window_size;
+			next = map_window(&ms, off + len, next_len, file);
+			madvise(next, next_len, MADV_WILLNEED);
+		}
+
+		if (!spe_decode_ctx_add(ctx, 0, buf, len)) {
+			spe_errx(1,
+			    "Unable to add data from \"%s\" to the context",
+			    file);
+		}
+		decode(ctx, file, nthreads);
+
+		off += len;
+		buf = next;
+		len = next_len;
+	}
+
+	/* Copy any incomplete packet so the windows can be unmapped */
+	spe_decode_ctx_set_release_cb(ctx, NULL, NULL);
+	while (ms.nwindows > 0) {
+		buf = ms.windows[0].buf;
+		if (!spe_decode_ctx_release(ctx, buf)) {
+			spe_errx(1,
+			    "Unable to release buffer from the context");
+		}
+		map_release(ctx, &ms, buf, ms.windows[0].len);
+	}
+}
+#endif
+
+static void
+process(struct spe_decode_ctx *ctx, const char *file, unsigned int nthreads)
+{
+#if defined(SPE_MMAP)
+	uint8_t magic[8];
 	struct stat sb;
+	ssize_t len;
 	void *buf;
-	int error, fd;
-#if !defined(SPE_MMAP)
-	char *cur;
-	size_t remaining;
+	int error;
 #endif
+	int fd;
+
+	if (strcmp(file, "-") == 0) {
+#if defined(_MSC_VER)
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		process_stream(ctx, fileno(stdin), "stdin", nthreads);
+		return;
+	}
 
 	fd = open(file, O_RDONLY | O_CLOEXEC);
 	if (fd == -1) {
 		spe_err(1, "Unable to open \"%s\"", file);
 	}
 
+#if defined(SPE_MMAP)
 	error = fstat(fd, &sb);
 	if (error == -1) {
 		spe_err(1, "Unable to stat \"%s\"", file);
 	}
 
-#if defined(SPE_MMAP)
-	buf = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (buf == MAP_FAILED) {
-		spe_err(1, "Unable to mmap \"%s\"", file);
+	/* Stream anything that can't be mapped, e.g. a named pipe */
+	if (S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		len = pread(fd, magic, sizeof(magic), 0);
+		if (len == -1) {
+			spe_err(1, "Unable to read \"%s\"", file);
+		}
+
+		/* Compressed data is decompressed as it's read */
+		if (spe_compress_detect(magic, (size_t)len) !=
+		    SPE_COMPRESS_NONE) {
+			process_stream(ctx, fd, file, nthreads);
+			close(fd);
+			return;
+		}
+
+		/* perf.data files are mapped whole as they aren't sequential */
+		if (len == 8 && memcmp(magic, "PERFILE2", 8) == 0) {
+			buf = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd,
+			    0);
+			if (buf == MAP_FAILED) {
+				spe_err(1, "Unable to mmap \"%s\"", file);
+			}
+			process_perf(buf, sb.st_size, file, nthreads);
+			munmap(buf, sb.st_size);
+			close(fd);
+			return;
+		}
+
+		process_mapped(ctx, fd, (uint64_t)sb.st_size, file, nthreads);
+		close(fd);
+		return;
 	}
-#else
-	buf = calloc(sb.st_size, 1);
-	if (buf == NULL) {
-		spe_err(1, "Unable to allocate %zu bytes", sb.st_size);
+#endif
+
+	process_stream(ctx, fd, file, nthreads);
+	close(fd);
+}
+
+/*
+ * Each file being merged is read in smaller blocks than when decoding a
+ * single file as there may be one for each CPU.
+ */
+#define	MERGE_BUF_SIZE		(256 * 1024)
+struct merge_input {
+	struct spe_reader *reader;
+	const char *file;
+	int fd;
+};
+
+static bool
+merge_fill(struct spe_decode_ctx *ctx, void *data)
+{
+	struct merge_input *input;
+
+	input = data;
+	if (spe_reader_add(input->reader, ctx)) {
+		return (true);
+	}
+	if (spe_reader_error(input->reader) != NULL) {
+		spe_errx(1, "Unable to read \"%s\": %s\n", input->file,
+		    spe_reader_error(input->reader));
 	}
-	remaining = sb.st_size;
-	cur = buf;
-	while (remaining > 0) {
-		read_t read_len;
+	return (false);
+}
 
-		read_len = read(fd, cur, remaining);
-		if (read_len == -1) {
-			spe_err(1, "Unable to read from \"%s\"", file);
-		}
-		assert((size_t)read_len <= remaining);
-		remaining -= read_len;
-		cur += read_len;
+/*
+ * Decode the files together, handling the records in timestamp order.
+ * Each file has its own context so a file's records are kept in order,
+ * the index of the file is used as its CPU number. Returns false if the
+ * library doesn't keep statistics.
+ */
+static bool
+process_merge(char *files[], size_t nfiles, struct spe_decode_stats *stats)
+{
+	struct merge_input *inputs, *input;
+	struct spe_decode_stats ctx_stats;
+	struct spe_decode_ctx *ctx;
+	struct spe_record rec;
+	struct merge merge;
+	size_t count, idx;
+	bool have_stats;
+
+	inputs = calloc(nfiles, sizeof(*inputs));
+	if (inputs == NULL) {
+		spe_errx(1, "Unable to allocate %zu inputs\n", nfiles);
 	}
+
+	merge_init(&merge, merge_fill, nfiles);
+	for (size_t i = 0; i < nfiles; i++) {
+		input = &inputs[i];
+		if (strcmp(files[i], "-") == 0) {
+#if defined(_MSC_VER)
+			_setmode(_fileno(stdin), _O_BINARY);
 #endif
+			input->file = "stdin";
+			input->fd = fileno(stdin);
+		} else {
+			input->file = files[i];
+			input->fd = open(files[i], O_RDONLY | O_CLOEXEC);
+			if (input->fd == -1) {
+				spe_err(1, "Unable to open \"%s\"", files[i]);
+			}
+		}
 
-	if (!spe_decode_ctx_add(ctx, 0, buf, sb.st_size)) {
-		spe_errx(1, "Unable to add data from \"%s\" to the context",
-		    file);
+		input->reader = spe_reader_alloc_fd(input->fd,
+		    io_block > 0 ? io_block : MERGE_BUF_SIZE, io_depth);
+		if (input->reader == NULL) {
+			spe_errx(1, "Unable to allocate the read buffers\n");
+		}
+		merge_set_source(&merge, i, decode_ctx_alloc(), input);
 	}
 
-	while (spe_packet_decode_next(ctx, SPE_PACKET_DECODE_SKIP_PADDING)) {
-		/* Do nada */
+	count = 0;
+	while (merge_next(&merge, &rec, &idx)) {
+		/* Keep the file with the record, e.g. when writing it out */
+		rec.source = (uint32_t)idx;
+		rec.present |= SPE_RECORD_SOURCE;
+		handle_record(&summary, &rec);
+		if (++count % MERGE_WINDOW == 0) {
+			log_print();
+		}
 	}
 
-	if (!spe_decode_ctx_release(ctx, buf)) {
-		spe_errx(1, "Unable to release buffer from the context");
+	memset(stats, 0, sizeof(*stats));
+	have_stats = true;
+	for (size_t i = 0; i < nfiles; i++) {
+		ctx = merge.sources[i].ctx;
+		if (spe_decode_ctx_get_stats(ctx, &ctx_stats)) {
+			spe_decode_stats_merge(stats, &ctx_stats);
+		} else {
+			have_stats = false;
+		}
+		if (!spe_reader_free(inputs[i].reader, ctx)) {
+			spe_errx(1,
+			    "Unable to release buffer from the context");
+		}
+		spe_decode_ctx_free(ctx);
+		if (inputs[i].fd != fileno(stdin)) {
+			close(inputs[i].fd);
+		}
 	}
+	merge_fini(&merge);
+	free(inputs);
 
-#if defined(SPE_MMAP)
-	munmap(buf, sb.st_size);
+	return (have_stats);
+}
+
+/*
+ * Returns the value of an option, either in the same argument, e.g. -j4 or
+ * --top=10, or the next argument. Returns NULL if the argument isn't the
+ * named option.
+ */
+static const char *
+option_value(int argc, char *argv[], int *ip, const char *name)
+{
+	const char *arg;
+	size_t len;
+
+	len = strlen(name);
+	arg = argv[*ip];
+	if (strncmp(arg, name, len) != 0) {
+		return (NULL);
+	}
+
+	arg += len;
+	if (*arg == '\0') {
+		if (++*ip == argc) {
+			usage();
+		}
+		return (argv[*ip]);
+	}
+	/* Long options use an = to separate the value */
+	if (name[1] == '-') {
+		if (*arg != '=') {
+			return (NULL);
+		}
+		arg++;
+	}
+
+	return (arg);
+}
+
+static unsigned long
+option_number(const char *arg, unsigned long max, const char *what)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 0);
+	if (errno != 0 || *end != '\0' || val == 0 || val > max) {
+		spe_errx(1, "Invalid %s \"%s\"\n", what, arg);
+	}
+
+	return (val);
+}
+
+static double
+stats_time(void)
+{
+	struct timespec ts;
+
+#if defined(_MSC_VER)
+	timespec_get(&ts, TIME_UTC);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 #endif
+	return ((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
 
-	close(fd);
+/* stats is NULL when the library was built without SPE_STATS */
+static void
+stats_print(const struct spe_decode_stats *stats, double elapsed, FILE *fp)
+{
+	static const char *names[SPE_PKT_MAX] = {
+		[SPE_PKT_INVALID] = "Invalid",
+		[SPE_PKT_UNKNOWN] = "Unknown",
+		[SPE_PKT_ADDRESS] = "Address",
+		[SPE_PKT_CONTEXT] = "Context",
+		[SPE_PKT_COUNTER] = "Counter",
+		[SPE_PKT_DATA_SOURCE] = "Data source",
+		[SPE_PKT_END] = "End",
+		[SPE_PKT_EVENTS] = "Events",
+		[SPE_PKT_OPERATION_TYPE] = "Operation type",
+		[SPE_PKT_PADDING] = "Padding",
+		[SPE_PKT_TIMESTAMP] = "Timestamp",
+	};
+	uint64_t packets;
 
+	if (elapsed <= 0.0) {
+		elapsed = 1e-9;
+	}
+	if (stats == NULL) {
+		fprintf(fp, "Decoded in %.3fs, the library was built without "
+		    "SPE_STATS\n", elapsed);
+		return;
+	}
+
+	fprintf(fp, "Decoded %" PRIu64 " of %" PRIu64 " bytes in %.3fs, "
+	    "%.1f MB/s\n", stats->bytes_decoded, stats->bytes_added, elapsed,
+	    (double)stats->bytes_decoded / elapsed / 1e6);
+	if (stats->records > 0) {
+		fprintf(fp, "Records:  %14" PRIu64 " %10.2f M/s\n",
+		    stats->records, (double)stats->records / elapsed / 1e6);
+	}
+	packets = 0;
+	for (size_t i = 0; i < SPE_PKT_MAX; i++) {
+		packets += stats->packets[i];
+	}
+	fprintf(fp, "Packets:  %14" PRIu64 " %10.2f M/s\n", packets,
+	    (double)packets / elapsed / 1e6);
+	for (size_t i = 0; i < SPE_PKT_MAX; i++) {
+		if (stats->packets[i] > 0) {
+			fprintf(fp, "  %-14s %12" PRIu64 "\n", names[i],
+			    stats->packets[i]);
+		}
+	}
+	fprintf(fp, "Padding:  %14" PRIu64 " bytes\n", stats->padding_bytes);
+	fprintf(fp, "Copied:   %14" PRIu64 " bytes in %" PRIu64
+	    " buffers\n", stats->copy_bytes, stats->copies);
+	fprintf(fp, "Stitched: %14" PRIu64 " bytes in %" PRIu64
+	    " packets\n", stats->stitch_bytes, stats->stitches);
+	if (stats->resyncs > 0) {
+		fprintf(fp, "Skipped:  %14" PRIu64 " bytes after %" PRIu64
+		    " bad records\n", stats->skipped_bytes, stats->resyncs);
+	}
 }
 
 int
 main(int argc, char *argv[])
 {
+	struct spe_decode_stats stats;
 	struct spe_decode_ctx *ctx;
+	struct spe_record rec;
+	unsigned long nthreads;
+	const char *arg;
+	char err[128];
+	double start;
+	bool have_stats;
+	int i;
+
+	nthreads = 1;
+	sym_table_init(&symbols);
+	/* Stop at the first file, - is stdin so is also a file */
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0';
+	    i++) {
+		if (strcmp(argv[i], "--") == 0) {
+			i++;
+			break;
+		}
+
+		if ((arg = option_value(argc, argv, &i, "-j")) != NULL) {
+			nthreads = option_number(arg, 1024, "thread count");
+		} else if ((arg = option_value(argc, argv, &i, "--top")) !=
+		    NULL) {
+			top_count = (unsigned int)option_number(arg, UINT_MAX,
+			    "top count");
+			record_mode = true;
+		} else if (strcmp(argv[i], "--latency") == 0) {
+			latency_mode = true;
+			record_mode = true;
+		} else if ((arg = option_value(argc, argv, &i,
+		    "--latency-by")) != NULL) {
+			if (strcmp(arg, "class") == 0) {
+				latency_by = LATENCY_BY_CLASS;
+			} else if (strcmp(arg, "source") == 0) {
+				latency_by = LATENCY_BY_SOURCE;
+			} else {
+				usage();
+			}
+			latency_mode = true;
+			record_mode = true;
+		} else if ((arg = option_value(argc, argv, &i, "--mem")) !=
+		    NULL) {
+			mem_count = (unsigned int)option_number(arg, UINT_MAX,
+			    "memory count");
+			record_mode = true;
+		} else if (strcmp(argv[i], "--mem-pa") == 0) {
+			mem_pa = true;
+		} else if ((arg = option_value(argc, argv, &i, "--sym")) !=
+		    NULL) {
+			sym_load_elf(&symbols, arg);
+			have_symbols = true;
+		} else if ((arg = option_value(argc, argv, &i, "--maps")) !=
+		    NULL) {
+			sym_load_maps(&symbols, arg);
+			have_symbols = true;
+		} else if ((arg = option_value(argc, argv, &i, "--filter")) !=
+		    NULL) {
+			filter = spe_filter_compile(arg, err, sizeof(err));
+			if (filter == NULL) {
+				spe_errx(1, "Invalid filter: %s\n", err);
+			}
+			record_mode = true;
+		} else if ((arg = option_value(argc, argv, &i, "-o")) !=
+		    NULL) {
+			recfile_name = arg;
+			record_mode = true;
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			stats_mode = true;
+		} else if (strcmp(argv[i], "--resync") == 0) {
+			resync_mode = true;
+			record_mode = true;
+		} else if (strcmp(argv[i], "--merge") == 0) {
+			merge_mode = true;
+			record_mode = true;
+		} else if ((arg = option_value(argc, argv, &i,
+		    "--io-depth")) != NULL) {
+			io_depth = option_number(arg, 1024, "read depth");
+		} else if ((arg = option_value(argc, argv, &i,
+		    "--io-block")) != NULL) {
+			io_block = option_number(arg, STREAM_BUF_SIZE_MAX,
+			    "read block size");
+			if (io_block < SPE_READER_BLOCK_MIN) {
+				spe_errx(1, "The read block size must be at "
+				    "least %d bytes\n", SPE_READER_BLOCK_MIN);
+			}
+#if defined(SPE_MMAP)
+		} else if ((arg = option_value(argc, argv, &i,
+		    "--map-window")) != NULL) {
+			map_window_size = option_number(arg, SIZE_MAX / 2,
+			    "map window size");
+			/* Keep the windows aligned in the file */
+			map_window_size = (map_window_size + MAP_ALIGN - 1) /
+			    MAP_ALIGN * MAP_ALIGN;
+#endif
+		} else if ((arg = option_value(argc, argv, &i, "--log")) !=
+		    NULL) {
+			log_level = (int)option_number(arg, INT_MAX,
+			    "log level");
+		} else {
+			usage();
+		}
+	}
 
-	if (argc < 2) {
+	if (i == argc) {
 		usage();
 	}
+	if (merge_mode && nthreads > 1) {
+		spe_errx(1, "--merge decodes on a single thread\n");
+	}
+	if (mem_pa && mem_count == 0) {
+		spe_errx(1, "--mem-pa needs --mem\n");
+	}
+	if (have_symbols) {
+		sym_table_finish(&symbols);
+	}
+	/* Without anything else to do with the records print them */
+	print_records = (filter != NULL || resync_mode || merge_mode) &&
+	    top_count == 0 && !latency_mode && mem_count == 0 &&
+	    recfile_name == NULL;
 
-	ctx = spe_decode_ctx_alloc();
-	if (ctx == NULL) {
-		spe_errx(1, "Unable to allocate a decode context");
+	stdout_output.fp = stdout;
+	/* Keep the reports out of a record file written to stdout */
+	report_fp = stdout;
+	if (recfile_name != NULL && strcmp(recfile_name, "-") == 0) {
+		report_fp = stderr;
+	}
+	if (record_mode) {
+		summary_init(&summary);
+		if (recfile_name != NULL) {
+			recfile_open();
+		}
 	}
 
-	spe_packet_decode_set_callback(ctx, SPE_PKT_INVALID, packet);
-	spe_packet_decode_set_callback(ctx, SPE_PKT_UNKNOWN, packet);
-	spe_packet_decode_set_callback(ctx, SPE_PKT_ADDRESS, address_packet);
-	spe_packet_decode_set_callback(ctx, SPE_PKT_CONTEXT, context_packet);
-	spe_packet_decode_set_callback(ctx, SPE_PKT_COUNTER, counter_packet);
-	spe_packet_decode_set_callback(ctx, SPE_PKT_DATA_SOURCE,
-	    data_source_packet);
-	spe_packet_decode_set_callback(ctx, SPE_PKT_END, end_packet);
-	spe_packet_decode_set_callback(ctx, SPE_PKT_EVENTS, events_packet);
-	spe_packet_decode_set_callback(ctx, SPE_PKT_OPERATION_TYPE,
-	    operation_packet);
-	spe_packet_decode_set_callback(ctx, SPE_PKT_PADDING, packet);
-	spe_packet_decode_set_callback(ctx, SPE_PKT_TIMESTAMP,
-	    timestamp_packet);
+	if (log_level > spe_log_level_max()) {
+		fprintf(stderr, "spe_decode: the library was built with log "
+		    "level %d, use -DSPE_LOG_LEVEL=%d for more messages\n",
+		    spe_log_level_max(), log_level);
+	}
+	if (log_level > 0) {
+		log_ring = spe_log_ring_alloc(LOG_RING_SIZE);
+		if (log_ring == NULL) {
+			spe_errx(1, "Unable to allocate the log ring\n");
+		}
+	}
 
-	for (int i = 1; i < argc; i++) {
-		process(ctx, argv[i]);
+	ctx = decode_ctx_alloc();
+
+	start = stats_time();
+	have_stats = false;
+	if (merge_mode) {
+		have_stats = process_merge(&argv[i], (size_t)(argc - i),
+		    &stats);
+		log_print();
+	} else {
+		for (; i < argc; i++) {
+			process(ctx, argv[i], (unsigned int)nthreads);
+			log_print();
+		}
 	}
 
+	if (record_mode) {
+		/* A parallel decode leaves the start of an incomplete record */
+		decode_records(ctx, &summary);
+		/* The last record may not have an end packet */
+		while (spe_record_decode_flush(ctx, &rec)) {
+			handle_record(&summary, &rec);
+		}
+		if (top_count > 0) {
+			top_print(&summary.top,
+			    have_symbols ? &symbols : NULL, report_fp,
+			    top_count);
+		}
+		if (latency_mode) {
+			if (top_count > 0) {
+				fprintf(report_fp, "\n");
+			}
+			latency_print(&summary.latency, report_fp);
+		}
+		if (mem_count > 0) {
+			if (top_count > 0 || latency_mode) {
+				fprintf(report_fp, "\n");
+			}
+			mem_print(&summary.mem, report_fp, mem_count);
+		}
+		if (recfile_name != NULL) {
+			recfile_close();
+		}
+		fflush(stdout);
+		skips_print(&summary, stderr);
+		summary_fini(&summary);
+	}
+
+	if (stats_mode) {
+		fflush(stdout);
+		if (!merge_mode) {
+			have_stats = spe_decode_ctx_get_stats(ctx, &stats);
+		}
+		stats_print(have_stats ? &stats : NULL, stats_time() - start,
+		    stderr);
+	}
 	spe_decode_ctx_free(ctx);
+	if (log_ring != NULL) {
+		log_print();
+		if (spe_log_ring_dropped(log_ring) > 0) {
+			fprintf(stderr, "%" PRIu64 " log messages dropped\n",
+			    spe_log_ring_dropped(log_ring));
+		}
+		spe_log_ring_free(log_ring);
+	}
+	sym_table_fini(&symbols);
+	spe_filter_free(filter);
 
 	return (0);
 }
@@ -0,0 +1,228 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SPE_DECODE_H_
+#define	_SPE_DECODE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* spedecode.h needs to be included first */
+
+#if !defined(_MSC_VER)
+#define	SPE_NORETURN	__attribute__((__noreturn__))
+#else
+#define	SPE_NORETURN	__declspec(noreturn)
+#endif
+
+SPE_NORETURN void spe_errx(int, const char *, ...);
+SPE_NORETURN void spe_err(int, const char *, ...);
+
+/*
+ * An open addressing hash table keyed by address. The slots only hold the
+ * key and an index into a dense array of values so probing stays within a
+ * few cache lines.
+ */
+struct addr_slot {
+	uint64_t key;
+	uint32_t idx;
+};
+
+struct addr_table {
+	struct addr_slot *slots;
+	unsigned int shift;	/* 64 - log2(number of slots) */
+	size_t mask;
+	size_t count;
+	size_t value_size;
+	size_t values_size;
+	void *values;
+	bool has_empty_key;	/* The empty slot key is in values */
+	uint32_t empty_key_idx;
+};
+
+void addr_table_init(struct addr_table *, size_t);
+void addr_table_fini(struct addr_table *);
+void *addr_table_get(struct addr_table *, uint64_t);
+uint64_t addr_table_key(struct addr_table *, size_t);
+void *addr_table_value(struct addr_table *, size_t);
+typedef int (addr_table_cmp)(const void *, const void *);
+size_t *addr_table_sort(struct addr_table *, addr_table_cmp *);
+
+/* latency.c */
+#define	LATENCY_BY_NONE		0
+#define	LATENCY_BY_CLASS	1
+#define	LATENCY_BY_SOURCE	2
+
+/* Data sources with a larger value are counted together */
+#define	LATENCY_SOURCES		16
+#define	LATENCY_GROUPS		(LATENCY_SOURCES + 1)
+
+struct latency_group {
+	struct spe_hist counter[SPE_RECORD_COUNTER_MAX];
+};
+
+struct latency {
+	int by;
+	struct latency_group all;
+	struct latency_group *groups[LATENCY_GROUPS];
+};
+
+void latency_init(struct latency *, int);
+void latency_fini(struct latency *);
+void latency_add(struct latency *, const struct spe_record *);
+void latency_merge(struct latency *, const struct latency *);
+void latency_print(const struct latency *, FILE *);
+
+/* mem.c */
+#define	MEM_GRANULES		3
+/* Data sources with a larger value are counted together */
+#define	MEM_SOURCES		16
+
+struct mem {
+	bool pa;		/* Use the physical rather than virtual address */
+	uint64_t samples;
+	struct addr_table tables[MEM_GRANULES];
+};
+
+void mem_init(struct mem *, bool);
+void mem_fini(struct mem *);
+void mem_add(struct mem *, const struct spe_record *);
+void mem_merge(struct mem *, struct mem *);
+void mem_print(struct mem *, FILE *, unsigned int);
+
+/* merge.c */
+/* The number of records decoded ahead from each source */
+#define	MERGE_WINDOW		64
+
+/* Add more data to the context, returns false at the end of the source */
+typedef bool (merge_fill_cb)(struct spe_decode_ctx *, void *);
+
+struct merge_source {
+	struct spe_decode_ctx *ctx;
+	void *data;		/* Passed to the fill callback */
+	struct spe_record recs[MERGE_WINDOW];
+	uint64_t keys[MERGE_WINDOW];
+	size_t head;
+	size_t count;
+	uint64_t timestamp;	/* The last timestamp from this source */
+	bool eof;
+};
+
+struct merge {
+	merge_fill_cb *fill;
+	struct merge_source *sources;
+	size_t nsources;
+	size_t *heap;
+	size_t heap_len;
+	bool started;
+};
+
+void merge_init(struct merge *, merge_fill_cb *, size_t);
+void merge_fini(struct merge *);
+void merge_set_source(struct merge *, size_t, struct spe_decode_ctx *,
+    void *);
+bool merge_next(struct merge *, struct spe_record *, size_t *);
+
+/* sym.c */
+struct sym {
+	uint64_t start;
+	uint64_t end;
+	const char *name;
+};
+
+struct sym_dso {
+	char *path;
+	const char *name;	/* The last part of the path */
+	uint64_t start;
+	uint64_t end;
+	uint64_t offset;	/* The file offset mapped at start */
+};
+
+/* Sorted keys in Eytzinger order, with their position in the sort */
+struct sym_index {
+	uint64_t *keys;		/* From index 1 */
+	uint32_t *rank;
+	size_t count;
+};
+
+struct sym_table {
+	struct sym *syms;
+	size_t nsyms;
+	size_t syms_size;
+	struct sym_dso *dsos;
+	size_t ndsos;
+	size_t dsos_size;
+	void *files;
+	size_t nfiles;
+	size_t files_size;
+	struct sym_index sym_index;
+	struct sym_index dso_index;
+};
+
+/* A direct mapped cache of recent lookups */
+#define	SYM_CACHE_BITS		8
+struct sym_cache_entry {
+	uint64_t addr;
+	const struct sym *sym;
+	const struct sym_dso *dso;
+	bool valid;
+};
+
+struct sym_cache {
+	struct sym_cache_entry entries[1 << SYM_CACHE_BITS];
+};
+
+struct sym_result {
+	const struct sym *sym;
+	const struct sym_dso *dso;
+};
+
+void sym_table_init(struct sym_table *);
+void sym_table_fini(struct sym_table *);
+void sym_load_elf(struct sym_table *, const char *);
+void sym_load_maps(struct sym_table *, const char *);
+void sym_table_finish(struct sym_table *);
+bool sym_lookup(const struct sym_table *, struct sym_cache *, uint64_t,
+    struct sym_result *);
+int sym_format(const struct sym_result *, uint64_t, char *, size_t);
+
+/* top.c */
+struct top {
+	struct addr_table table;
+	uint64_t samples;
+};
+
+void top_init(struct top *);
+void top_fini(struct top *);
+void top_add(struct top *, const struct spe_record *);
+void top_merge(struct top *, struct top *);
+void top_print(struct top *, const struct sym_table *, FILE *,
+    unsigned int);
+
+#endif /* _SPE_DECODE_H_ */
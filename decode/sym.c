@@ -0,0 +1,670 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if defined(SPE_MMAP)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_MSC_VER)
+#include <unistd.h>
+#else
+#include <intrin.h>
+#endif
+
+#include <spedecode.h>
+
+#include "spe_decode.h"
+
+/*
+ * The parts of the ELF64 format needed to read the symbol table. These are
+ * defined here as not all hosts spe_decode is built on have an elf.h.
+ */
+#define	ELF_CLASS64	2
+#define	ELF_DATA2LSB	1
+#define	ELF_PT_LOAD	1
+#define	ELF_PF_X	0x1
+#define	ELF_SHT_SYMTAB	2
+#define	ELF_SHT_DYNSYM	11
+#define	ELF_STT_FUNC	2
+#define	ELF_SHN_UNDEF	0
+
+struct elf_ehdr {
+	uint8_t ident[16];
+	uint16_t type;
+	uint16_t machine;
+	uint32_t version;
+	uint64_t entry;
+	uint64_t phoff;
+	uint64_t shoff;
+	uint32_t flags;
+	uint16_t ehsize;
+	uint16_t phentsize;
+	uint16_t phnum;
+	uint16_t shentsize;
+	uint16_t shnum;
+	uint16_t shstrndx;
+};
+
+struct elf_phdr {
+	uint32_t type;
+	uint32_t flags;
+	uint64_t offset;
+	uint64_t vaddr;
+	uint64_t paddr;
+	uint64_t filesz;
+	uint64_t memsz;
+	uint64_t align;
+};
+
+struct elf_shdr {
+	uint32_t name;
+	uint32_t type;
+	uint64_t flags;
+	uint64_t addr;
+	uint64_t offset;
+	uint64_t size;
+	uint32_t link;
+	uint32_t info;
+	uint64_t addralign;
+	uint64_t entsize;
+};
+
+struct elf_sym {
+	uint32_t name;
+	uint8_t info;
+	uint8_t other;
+	uint16_t shndx;
+	uint64_t value;
+	uint64_t size;
+};
+
+/* A file the symbol names point into */
+struct sym_file {
+	void *data;
+	size_t len;
+	bool mapped;
+};
+
+/*
+ * Load a file, returns false with a warning if it can't be read, e.g. a
+ * file in a maps snapshot that has since been removed.
+ */
+static bool
+sym_file_load(struct sym_file *file, const char *path)
+{
+#if defined(SPE_MMAP)
+	struct stat sb;
+	int fd;
+#endif
+	FILE *fp;
+	long len;
+
+	memset(file, 0, sizeof(*file));
+#if defined(SPE_MMAP)
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd != -1 && fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+	    sb.st_size > 0) {
+		file->data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE,
+		    fd, 0);
+		if (file->data != MAP_FAILED) {
+			file->len = sb.st_size;
+			file->mapped = true;
+			close(fd);
+			return (true);
+		}
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+#endif
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Unable to open \"%s\": %s\n", path,
+		    strerror(errno));
+		return (false);
+	}
+	if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 ||
+	    fseek(fp, 0, SEEK_SET) != 0) {
+		spe_err(1, "Unable to find the size of \"%s\"", path);
+	}
+	file->len = (size_t)len;
+	file->data = malloc(file->len);
+	if (file->data == NULL && file->len > 0) {
+		spe_errx(1, "Unable to allocate %zu bytes\n", file->len);
+	}
+	if (fread(file->data, 1, file->len, fp) != file->len) {
+		spe_err(1, "Unable to read \"%s\"", path);
+	}
+	fclose(fp);
+
+	return (true);
+}
+
+static void
+sym_file_unload(struct sym_file *file)
+{
+#if defined(SPE_MMAP)
+	if (file->mapped) {
+		munmap(file->data, file->len);
+		return;
+	}
+#endif
+	free(file->data);
+}
+
+void
+sym_table_init(struct sym_table *table)
+{
+	memset(table, 0, sizeof(*table));
+}
+
+void
+sym_table_fini(struct sym_table *table)
+{
+	struct sym_file *files;
+
+	files = table->files;
+	for (size_t i = 0; i < table->nfiles; i++) {
+		sym_file_unload(&files[i]);
+	}
+	for (size_t i = 0; i < table->ndsos; i++) {
+		free(table->dsos[i].path);
+	}
+	free(table->files);
+	free(table->syms);
+	free(table->dsos);
+	free(table->sym_index.keys);
+	free(table->sym_index.rank);
+	free(table->dso_index.keys);
+	free(table->dso_index.rank);
+	memset(table, 0, sizeof(*table));
+}
+
+static void *
+sym_grow(void *array, size_t *sizep, size_t count, size_t elem)
+{
+	size_t size;
+
+	if (count < *sizep) {
+		return (array);
+	}
+
+	size = *sizep == 0 ? 64 : *sizep * 2;
+	array = realloc(array, size * elem);
+	if (array == NULL) {
+		spe_errx(1, "Unable to allocate the symbol table\n");
+	}
+	*sizep = size;
+	return (array);
+}
+
+static bool
+sym_elf_range(const struct sym_file *file, uint64_t off, uint64_t len)
+{
+	return (off <= file->len && len <= file->len - off);
+}
+
+/*
+ * Add the function symbols from an ELF file. Symbols are moved by bias
+ * and only those within the mapping of the DSO are kept.
+ */
+static void
+sym_add_elf(struct sym_table *table, const struct sym_file *file,
+    const char *path, size_t dso, uint64_t bias)
+{
+	const struct elf_ehdr *ehdr;
+	struct elf_shdr symtab, strtab;
+	struct elf_sym esym;
+	const char *strs, *name;
+	struct sym *sym;
+	uint64_t start;
+	bool found;
+
+	ehdr = file->data;
+	found = false;
+	memset(&symtab, 0, sizeof(symtab));
+	for (int pass = 0; pass < 2 && !found; pass++) {
+		/* Prefer the full symbol table to the dynamic symbols */
+		for (size_t i = 0; i < ehdr->shnum; i++) {
+			memcpy(&symtab, (const uint8_t *)file->data +
+			    ehdr->shoff + i * sizeof(symtab), sizeof(symtab));
+			if (symtab.type == (pass == 0 ? ELF_SHT_SYMTAB :
+			    ELF_SHT_DYNSYM)) {
+				found = true;
+				break;
+			}
+		}
+	}
+	if (!found || symtab.link >= ehdr->shnum) {
+		fprintf(stderr, "No symbols found in \"%s\"\n", path);
+		return;
+	}
+
+	memcpy(&strtab, (const uint8_t *)file->data + ehdr->shoff +
+	    symtab.link * sizeof(strtab), sizeof(strtab));
+	if (!sym_elf_range(file, symtab.offset, symtab.size) ||
+	    !sym_elf_range(file, strtab.offset, strtab.size)) {
+		spe_errx(1, "Invalid symbol table in \"%s\"\n", path);
+	}
+	strs = (const char *)file->data + strtab.offset;
+
+	for (size_t off = 0; off + sizeof(esym) <= symtab.size;
+	    off += sizeof(esym)) {
+		memcpy(&esym, (const uint8_t *)file->data + symtab.offset + off,
+		    sizeof(esym));
+		if ((esym.info & 0xf) != ELF_STT_FUNC ||
+		    esym.shndx == ELF_SHN_UNDEF || esym.name >= strtab.size) {
+			continue;
+		}
+		name = strs + esym.name;
+		if (memchr(name, '\0', strtab.size - esym.name) == NULL ||
+		    *name == '\0') {
+			continue;
+		}
+
+		start = esym.value + bias;
+		if (start < table->dsos[dso].start ||
+		    start >= table->dsos[dso].end) {
+			continue;
+		}
+
+		table->syms = sym_grow(table->syms, &table->syms_size,
+		    table->nsyms, sizeof(*table->syms));
+		sym = &table->syms[table->nsyms++];
+		sym->start = start;
+		sym->end = start + esym.size;
+		sym->name = name;
+	}
+}
+
+static const struct sym_file *
+sym_load_file(struct sym_table *table, const char *path)
+{
+	const struct elf_ehdr *ehdr;
+	struct sym_file *files;
+
+	table->files = sym_grow(table->files, &table->files_size,
+	    table->nfiles, sizeof(struct sym_file));
+	files = table->files;
+	if (!sym_file_load(&files[table->nfiles], path)) {
+		return (NULL);
+	}
+	table->nfiles++;
+
+	ehdr = files[table->nfiles - 1].data;
+	if (files[table->nfiles - 1].len < sizeof(*ehdr) ||
+	    memcmp(ehdr->ident, "\177ELF", 4) != 0 ||
+	    ehdr->ident[4] != ELF_CLASS64 || ehdr->ident[5] != ELF_DATA2LSB ||
+	    !sym_elf_range(&files[table->nfiles - 1], ehdr->phoff,
+	    (uint64_t)ehdr->phnum * sizeof(struct elf_phdr)) ||
+	    !sym_elf_range(&files[table->nfiles - 1], ehdr->shoff,
+	    (uint64_t)ehdr->shnum * sizeof(struct elf_shdr))) {
+		fprintf(stderr, "\"%s\" is not a 64-bit ELF file\n", path);
+		return (NULL);
+	}
+
+	return (&files[table->nfiles - 1]);
+}
+
+static size_t
+sym_add_dso(struct sym_table *table, const char *path, uint64_t start,
+    uint64_t end, uint64_t offset)
+{
+	struct sym_dso *dso;
+
+	table->dsos = sym_grow(table->dsos, &table->dsos_size, table->ndsos,
+	    sizeof(*table->dsos));
+	dso = &table->dsos[table->ndsos];
+	dso->path = strdup(path);
+	if (dso->path == NULL) {
+		spe_errx(1, "Unable to allocate the symbol table\n");
+	}
+	dso->name = strrchr(dso->path, '/');
+	dso->name = dso->name == NULL ? dso->path : dso->name + 1;
+	dso->start = start;
+	dso->end = end;
+	dso->offset = offset;
+
+	return (table->ndsos++);
+}
+
+/*
+ * Load the symbols from an ELF file at the addresses it was linked at,
+ * e.g. the kernel or a non-PIE executable.
+ */
+void
+sym_load_elf(struct sym_table *table, const char *path)
+{
+	const struct sym_file *file;
+	const struct elf_ehdr *ehdr;
+	struct elf_phdr phdr;
+	uint64_t start, end;
+
+	file = sym_load_file(table, path);
+	if (file == NULL) {
+		return;
+	}
+
+	ehdr = file->data;
+	start = UINT64_MAX;
+	end = 0;
+	for (size_t i = 0; i < ehdr->phnum; i++) {
+		memcpy(&phdr, (const uint8_t *)file->data + ehdr->phoff +
+		    i * sizeof(phdr), sizeof(phdr));
+		if (phdr.type != ELF_PT_LOAD || (phdr.flags & ELF_PF_X) == 0) {
+			continue;
+		}
+		if (phdr.vaddr < start) {
+			start = phdr.vaddr;
+		}
+		if (phdr.vaddr + phdr.memsz > end) {
+			end = phdr.vaddr + phdr.memsz;
+		}
+	}
+	if (start >= end) {
+		fprintf(stderr, "No executable segments in \"%s\"\n", path);
+		return;
+	}
+
+	sym_add_elf(table, file, path, sym_add_dso(table, path, start, end, 0),
+	    0);
+}
+
+/*
+ * Load the executable mappings from a copy of /proc/<pid>/maps, and the
+ * symbols of each file mapped. The files are read from the local system.
+ */
+void
+sym_load_maps(struct sym_table *table, const char *path)
+{
+	const struct sym_file *file;
+	const struct elf_ehdr *ehdr;
+	struct elf_phdr phdr;
+	unsigned long long start, end, pgoff;
+	char line[4096], perms[8], dso_path[4096];
+	uint64_t bias;
+	size_t dso;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		spe_err(1, "Unable to open \"%s\"", path);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %4095s", &start,
+		    &end, perms, &pgoff, dso_path) != 5 ||
+		    strchr(perms, 'x') == NULL || dso_path[0] != '/') {
+			continue;
+		}
+
+		dso = sym_add_dso(table, dso_path, start, end, pgoff);
+		file = sym_load_file(table, dso_path);
+		if (file == NULL) {
+			continue;
+		}
+
+		/*
+		 * Find the segment holding the mapped file offset to find
+		 * where the file was loaded.
+		 */
+		ehdr = file->data;
+		for (size_t i = 0; i < ehdr->phnum; i++) {
+			memcpy(&phdr, (const uint8_t *)file->data +
+			    ehdr->phoff + i * sizeof(phdr), sizeof(phdr));
+			if (phdr.type != ELF_PT_LOAD || pgoff < phdr.offset ||
+			    pgoff >= phdr.offset + phdr.filesz) {
+				continue;
+			}
+
+			bias = start - (phdr.vaddr + (pgoff - phdr.offset));
+			sym_add_elf(table, file, dso_path, dso, bias);
+			break;
+		}
+	}
+	if (ferror(fp)) {
+		spe_err(1, "Unable to read \"%s\"", path);
+	}
+	fclose(fp);
+}
+
+static int
+sym_cmp(const void *a, const void *b)
+{
+	const struct sym *sa, *sb;
+
+	sa = a;
+	sb = b;
+	if (sa->start != sb->start) {
+		return (sa->start < sb->start ? -1 : 1);
+	}
+	/* Keep the symbol with a size, then the first loaded */
+	if ((sa->end == sa->start) != (sb->end == sb->start)) {
+		return (sa->end == sa->start ? 1 : -1);
+	}
+	return (sa < sb ? -1 : 1);
+}
+
+static int
+sym_dso_cmp(const void *a, const void *b)
+{
+	const struct sym_dso *da, *db;
+
+	da = a;
+	db = b;
+	if (da->start != db->start) {
+		return (da->start < db->start ? -1 : 1);
+	}
+	return (da < db ? -1 : 1);
+}
+
+/*
+ * Store the keys in Eytzinger (breadth first) order. The first levels of
+ * the implicit tree are then in the same few cache lines, and the search
+ * below doesn't need to branch on the comparison.
+ */
+static size_t
+sym_index_fill(struct sym_index *index, const uint64_t *sorted, size_t i,
+    size_t k)
+{
+	if (k <= index->count) {
+		i = sym_index_fill(index, sorted, i, 2 * k);
+		index->keys[k] = sorted[i];
+		index->rank[k] = (uint32_t)i;
+		i++;
+		i = sym_index_fill(index, sorted, i, 2 * k + 1);
+	}
+	return (i);
+}
+
+static void
+sym_index_build(struct sym_index *index, const uint64_t *sorted, size_t count)
+{
+	index->count = count;
+	index->keys = malloc((count + 1) * sizeof(*index->keys));
+	index->rank = malloc((count + 1) * sizeof(*index->rank));
+	if (index->keys == NULL || index->rank == NULL) {
+		spe_errx(1, "Unable to allocate the symbol index\n");
+	}
+	sym_index_fill(index, sorted, 0, 1);
+}
+
+/*
+ * Returns the position in the sorted keys of the last key less than or
+ * equal to addr, or SIZE_MAX if there is none.
+ */
+static size_t
+sym_index_find(const struct sym_index *index, uint64_t addr)
+{
+	size_t k;
+
+	k = 1;
+	while (k <= index->count) {
+		k = 2 * k + (index->keys[k] <= addr);
+	}
+	/* Undo the final right steps to find the first key above addr */
+#if defined(_MSC_VER)
+	unsigned long bit;
+
+	_BitScanForward64(&bit, ~(uint64_t)k);
+	k >>= bit + 1;
+#else
+	k >>= __builtin_ffsll((long long)~k);
+#endif
+	if (k == 0) {
+		return (index->count == 0 ? SIZE_MAX : index->count - 1);
+	}
+	return (index->rank[k] == 0 ? SIZE_MAX : index->rank[k] - 1);
+}
+
+/*
+ * Sort the symbols and mappings and build the indexes. Called once all
+ * files are loaded, after this the table is only read so may be used from
+ * multiple threads.
+ */
+void
+sym_table_finish(struct sym_table *table)
+{
+	uint64_t *keys;
+	size_t count, n;
+
+	qsort(table->syms, table->nsyms, sizeof(*table->syms), sym_cmp);
+	qsort(table->dsos, table->ndsos, sizeof(*table->dsos), sym_dso_cmp);
+
+	/* Remove aliases and end symbols without a size at the next one */
+	count = 0;
+	for (size_t i = 0; i < table->nsyms; i++) {
+		if (count > 0 &&
+		    table->syms[count - 1].start == table->syms[i].start) {
+			continue;
+		}
+		table->syms[count++] = table->syms[i];
+	}
+	table->nsyms = count;
+	for (size_t i = 0; i < count; i++) {
+		if (table->syms[i].end == table->syms[i].start) {
+			table->syms[i].end = i + 1 < count ?
+			    table->syms[i + 1].start : table->syms[i].start + 1;
+		}
+	}
+
+	n = table->nsyms > table->ndsos ? table->nsyms : table->ndsos;
+	keys = malloc((n + 1) * sizeof(*keys));
+	if (keys == NULL) {
+		spe_errx(1, "Unable to allocate the symbol index\n");
+	}
+	for (size_t i = 0; i < table->nsyms; i++) {
+		keys[i] = table->syms[i].start;
+	}
+	sym_index_build(&table->sym_index, keys, table->nsyms);
+	for (size_t i = 0; i < table->ndsos; i++) {
+		keys[i] = table->dsos[i].start;
+	}
+	sym_index_build(&table->dso_index, keys, table->ndsos);
+	free(keys);
+}
+
+/*
+ * Find the symbol and DSO an address is in. The cache may be NULL,
+ * otherwise it must only be used by one thread at a time. Returns false if
+ * the address isn't in a known DSO.
+ */
+bool
+sym_lookup(const struct sym_table *table, struct sym_cache *cache,
+    uint64_t addr, struct sym_result *res)
+{
+	struct sym_cache_entry *entry;
+	const struct sym *sym;
+	const struct sym_dso *dso;
+	size_t idx;
+
+	entry = NULL;
+	if (cache != NULL) {
+		entry = &cache->entries[(addr * 0x9e3779b97f4a7c15ull) >>
+		    (64 - SYM_CACHE_BITS)];
+		if (entry->valid && entry->addr == addr) {
+			goto found;
+		}
+	}
+
+	idx = sym_index_find(&table->sym_index, addr);
+	sym = NULL;
+	if (idx != SIZE_MAX && addr < table->syms[idx].end) {
+		sym = &table->syms[idx];
+	}
+	idx = sym_index_find(&table->dso_index, addr);
+	dso = NULL;
+	if (idx != SIZE_MAX && addr < table->dsos[idx].end) {
+		dso = &table->dsos[idx];
+	}
+
+	if (entry == NULL) {
+		res->sym = sym;
+		res->dso = dso;
+		return (dso != NULL);
+	}
+	entry->addr = addr;
+	entry->sym = sym;
+	entry->dso = dso;
+	entry->valid = true;
+
+found:
+	res->sym = entry->sym;
+	res->dso = entry->dso;
+	return (entry->dso != NULL);
+}
+
+/*
+ * Format an address as symbol+offset (dso), or dso+offset when there is
+ * no symbol. The DSO offset is the offset in the file as used by
+ * addr2line.
+ */
+int
+sym_format(const struct sym_result *res, uint64_t addr, char *buf,
+    size_t size)
+{
+	if (res->dso == NULL) {
+		return (snprintf(buf, size, "?"));
+	}
+	if (res->sym == NULL) {
+		return (snprintf(buf, size, "%s+%#"PRIx64, res->dso->name,
+		    addr - res->dso->start + res->dso->offset));
+	}
+	return (snprintf(buf, size, "%s+%#"PRIx64" (%s)", res->sym->name,
+	    addr - res->sym->start, res->dso->name));
+}
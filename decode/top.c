@@ -0,0 +1,184 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <spedecode.h>
+
+#include "spe_decode.h"
+
+/* Count these events for each PC */
+static const struct {
+	const char *name;
+	int bit;
+} top_events[] = {
+	{ "L1D-miss", SPE_EVENT_L1D_REFILL },
+	{ "TLB-walk", SPE_EVENT_TLB_WALK },
+	{ "LLC-miss", SPE_EVENT_LLC_MISS },
+	{ "Mispred", SPE_EVENT_MISPREDICTED },
+};
+#define	TOP_EVENTS	(sizeof(top_events) / sizeof(top_events[0]))
+
+struct top_entry {
+	uint64_t samples;
+	uint64_t latency;		/* Sum of the total latency */
+	uint64_t latency_samples;	/* Samples with a total latency */
+	uint64_t events[TOP_EVENTS];
+};
+
+void
+top_init(struct top *top)
+{
+	addr_table_init(&top->table, sizeof(struct top_entry));
+	top->samples = 0;
+}
+
+void
+top_fini(struct top *top)
+{
+	addr_table_fini(&top->table);
+}
+
+void
+top_add(struct top *top, const struct spe_record *rec)
+{
+	struct top_entry *entry;
+
+	if ((rec->present & SPE_RECORD_ADDR(SPE_ADDRESS_IDX_PC_VA)) == 0) {
+		return;
+	}
+
+	entry = addr_table_get(&top->table,
+	    SPE_ADDRESS_ADDR_SE(rec->addr[SPE_ADDRESS_IDX_PC_VA]));
+	entry->samples++;
+	top->samples++;
+
+	if ((rec->present & SPE_RECORD_COUNTER(SPE_COUNTER_IDX_TOTAL_LAT)) !=
+	    0) {
+		entry->latency += rec->counter[SPE_COUNTER_IDX_TOTAL_LAT];
+		entry->latency_samples++;
+	}
+
+	if ((rec->present & SPE_RECORD_EVENTS) != 0) {
+		for (size_t i = 0; i < TOP_EVENTS; i++) {
+			entry->events[i] += SPE_EVENTS(rec->events,
+			    top_events[i].bit);
+		}
+	}
+}
+
+/*
+ * Add the samples in src to dst.
+ */
+void
+top_merge(struct top *dst, struct top *src)
+{
+	struct top_entry *from, *to;
+
+	for (size_t i = 0; i < src->table.count; i++) {
+		from = addr_table_value(&src->table, i);
+		to = addr_table_get(&dst->table, addr_table_key(&src->table,
+		    i));
+		to->samples += from->samples;
+		to->latency += from->latency;
+		to->latency_samples += from->latency_samples;
+		for (size_t j = 0; j < TOP_EVENTS; j++) {
+			to->events[j] += from->events[j];
+		}
+	}
+	dst->samples += src->samples;
+}
+
+static int
+top_cmp(const void *a, const void *b)
+{
+	const struct top_entry *ea, *eb;
+
+	ea = a;
+	eb = b;
+	if (ea->samples != eb->samples) {
+		return (ea->samples < eb->samples ? 1 : -1);
+	}
+	return (0);
+}
+
+/*
+ * Print the PCs with the most samples.
+ */
+void
+top_print(struct top *top, const struct sym_table *syms, FILE *fp,
+    unsigned int count)
+{
+	struct addr_table *table;
+	struct top_entry *entry;
+	struct sym_result res;
+	char name[512];
+	uint64_t pc;
+	size_t *order;
+
+	fprintf(fp, "%10s %6s %8s", "Samples", "Pct", "Avg-lat");
+	for (size_t i = 0; i < TOP_EVENTS; i++) {
+		fprintf(fp, " %8s", top_events[i].name);
+	}
+	if (syms != NULL) {
+		fprintf(fp, " %16s %s\n", "PC", "Symbol");
+	} else {
+		fprintf(fp, " %s\n", "PC");
+	}
+
+	table = &top->table;
+	if (table->count == 0) {
+		return;
+	}
+
+	order = addr_table_sort(table, top_cmp);
+
+	for (size_t i = 0; i < table->count && i < count; i++) {
+		entry = addr_table_value(table, order[i]);
+		fprintf(fp, "%10"PRIu64" %5.2f%% %8.1f", entry->samples,
+		    100.0 * (double)entry->samples / (double)top->samples,
+		    entry->latency_samples == 0 ? 0.0 :
+		    (double)entry->latency / (double)entry->latency_samples);
+		for (size_t j = 0; j < TOP_EVENTS; j++) {
+			fprintf(fp, " %8"PRIu64, entry->events[j]);
+		}
+		pc = addr_table_key(table, order[i]);
+		if (syms == NULL) {
+			fprintf(fp, " %"PRIx64"\n", pc);
+			continue;
+		}
+		sym_lookup(syms, NULL, pc, &res);
+		sym_format(&res, pc, name, sizeof(name));
+		fprintf(fp, " %16"PRIx64" %s\n", pc, name);
+	}
+
+	free(order);
+}
@@ -0,0 +1,182 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SPE_TEST_H_
+#define	_SPE_TEST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Helpers for the behaviour tests. A failed check is reported and the test
+ * carries on, main returns spe_test_result() as its exit status.
+ */
+static int spe_test_failures;
+
+#define	SPE_CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,	\
+		    __LINE__, #cond);					\
+		spe_test_failures++;					\
+	}								\
+} while (0)
+
+static inline int
+spe_test_result(void)
+{
+	if (spe_test_failures != 0) {
+		fprintf(stderr, "%d checks failed\n", spe_test_failures);
+		return (1);
+	}
+	return (0);
+}
+
+/* Append a packet with a one byte header and len bytes of data */
+static inline size_t
+spe_test_put(uint8_t *p, uint8_t header, uint64_t data, size_t len)
+{
+	p[0] = header;
+	for (size_t i = 0; i < len; i++) {
+		p[1 + i] = (uint8_t)(data >> (i * 8));
+	}
+	return (1 + len);
+}
+
+/*
+ * Encode the fields set in a record as packets. The record is ended with
+ * a timestamp packet if it has one, otherwise an end packet. Returns the
+ * number of bytes written, at most SPE_TEST_RECORD_MAX.
+ */
+#define	SPE_TEST_RECORD_MAX	96
+static inline size_t
+spe_test_put_record(uint8_t *p, const struct spe_record *rec)
+{
+	size_t len;
+
+	len = 0;
+	for (unsigned int i = 0; i < SPE_RECORD_ADDR_MAX; i++) {
+		if ((rec->present & SPE_RECORD_ADDR(i)) != 0) {
+			len += spe_test_put(p + len, (uint8_t)(0xb0 | i),
+			    rec->addr[i], 8);
+		}
+	}
+	for (unsigned int i = 0; i < SPE_RECORD_COUNTER_MAX; i++) {
+		if ((rec->present & SPE_RECORD_COUNTER(i)) != 0) {
+			len += spe_test_put(p + len, (uint8_t)(0x98 | i),
+			    rec->counter[i], 2);
+		}
+	}
+	if ((rec->present & SPE_RECORD_OPERATION_TYPE) != 0) {
+		len += spe_test_put(p + len, (uint8_t)(0x48 | rec->op_class),
+		    rec->op_subclass, 1);
+	}
+	if ((rec->present & SPE_RECORD_EVENTS) != 0) {
+		len += spe_test_put(p + len, 0x72, rec->events, 8);
+	}
+	if ((rec->present & SPE_RECORD_DATA_SOURCE) != 0) {
+		len += spe_test_put(p + len, 0x73, rec->data_source, 8);
+	}
+	if ((rec->present & SPE_RECORD_CONTEXT) != 0) {
+		len += spe_test_put(p + len, 0x64, rec->context, 4);
+	}
+	if ((rec->present & SPE_RECORD_TIMESTAMP) != 0) {
+		len += spe_test_put(p + len, 0x71, rec->timestamp, 8);
+	} else if ((rec->present & SPE_RECORD_END) != 0) {
+		len += spe_test_put(p + len, 0x01, 0, 0);
+	}
+
+	return (len);
+}
+
+static inline bool
+spe_test_record_equal(const struct spe_record *a, const struct spe_record *b)
+{
+	if (a->present != b->present || a->op_class != b->op_class ||
+	    a->op_subclass != b->op_subclass || a->context != b->context ||
+	    a->events != b->events || a->data_source != b->data_source ||
+	    a->timestamp != b->timestamp || a->source != b->source) {
+		return (false);
+	}
+	for (size_t i = 0; i < SPE_RECORD_ADDR_MAX; i++) {
+		if (a->addr[i] != b->addr[i]) {
+			return (false);
+		}
+	}
+	for (size_t i = 0; i < SPE_RECORD_COUNTER_MAX; i++) {
+		if (a->counter[i] != b->counter[i]) {
+			return (false);
+		}
+	}
+	return (true);
+}
+
+/* A few different records to decode */
+static inline void
+spe_test_record(struct spe_record *rec, unsigned int n)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->present = SPE_RECORD_ADDR(SPE_ADDRESS_IDX_PC_VA) |
+	    SPE_RECORD_COUNTER(SPE_COUNTER_IDX_TOTAL_LAT) |
+	    SPE_RECORD_OPERATION_TYPE | SPE_RECORD_EVENTS;
+	rec->addr[SPE_ADDRESS_IDX_PC_VA] = 0xffff800010000000ull + n * 4;
+	rec->counter[SPE_COUNTER_IDX_TOTAL_LAT] = (uint16_t)(10 + n % 50);
+	rec->events = 1ull << SPE_EVENT_RETIRED;
+
+	switch (n % 3) {
+	case 0:
+		rec->op_class = SPE_OPERATION_TYPE_LOAD_STORE;
+		rec->addr[SPE_ADDRESS_IDX_DATA_VA] = 0x400000 + n * 64;
+		rec->present |= SPE_RECORD_ADDR(SPE_ADDRESS_IDX_DATA_VA) |
+		    SPE_RECORD_DATA_SOURCE;
+		rec->data_source = n % 4;
+		break;
+	case 1:
+		rec->op_class = SPE_OPERATION_TYPE_BRANCH;
+		rec->op_subclass = 0x01;
+		rec->addr[SPE_ADDRESS_IDX_B_TARGET] = 0x1000 + n;
+		rec->present |= SPE_RECORD_ADDR(SPE_ADDRESS_IDX_B_TARGET);
+		break;
+	default:
+		rec->op_class = SPE_OPERATION_TYPE_OTHER;
+		rec->context = n;
+		rec->present |= SPE_RECORD_CONTEXT;
+		break;
+	}
+
+	if (n % 2 == 0) {
+		rec->timestamp = 1000 + n;
+		rec->present |= SPE_RECORD_TIMESTAMP;
+	} else {
+		rec->present |= SPE_RECORD_END;
+	}
+}
+
+#endif /* _SPE_TEST_H_ */
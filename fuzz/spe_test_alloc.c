@@ -0,0 +1,305 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spe_test.h"
+
+#define	NRECORDS	64
+#define	MAX_LIVE	256
+
+/*
+ * An allocator that keeps track of the blocks it has handed out. It is
+ * only expected to be called from the thread using the context.
+ */
+struct counting {
+	void *live[MAX_LIVE];
+	size_t nlive;
+	size_t allocs;
+	size_t frees;
+	pthread_t thread;
+};
+
+static void
+counting_track(struct counting *c, void *ptr)
+{
+	SPE_CHECK(c->nlive < MAX_LIVE);
+	if (c->nlive < MAX_LIVE) {
+		c->live[c->nlive++] = ptr;
+	}
+}
+
+static bool
+counting_untrack(struct counting *c, void *ptr)
+{
+	for (size_t i = 0; i < c->nlive; i++) {
+		if (c->live[i] == ptr) {
+			c->live[i] = c->live[--c->nlive];
+			return (true);
+		}
+	}
+	return (false);
+}
+
+static void *
+counting_alloc(void *data, size_t size)
+{
+	struct counting *c;
+	void *ptr;
+
+	c = data;
+	SPE_CHECK(pthread_equal(c->thread, pthread_self()));
+	ptr = malloc(size);
+	if (ptr != NULL) {
+		c->allocs++;
+		counting_track(c, ptr);
+	}
+	return (ptr);
+}
+
+static void *
+counting_realloc(void *data, void *ptr, size_t size)
+{
+	struct counting *c;
+	void *tmp;
+
+	c = data;
+	SPE_CHECK(pthread_equal(c->thread, pthread_self()));
+	SPE_CHECK(counting_untrack(c, ptr));
+	tmp = realloc(ptr, size);
+	counting_track(c, tmp != NULL ? tmp : ptr);
+	return (tmp);
+}
+
+static void
+counting_free(void *data, void *ptr)
+{
+	struct counting *c;
+
+	c = data;
+	SPE_CHECK(pthread_equal(c->thread, pthread_self()));
+	SPE_CHECK(counting_untrack(c, ptr));
+	c->frees++;
+	free(ptr);
+}
+
+static struct counting counting;
+static const struct spe_allocator counting_allocator = {
+	.alloc_cb = counting_alloc,
+	.realloc_cb = counting_realloc,
+	.free_cb = counting_free,
+	.data = &counting,
+};
+
+static _Alignas(SPE_DECODE_CTX_ALIGN) uint8_t storage[SPE_DECODE_CTX_SIZE];
+
+static uint8_t buf[NRECORDS * SPE_TEST_RECORD_MAX];
+static size_t buf_len;
+
+static void
+build(void)
+{
+	struct spe_record rec;
+
+	buf_len = 0;
+	for (unsigned int i = 0; i < NRECORDS; i++) {
+		spe_test_record(&rec, i);
+		buf_len += spe_test_put_record(buf + buf_len, &rec);
+	}
+}
+
+static struct spe_decode_ctx *
+counting_ctx(void)
+{
+	struct spe_decode_ctx *ctx;
+
+	memset(&counting, 0, sizeof(counting));
+	counting.thread = pthread_self();
+	ctx = spe_decode_ctx_init(storage, sizeof(storage),
+	    &counting_allocator);
+	SPE_CHECK(ctx == (void *)storage);
+	return (ctx);
+}
+
+static unsigned int
+decode_records(struct spe_decode_ctx *ctx)
+{
+	struct spe_record rec, expect;
+	unsigned int n;
+
+	n = 0;
+	while (spe_record_decode_next(ctx, &rec) ||
+	    spe_record_decode_flush(ctx, &rec)) {
+		spe_test_record(&expect, n++);
+		SPE_CHECK(spe_test_record_equal(&rec, &expect));
+	}
+	return (n);
+}
+
+/* Storage that is too small or misaligned is rejected */
+static void
+test_storage(void)
+{
+	SPE_CHECK(spe_decode_ctx_init(storage, sizeof(storage) / 4,
+	    NULL) == NULL);
+	SPE_CHECK(spe_decode_ctx_init(storage + 1, sizeof(storage) - 1,
+	    NULL) == NULL);
+	SPE_CHECK(spe_decode_ctx_init(NULL, sizeof(storage), NULL) == NULL);
+}
+
+/*
+ * Every internal buffer comes from the allocator and is freed by
+ * spe_decode_ctx_fini: the segment list, copies made for
+ * SPE_FLAG_MUST_COPY and copies made by spe_decode_ctx_release.
+ */
+static void
+test_fini(void)
+{
+	static uint8_t part[sizeof(buf)];
+	struct spe_decode_ctx *ctx;
+	size_t off, len;
+
+	ctx = counting_ctx();
+	/* Small parts so the segment list grows */
+	for (off = 0; off < buf_len / 2; off += len) {
+		len = 16;
+		SPE_CHECK(spe_decode_ctx_add(ctx, SPE_FLAG_MUST_COPY,
+		    buf + off, len));
+	}
+	memcpy(part, buf + off, buf_len - off);
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, part, buf_len - off));
+	SPE_CHECK(spe_decode_ctx_release(ctx, part));
+	memset(part, 0xff, buf_len - off);
+	SPE_CHECK(counting.allocs > 2);
+	SPE_CHECK(decode_records(ctx) == NRECORDS);
+
+	/* Leave some copies behind for fini to free */
+	SPE_CHECK(spe_decode_ctx_add(ctx, SPE_FLAG_MUST_COPY, buf, 16));
+	SPE_CHECK(spe_decode_ctx_add(ctx, SPE_FLAG_MUST_COPY, buf + 16, 16));
+	spe_decode_ctx_fini(ctx);
+	SPE_CHECK(counting.nlive == 0);
+	SPE_CHECK(counting.allocs == counting.frees);
+}
+
+/* After a reset the segment list is reused so nothing is allocated */
+static void
+test_reset(void)
+{
+	struct spe_decode_ctx *ctx;
+	size_t allocs;
+
+	ctx = counting_ctx();
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf, buf_len / 2));
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf + buf_len / 2,
+	    buf_len - buf_len / 2));
+	SPE_CHECK(decode_records(ctx) == NRECORDS);
+
+	allocs = counting.allocs;
+	spe_decode_ctx_reset(ctx);
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf, buf_len / 2));
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf + buf_len / 2,
+	    buf_len - buf_len / 2));
+	SPE_CHECK(decode_records(ctx) == NRECORDS);
+	SPE_CHECK(counting.allocs == allocs);
+
+	spe_decode_ctx_fini(ctx);
+	SPE_CHECK(counting.nlive == 0);
+}
+
+static void *
+chunk_start(struct spe_decode_ctx *ctx, void *priv, size_t idx)
+{
+	(void)ctx;
+	(void)idx;
+
+	return (priv);
+}
+
+static void
+chunk_done(void *priv, size_t idx, void *data)
+{
+	(void)priv;
+	(void)idx;
+	(void)data;
+}
+
+/*
+ * spe_decode_parallel allocates its arrays from the allocator on the
+ * calling thread, the chunk contexts on the workers don't use it.
+ */
+static void
+test_parallel(void)
+{
+	static const struct spe_parallel_ops ops = {
+		.chunk_start = chunk_start,
+		.chunk_done = chunk_done,
+		.chunk_discard = chunk_done,
+	};
+	struct spe_decode_ctx *ctx;
+	uint8_t *big;
+	size_t big_len;
+
+	/* Enough data for several chunks */
+	big_len = 0;
+	big = malloc(4 * 1024 * 1024 + sizeof(buf));
+	SPE_CHECK(big != NULL);
+	if (big == NULL) {
+		return;
+	}
+	while (big_len < 4 * 1024 * 1024) {
+		memcpy(big + big_len, buf, buf_len);
+		big_len += buf_len;
+	}
+
+	ctx = counting_ctx();
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, big, big_len));
+	SPE_CHECK(spe_decode_parallel(ctx, 0, 4, &ops, &counting));
+	SPE_CHECK(counting.allocs > 1);
+	spe_decode_ctx_fini(ctx);
+	SPE_CHECK(counting.nlive == 0);
+	SPE_CHECK(counting.allocs == counting.frees);
+	free(big);
+}
+
+int
+main(void)
+{
+	build();
+	test_storage();
+	test_fini();
+	test_reset();
+	test_parallel();
+
+	return (spe_test_result());
+}
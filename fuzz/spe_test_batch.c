@@ -0,0 +1,192 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spe_test.h"
+
+#define	NRECORDS	64
+#define	MAX_PACKETS	(NRECORDS * 16)
+
+static uint8_t buf[NRECORDS * (SPE_TEST_RECORD_MAX + 4)];
+static size_t buf_len;
+
+/* The packets in the order they were decoded */
+struct packets {
+	uint8_t type[MAX_PACKETS];
+	uint16_t header[MAX_PACKETS];
+	uint64_t data[MAX_PACKETS];
+	uint64_t offset[MAX_PACKETS];
+	size_t count;
+};
+
+/* Encode the test records with some padding between them */
+static void
+build(void)
+{
+	struct spe_record rec;
+
+	buf_len = 0;
+	for (unsigned int i = 0; i < NRECORDS; i++) {
+		spe_test_record(&rec, i);
+		buf_len += spe_test_put_record(buf + buf_len, &rec);
+		for (unsigned int j = 0; j < i % 4; j++) {
+			buf[buf_len++] = 0x00;
+		}
+	}
+}
+
+static void
+packet_cb(struct spe_decode_ctx *ctx, void *data, spe_packet_type type,
+    uint16_t header, uint64_t payload)
+{
+	struct packets *pkts;
+
+	(void)ctx;
+
+	pkts = data;
+	SPE_CHECK(pkts->count < MAX_PACKETS);
+	if (pkts->count < MAX_PACKETS) {
+		pkts->type[pkts->count] = (uint8_t)type;
+		pkts->header[pkts->count] = header;
+		pkts->data[pkts->count] = payload;
+		pkts->count++;
+	}
+}
+
+/* The packets from the callbacks, these have no offset */
+static void
+decode_callbacks(int flags, struct packets *pkts)
+{
+	struct spe_decode_ctx *ctx;
+
+	memset(pkts, 0, sizeof(*pkts));
+	ctx = spe_decode_ctx_alloc();
+	for (int i = 0; i < SPE_PKT_MAX; i++) {
+		spe_packet_decode_set_callback(ctx, (spe_packet_type)i,
+		    packet_cb);
+	}
+	spe_packet_decode_set_callback_data(ctx, pkts);
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf, buf_len));
+	while (spe_packet_decode_next(ctx, flags)) {
+		/* Do nada */
+	}
+	spe_decode_ctx_free(ctx);
+}
+
+/*
+ * Decode max packets at a time with the data added in parts of split
+ * bytes, so some batches end part way through a packet.
+ */
+static void
+decode_batch(int flags, size_t max, size_t split, struct packets *pkts)
+{
+	struct spe_decode_ctx *ctx;
+	struct spe_packet_batch batch;
+	size_t count, len, n;
+
+	memset(pkts, 0, sizeof(*pkts));
+	ctx = spe_decode_ctx_alloc();
+	for (size_t off = 0; off < buf_len; off += len) {
+		len = buf_len - off < split ? buf_len - off : split;
+		SPE_CHECK(spe_decode_ctx_add(ctx, SPE_FLAG_MUST_COPY,
+		    buf + off, len));
+		do {
+			n = MAX_PACKETS - pkts->count;
+			if (n > max) {
+				n = max;
+			}
+			SPE_CHECK(n > 0);
+			if (n == 0) {
+				break;
+			}
+			batch.type = pkts->type + pkts->count;
+			batch.header = pkts->header + pkts->count;
+			batch.data = pkts->data + pkts->count;
+			batch.offset = pkts->offset + pkts->count;
+			count = spe_packet_decode_batch(ctx, flags, &batch, n);
+			SPE_CHECK(count <= n);
+			pkts->count += count;
+		} while (count == n);
+	}
+	spe_decode_ctx_free(ctx);
+}
+
+static void
+check(int flags, size_t max, size_t split)
+{
+	struct packets expect, got;
+	uint16_t header;
+
+	decode_callbacks(flags, &expect);
+	decode_batch(flags, max, split, &got);
+
+	SPE_CHECK(expect.count > NRECORDS);
+	SPE_CHECK(got.count == expect.count);
+	for (size_t i = 0; i < got.count && i < expect.count; i++) {
+		SPE_CHECK(got.type[i] == expect.type[i]);
+		SPE_CHECK(got.header[i] == expect.header[i]);
+		SPE_CHECK(got.data[i] == expect.data[i]);
+
+		/* The offset is where the header is in the data */
+		SPE_CHECK(got.offset[i] < buf_len);
+		if (got.offset[i] >= buf_len) {
+			continue;
+		}
+		header = buf[got.offset[i]];
+		if (header >= 0x20 && header < 0x40) {
+			header = (uint16_t)(header << 8) |
+			    buf[got.offset[i] + 1];
+		}
+		SPE_CHECK(header == got.header[i]);
+		SPE_CHECK(i == 0 || got.offset[i] > got.offset[i - 1]);
+	}
+}
+
+int
+main(void)
+{
+	static const size_t maxes[] = { 1, 3, 256, MAX_PACKETS };
+	static const size_t splits[] = { 1, 7, SIZE_MAX };
+
+	build();
+	for (size_t i = 0; i < sizeof(maxes) / sizeof(maxes[0]); i++) {
+		for (size_t j = 0; j < sizeof(splits) / sizeof(splits[0]);
+		    j++) {
+			check(0, maxes[i], splits[j]);
+			check(SPE_PACKET_DECODE_SKIP_PADDING, maxes[i],
+			    splits[j]);
+		}
+	}
+
+	return (spe_test_result());
+}
@@ -0,0 +1,222 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Check the C++ wrapper gives the same results as the C API */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <spedecode.hpp>
+
+#include "spe_test.h"
+
+namespace {
+
+constexpr unsigned int nrecords = 64;
+
+/* The records from spe_test_record with some padding between them */
+std::vector<uint8_t>
+build()
+{
+	std::vector<uint8_t> buf;
+	uint8_t tmp[SPE_TEST_RECORD_MAX];
+	spe_record rec;
+	size_t len;
+
+	for (unsigned int i = 0; i < nrecords; i++) {
+		spe_test_record(&rec, i);
+		len = spe_test_put_record(tmp, &rec);
+		buf.insert(buf.end(), tmp, tmp + len);
+		buf.insert(buf.end(), i % 4, 0x00);
+	}
+	return (buf);
+}
+
+bool
+packet_equal(const spe::any_packet &a, const spe::any_packet &b)
+{
+	return (a.type == b.type && a.header == b.header &&
+	    a.data == b.data && a.offset == b.offset);
+}
+
+/* The packets from spe_packet_decode_batch */
+std::vector<spe::any_packet>
+c_packets(const std::vector<uint8_t> &buf, int flags)
+{
+	std::vector<spe::any_packet> pkts;
+	spe_decode_ctx *ctx;
+	uint8_t type[16];
+	uint16_t header[16];
+	uint64_t data[16], offset[16];
+	spe_packet_batch batch = { type, header, data, offset };
+	size_t count;
+
+	ctx = spe_decode_ctx_alloc();
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, const_cast<uint8_t *>(buf.data()),
+	    buf.size()));
+	while ((count = spe_packet_decode_batch(ctx, flags, &batch, 16)) > 0) {
+		for (size_t i = 0; i < count; i++) {
+			pkts.push_back(spe::any_packet{
+			    static_cast<spe_packet_type>(type[i]), header[i],
+			    data[i], offset[i] });
+		}
+	}
+	spe_decode_ctx_free(ctx);
+	return (pkts);
+}
+
+/* The packet iterator matches the C batch API */
+void
+test_packets(const std::vector<uint8_t> &buf)
+{
+	for (int flags : { 0, SPE_PACKET_DECODE_SKIP_PADDING }) {
+		std::vector<spe::any_packet> expect = c_packets(buf, flags);
+		spe::decoder dec;
+		size_t n = 0;
+
+		SPE_CHECK(dec.add(buf.data(), buf.size()));
+		for (spe::any_packet pkt : dec.packets(flags)) {
+			SPE_CHECK(n < expect.size());
+			if (n < expect.size()) {
+				SPE_CHECK(packet_equal(pkt, expect[n]));
+			}
+			n++;
+		}
+		SPE_CHECK(n == expect.size());
+	}
+}
+
+/* Only the packet types with an overload are passed to the visitor */
+struct visitor {
+	std::vector<spe::any_packet> pkts;
+
+	template <spe_packet_type Type>
+	void
+	push(const spe::packet<Type> &pkt)
+	{
+		pkts.push_back(spe::any_packet{ Type, pkt.header, pkt.data,
+		    pkt.offset });
+	}
+
+	void operator()(const spe::address_packet &pkt) { push(pkt); }
+	void operator()(const spe::end_packet &pkt) { push(pkt); }
+	void operator()(const spe::timestamp_packet &pkt) { push(pkt); }
+};
+
+void
+test_visitor(const std::vector<uint8_t> &buf)
+{
+	std::vector<spe::any_packet> all, expect;
+	spe::decoder dec;
+	visitor v;
+	size_t total;
+
+	all = c_packets(buf, SPE_PACKET_DECODE_SKIP_PADDING);
+	for (const spe::any_packet &pkt : all) {
+		if (pkt.type == SPE_PKT_ADDRESS || pkt.type == SPE_PKT_END ||
+		    pkt.type == SPE_PKT_TIMESTAMP) {
+			expect.push_back(pkt);
+		}
+	}
+
+	SPE_CHECK(dec.add(buf.data(), buf.size()));
+	total = dec.decode(v);
+	SPE_CHECK(total == all.size());
+	SPE_CHECK(v.pkts.size() == expect.size());
+	for (size_t i = 0; i < v.pkts.size() && i < expect.size(); i++) {
+		SPE_CHECK(packet_equal(v.pkts[i], expect[i]));
+	}
+}
+
+/*
+ * The record iterator and decode_records give the shared test records.
+ * After reset the decoder can be used again.
+ */
+void
+test_records(const std::vector<uint8_t> &buf)
+{
+	spe::decoder dec;
+	spe_record expect;
+	unsigned int n;
+
+	SPE_CHECK(dec.add(buf.data(), buf.size()));
+	n = 0;
+	for (const spe_record &rec : dec.records()) {
+		spe_test_record(&expect, n++);
+		SPE_CHECK(spe_test_record_equal(&rec, &expect));
+	}
+	SPE_CHECK(n == nrecords);
+
+	dec.reset();
+	SPE_CHECK(dec.add(buf.data(), buf.size()));
+	n = 0;
+	dec.decode_records([&n](const spe_record &rec) {
+		spe_record want;
+
+		spe_test_record(&want, n++);
+		SPE_CHECK(spe_test_record_equal(&rec, &want));
+	});
+	SPE_CHECK(n == nrecords);
+}
+
+/* Moving a decoder moves the context */
+void
+test_move(const std::vector<uint8_t> &buf)
+{
+	spe::decoder a;
+	spe_decode_ctx *ctx;
+	unsigned int n;
+
+	ctx = a.get();
+	SPE_CHECK(a.add(buf.data(), buf.size()));
+	spe::decoder b(std::move(a));
+	SPE_CHECK(b.get() == ctx);
+	n = 0;
+	for (const spe_record &rec : b.records()) {
+		(void)rec;
+		n++;
+	}
+	SPE_CHECK(n == nrecords);
+}
+
+} /* namespace */
+
+int
+main()
+{
+	std::vector<uint8_t> buf = build();
+
+	test_packets(buf);
+	test_visitor(buf);
+	test_records(buf);
+	test_move(buf);
+
+	return (spe_test_result());
+}
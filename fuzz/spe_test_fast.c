@@ -0,0 +1,192 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spe_test.h"
+
+#define	NGROUPS		32
+#define	GROUP_PACKETS	5
+#define	GROUP_LEN	(1 + 2 + 3 + 5 + 9)
+#define	NPACKETS	(NGROUPS * GROUP_PACKETS)
+
+static uint8_t buf[NGROUPS * GROUP_LEN];
+static size_t buf_len;
+
+/* The packets passed to the callbacks */
+struct result {
+	spe_packet_type type[NPACKETS];
+	uint64_t data[NPACKETS];
+	size_t count;
+};
+
+/*
+ * Packets with each data length. All the payload bytes are non-zero, so
+ * a payload read with too wide a load would pick up the following bytes.
+ */
+static void
+build(void)
+{
+	buf_len = 0;
+	for (uint64_t i = 0; i < NGROUPS; i++) {
+		buf_len += spe_test_put(buf + buf_len, 0x01, 0, 0);
+		buf_len += spe_test_put(buf + buf_len, 0x49, 0x80 | i, 1);
+		buf_len += spe_test_put(buf + buf_len, 0x98, 0xf0f0 + i, 2);
+		buf_len += spe_test_put(buf + buf_len, 0x64, 0xe0e0e0e0 + i,
+		    4);
+		buf_len += spe_test_put(buf + buf_len, 0xb0,
+		    0xd0d0d0d0d0d0d0d0ull + i, 8);
+	}
+}
+
+static void
+packet_cb(struct spe_decode_ctx *ctx, void *arg, spe_packet_type type,
+    uint16_t header, uint64_t data)
+{
+	struct result *res;
+
+	(void)ctx;
+	(void)header;
+
+	res = arg;
+	SPE_CHECK(res->count < NPACKETS);
+	if (res->count < NPACKETS) {
+		res->type[res->count] = type;
+		res->data[res->count] = data;
+		res->count++;
+	}
+}
+
+/*
+ * Decode with callbacks for the types in mask only, adding the data in
+ * parts of split bytes. Near the end of a part the slow path is used,
+ * elsewhere the fast path. Returns the number of packets decoded.
+ */
+static size_t
+decode(uint32_t mask, size_t split, struct result *res)
+{
+	struct spe_decode_ctx *ctx;
+	struct spe_decode_stats stats;
+	size_t count, len, total;
+
+	memset(res, 0, sizeof(*res));
+	ctx = spe_decode_ctx_alloc();
+	for (int i = 0; i < SPE_PKT_MAX; i++) {
+		if ((mask & (1u << i)) != 0) {
+			spe_packet_decode_set_callback(ctx, (spe_packet_type)i,
+			    packet_cb);
+		}
+	}
+	spe_packet_decode_set_callback_data(ctx, res);
+
+	count = 0;
+	for (size_t off = 0; off < buf_len; off += len) {
+		len = buf_len - off < split ? buf_len - off : split;
+		SPE_CHECK(spe_decode_ctx_add(ctx, SPE_FLAG_MUST_COPY,
+		    buf + off, len));
+		while (spe_packet_decode_next(ctx, 0)) {
+			count++;
+		}
+	}
+
+	/* Every packet was counted and the decoder reached the end */
+	if (spe_decode_ctx_get_stats(ctx, &stats)) {
+		total = 0;
+		for (int i = 0; i < SPE_PKT_MAX; i++) {
+			total += stats.packets[i];
+		}
+		SPE_CHECK(total == NPACKETS);
+		SPE_CHECK(stats.bytes_decoded == buf_len);
+	}
+	spe_decode_ctx_free(ctx);
+
+	return (count);
+}
+
+static void
+check(size_t split)
+{
+	static const uint32_t masks[] = {
+		0,
+		1u << SPE_PKT_ADDRESS,
+		(1u << SPE_PKT_COUNTER) | (1u << SPE_PKT_END),
+		(1u << SPE_PKT_OPERATION_TYPE) | (1u << SPE_PKT_CONTEXT),
+	};
+	struct result all, res;
+	size_t n;
+
+	/* With a callback for every type the payloads are all read */
+	SPE_CHECK(decode(UINT32_MAX, split, &all) == NPACKETS);
+	SPE_CHECK(all.count == NPACKETS);
+	for (size_t i = 0; i + GROUP_PACKETS <= all.count;
+	    i += GROUP_PACKETS) {
+		uint64_t g = i / GROUP_PACKETS;
+
+		SPE_CHECK(all.type[i] == SPE_PKT_END && all.data[i] == 0);
+		SPE_CHECK(all.data[i + 1] == (0x80 | g));
+		SPE_CHECK(all.data[i + 2] == 0xf0f0 + g);
+		SPE_CHECK(all.data[i + 3] == 0xe0e0e0e0 + g);
+		SPE_CHECK(all.data[i + 4] == 0xd0d0d0d0d0d0d0d0ull + g);
+	}
+
+	/*
+	 * Packets without a callback are skipped without reading their
+	 * payload, but the decoder still moves past them.
+	 */
+	for (size_t m = 0; m < sizeof(masks) / sizeof(masks[0]); m++) {
+		SPE_CHECK(decode(masks[m], split, &res) == NPACKETS);
+		n = 0;
+		for (size_t i = 0; i < all.count; i++) {
+			if ((masks[m] & (1u << all.type[i])) == 0) {
+				continue;
+			}
+			SPE_CHECK(n < res.count);
+			if (n < res.count) {
+				SPE_CHECK(res.type[n] == all.type[i]);
+				SPE_CHECK(res.data[n] == all.data[i]);
+			}
+			n++;
+		}
+		SPE_CHECK(n == res.count);
+	}
+}
+
+int
+main(void)
+{
+	build();
+	check(SIZE_MAX);
+	check(3);
+	check(11);
+
+	return (spe_test_result());
+}
@@ -0,0 +1,204 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spe_test.h"
+
+/* A user space load that missed in the L1D and a kernel branch */
+static struct spe_record load_rec, branch_rec;
+
+static void
+build(void)
+{
+	load_rec = (struct spe_record){ 0 };
+	load_rec.present = SPE_RECORD_ADDR(SPE_ADDRESS_IDX_PC_VA) |
+	    SPE_RECORD_ADDR(SPE_ADDRESS_IDX_DATA_VA) |
+	    SPE_RECORD_COUNTER(SPE_COUNTER_IDX_TOTAL_LAT) |
+	    SPE_RECORD_OPERATION_TYPE | SPE_RECORD_EVENTS |
+	    SPE_RECORD_DATA_SOURCE | SPE_RECORD_TIMESTAMP;
+	/* Non-secure EL0 */
+	load_rec.addr[SPE_ADDRESS_IDX_PC_VA] = (1ull << 63) | 0x400100;
+	load_rec.addr[SPE_ADDRESS_IDX_DATA_VA] = 0x7fff0040;
+	load_rec.counter[SPE_COUNTER_IDX_TOTAL_LAT] = 300;
+	load_rec.op_class = SPE_OPERATION_TYPE_LOAD_STORE;
+	load_rec.events = (1ull << SPE_EVENT_RETIRED) |
+	    (1ull << SPE_EVENT_L1D_REFILL) |
+	    (1ull << SPE_EVENT_TRANSACTIONAL);
+	load_rec.data_source = 3;
+	load_rec.timestamp = 1000;
+
+	branch_rec = (struct spe_record){ 0 };
+	branch_rec.present = SPE_RECORD_ADDR(SPE_ADDRESS_IDX_PC_VA) |
+	    SPE_RECORD_ADDR(SPE_ADDRESS_IDX_B_TARGET) |
+	    SPE_RECORD_OPERATION_TYPE | SPE_RECORD_EVENTS | SPE_RECORD_END;
+	/* EL1 with a sign extended kernel address */
+	branch_rec.addr[SPE_ADDRESS_IDX_PC_VA] = (1ull << 61) |
+	    0x00ff800010000000ull;
+	branch_rec.addr[SPE_ADDRESS_IDX_B_TARGET] = 0x2000;
+	branch_rec.op_class = SPE_OPERATION_TYPE_BRANCH;
+	branch_rec.op_subclass = 0x01;
+	branch_rec.events = (1ull << SPE_EVENT_RETIRED) |
+	    (1ull << SPE_EVENT_MISPREDICTED);
+	branch_rec.source = 2;
+	branch_rec.present |= SPE_RECORD_SOURCE;
+}
+
+static const struct {
+	const char *expr;
+	bool load;		/* Matches load_rec */
+	bool branch;		/* Matches branch_rec */
+} match_tests[] = {
+	{ "pc == 0x400100", true, false },
+	{ "pc == 0xffff800010000000", false, true },
+	{ "el == 0", true, false },
+	{ "el == 1 && ns == 0", false, true },
+	{ "op_class == load_store", true, false },
+	{ "op_class == branch && branch_target == 0x2000", false, true },
+	{ "op_subclass == 1", false, true },
+	{ "total_lat > 200", true, false },
+	{ "total_lat > 300", false, false },
+	{ "total_lat >= 300 && total_lat <= 300", true, false },
+	{ "total_lat != 300", false, false },
+	{ "data_va < 0x80000000", true, false },
+	{ "data_source == 3", true, false },
+	{ "timestamp", true, false },
+	{ "source == 2", false, true },
+	{ "!(source == 2)", true, false },
+	{ "retired", true, true },
+	{ "l1d_refill", true, false },
+	{ "!l1d_refill", false, true },
+	{ "mispredicted || l1d_refill", true, true },
+	{ "transactional", true, false },
+	{ "events & 0x8", true, false },
+	{ "(events & 0x80) == 0x80", false, true },
+	/* A missing field makes the comparison false */
+	{ "issue_lat == 0", false, false },
+	{ "!(issue_lat == 0)", true, true },
+	{ "context == 0 || retired", true, true },
+	{ "!!(pc & 0x100)", true, false },
+	{ "1", true, true },
+	{ "0", false, false },
+	{ "load_store == 1 && branch == 2 && other == 0", true, true },
+};
+
+static void
+test_match(void)
+{
+	struct spe_filter *filter;
+	char err[128];
+
+	for (size_t i = 0; i < sizeof(match_tests) / sizeof(match_tests[0]);
+	    i++) {
+		err[0] = '\0';
+		filter = spe_filter_compile(match_tests[i].expr, err,
+		    sizeof(err));
+		SPE_CHECK(filter != NULL);
+		if (filter == NULL) {
+			fprintf(stderr, "\"%s\": %s\n", match_tests[i].expr,
+			    err);
+			continue;
+		}
+		if (spe_filter_match(filter, &load_rec) !=
+		    match_tests[i].load ||
+		    spe_filter_match(filter, &branch_rec) !=
+		    match_tests[i].branch) {
+			fprintf(stderr, "\"%s\" mismatch\n",
+			    match_tests[i].expr);
+			spe_test_failures++;
+		}
+		spe_filter_free(filter);
+	}
+}
+
+static const char *const error_tests[] = {
+	"",
+	"pc ==",
+	"pc == == 1",
+	"no_such_field == 1",
+	"(pc == 1",
+	"pc == 1)",
+	"pc = 1",
+	"l2d_access",
+	"0x",
+	"99999999999999999999999",
+};
+
+static void
+test_errors(void)
+{
+	struct spe_filter *filter;
+	char err[128], deep[256];
+	size_t len;
+
+	for (size_t i = 0; i < sizeof(error_tests) / sizeof(error_tests[0]);
+	    i++) {
+		err[0] = '\0';
+		filter = spe_filter_compile(error_tests[i], err, sizeof(err));
+		if (filter != NULL) {
+			fprintf(stderr, "\"%s\" compiled\n", error_tests[i]);
+			spe_test_failures++;
+			spe_filter_free(filter);
+			continue;
+		}
+		SPE_CHECK(err[0] != '\0');
+	}
+
+	/* Errors may be ignored */
+	SPE_CHECK(spe_filter_compile("pc ==", NULL, 0) == NULL);
+
+	/* An expression deeper than the stack */
+	len = 0;
+	for (size_t i = 0; i < 40; i++) {
+		len += (size_t)snprintf(deep + len, sizeof(deep) - len,
+		    "1 & (");
+	}
+	len += (size_t)snprintf(deep + len, sizeof(deep) - len, "1");
+	for (size_t i = 0; i < 40; i++) {
+		len += (size_t)snprintf(deep + len, sizeof(deep) - len, ")");
+	}
+	SPE_CHECK(len < sizeof(deep));
+	err[0] = '\0';
+	SPE_CHECK(spe_filter_compile(deep, err, sizeof(err)) == NULL);
+	SPE_CHECK(strstr(err, "too complex") != NULL);
+}
+
+int
+main(void)
+{
+	build();
+	test_match();
+	test_errors();
+
+	return (spe_test_result());
+}
@@ -0,0 +1,172 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spedecode_internal.h"
+#include "spe_test.h"
+
+/*
+ * The header encodings as they were matched one at a time before the
+ * lookup tables, to check the tables against.
+ */
+static const struct {
+	uint16_t val;
+	uint16_t mask;
+	int width;
+	spe_packet_type type;
+} ref_headers[] = {
+	{ 0xb0, 0xf8, 1, SPE_PKT_ADDRESS },
+	{ 0x20b0, 0xfcf8, 2, SPE_PKT_ADDRESS },
+	{ 0x64, 0xfc, 1, SPE_PKT_CONTEXT },
+	{ 0x98, 0xf8, 1, SPE_PKT_COUNTER },
+	{ 0x2098, 0xfcf8, 2, SPE_PKT_COUNTER },
+	{ 0x43, 0xcf, 1, SPE_PKT_DATA_SOURCE },
+	{ 0x01, 0xff, 1, SPE_PKT_END },
+	{ 0x42, 0xcf, 1, SPE_PKT_EVENTS },
+	{ 0x48, 0xfc, 1, SPE_PKT_OPERATION_TYPE },
+	{ 0x00, 0xff, 1, SPE_PKT_PADDING },
+	{ 0x71, 0xff, 1, SPE_PKT_TIMESTAMP },
+};
+
+static spe_packet_type
+ref_type(uint16_t header, int header_len)
+{
+	for (size_t i = 0; i < SPE_NITEMS(ref_headers); i++) {
+		if (ref_headers[i].width == header_len &&
+		    (header & ref_headers[i].mask) == ref_headers[i].val) {
+			return (ref_headers[i].type);
+		}
+	}
+	return (SPE_PKT_UNKNOWN);
+}
+
+static int
+ref_data_len(uint16_t header)
+{
+	if (header < 0x20) {
+		return (0);
+	}
+	return (1 << ((header >> 4) & 3));
+}
+
+static void
+packet_cb(struct spe_decode_ctx *ctx, void *data, spe_packet_type type,
+    uint16_t header, uint64_t payload)
+{
+	spe_packet_type *typep;
+
+	(void)ctx;
+	(void)header;
+	(void)payload;
+
+	typep = data;
+	*typep = type;
+}
+
+/*
+ * Decode a packet with the header followed by 8 bytes of data through
+ * spe_packet_decode_next, which uses the entry stored by
+ * spe_packet_get_header.
+ */
+static void
+check_decode(uint16_t header, int header_len)
+{
+	struct spe_decode_ctx *ctx;
+	spe_packet_type type;
+	uint8_t buf[10];
+	uint16_t got_header;
+	int data_len, got_len;
+
+	memset(buf, 0xaa, sizeof(buf));
+	if (header_len == 2) {
+		buf[0] = (uint8_t)(header >> 8);
+		buf[1] = (uint8_t)header;
+	} else {
+		buf[0] = (uint8_t)header;
+	}
+
+	ctx = spe_decode_ctx_alloc();
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf, sizeof(buf)));
+	for (int i = 0; i < SPE_PKT_MAX; i++) {
+		spe_packet_decode_set_callback(ctx, (spe_packet_type)i,
+		    packet_cb);
+	}
+	type = SPE_PKT_INVALID;
+	spe_packet_decode_set_callback_data(ctx, &type);
+	SPE_CHECK(spe_packet_decode_next(ctx, 0));
+	SPE_CHECK(type == ref_type(header, header_len));
+	spe_decode_ctx_free(ctx);
+
+	ctx = spe_decode_ctx_alloc();
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf, sizeof(buf)));
+	SPE_CHECK(spe_packet_get_header(ctx, 0, &got_header, &got_len));
+	SPE_CHECK(got_header == header && got_len == header_len);
+	SPE_CHECK(spe_packet_data_len(ctx, &data_len));
+	SPE_CHECK(data_len == ref_data_len(header));
+	spe_decode_ctx_free(ctx);
+}
+
+static void
+check_header(uint16_t header, int header_len)
+{
+	const struct spe_header_info *info;
+	spe_packet_type type;
+
+	info = spe_header_lookup(header, header_len);
+	type = ref_type(header, header_len);
+	SPE_CHECK(info->type == type);
+	SPE_CHECK(info->data_len == ref_data_len(header));
+	if (type == SPE_PKT_ADDRESS) {
+		SPE_CHECK(info->index == SPE_ADDRESS_INDEX(header));
+	} else if (type == SPE_PKT_COUNTER) {
+		SPE_CHECK(info->index == SPE_COUNTER_INDEX(header));
+	}
+	check_decode(header, header_len);
+}
+
+int
+main(void)
+{
+	/* Every one byte header, 0x20 - 0x3f start an extended header */
+	for (unsigned int header = 0; header < 0x100; header++) {
+		if (header < 0x20 || header >= 0x40) {
+			check_header((uint16_t)header, 1);
+		}
+	}
+	/* The tables for 0x2000 - 0x23ff and the rest of the space */
+	for (unsigned int header = 0x2000; header < 0x4000; header++) {
+		check_header((uint16_t)header, 2);
+	}
+
+	return (spe_test_result());
+}
@@ -0,0 +1,192 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spe_test.h"
+
+/* Enough records for a full block and part of the next */
+#define	NRECORDS	(SPE_RECFILE_BLOCK_RECORDS + 100)
+
+struct mem_file {
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+	bool fail;
+};
+
+static bool
+mem_write(void *data, const void *buf, size_t len)
+{
+	struct mem_file *file;
+	void *tmp;
+
+	file = data;
+	if (file->fail) {
+		return (false);
+	}
+	if (file->len + len > file->size) {
+		file->size = (file->len + len) * 2;
+		tmp = realloc(file->buf, file->size);
+		SPE_CHECK(tmp != NULL);
+		if (tmp == NULL) {
+			return (false);
+		}
+		file->buf = tmp;
+	}
+	memcpy(file->buf + file->len, buf, len);
+	file->len += len;
+
+	return (true);
+}
+
+/* The test records, some with a source as set by the caller */
+static void
+test_record(struct spe_record *rec, unsigned int n)
+{
+	spe_test_record(rec, n);
+	if (n % 4 == 3) {
+		rec->source = n % 64;
+		rec->present |= SPE_RECORD_SOURCE;
+	}
+}
+
+static void
+write_file(struct mem_file *file, size_t count)
+{
+	struct spe_recfile_writer *w;
+	struct spe_record rec;
+
+	memset(file, 0, sizeof(*file));
+	w = spe_recfile_writer_alloc(mem_write, file);
+	SPE_CHECK(w != NULL);
+	for (size_t i = 0; i < count; i++) {
+		test_record(&rec, (unsigned int)i);
+		SPE_CHECK(spe_recfile_write(w, &rec));
+	}
+	SPE_CHECK(spe_recfile_writer_free(w));
+}
+
+static void
+test_round_trip(void)
+{
+	struct spe_recfile_block block;
+	struct spe_recfile rf;
+	struct spe_record rec, expect;
+	struct mem_file file;
+	size_t n, blocks;
+
+	write_file(&file, NRECORDS);
+	SPE_CHECK(spe_recfile_open(&rf, file.buf, file.len));
+
+	n = 0;
+	blocks = 0;
+	while (spe_recfile_next_block(&rf, &block)) {
+		SPE_CHECK(block.count <= SPE_RECFILE_BLOCK_RECORDS);
+		for (size_t i = 0; i < block.count; i++) {
+			spe_recfile_block_record(&block, i, &rec);
+			test_record(&expect, (unsigned int)n);
+			SPE_CHECK(spe_test_record_equal(&rec, &expect));
+			n++;
+		}
+		blocks++;
+	}
+	SPE_CHECK(!rf.error);
+	SPE_CHECK(n == NRECORDS);
+	SPE_CHECK(blocks == 2);
+	free(file.buf);
+}
+
+static void
+test_empty(void)
+{
+	struct spe_recfile_block block;
+	struct spe_recfile rf;
+	struct mem_file file;
+
+	write_file(&file, 0);
+	SPE_CHECK(spe_recfile_open(&rf, file.buf, file.len));
+	SPE_CHECK(!spe_recfile_next_block(&rf, &block));
+	SPE_CHECK(!rf.error);
+	free(file.buf);
+}
+
+/* Damaged files are rejected rather than read past their end */
+static void
+test_invalid(void)
+{
+	struct spe_recfile_block block;
+	struct spe_recfile rf;
+	struct mem_file file;
+
+	write_file(&file, 10);
+
+	SPE_CHECK(spe_recfile_open(&rf, file.buf, file.len - 64));
+	SPE_CHECK(!spe_recfile_next_block(&rf, &block));
+	SPE_CHECK(rf.error);
+
+	SPE_CHECK(!spe_recfile_open(&rf, file.buf, 16));
+
+	file.buf[0] = 'X';
+	SPE_CHECK(!spe_recfile_open(&rf, file.buf, file.len));
+	free(file.buf);
+}
+
+/* A write error is reported when the writer is freed */
+static void
+test_write_error(void)
+{
+	struct spe_recfile_writer *w;
+	struct spe_record rec;
+	struct mem_file file;
+
+	memset(&file, 0, sizeof(file));
+	w = spe_recfile_writer_alloc(mem_write, &file);
+	SPE_CHECK(w != NULL);
+	file.fail = true;
+	spe_test_record(&rec, 0);
+	spe_recfile_write(w, &rec);
+	SPE_CHECK(!spe_recfile_writer_free(w));
+	free(file.buf);
+}
+
+int
+main(void)
+{
+	test_round_trip();
+	test_empty();
+	test_invalid();
+	test_write_error();
+
+	return (spe_test_result());
+}
@@ -0,0 +1,165 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spe_test.h"
+
+#define	NRECORDS	64
+
+static uint8_t buf[NRECORDS * (SPE_TEST_RECORD_MAX + 4)];
+static size_t buf_len;
+
+/* Encode the test records with some padding between them */
+static void
+build(void)
+{
+	struct spe_record rec;
+
+	buf_len = 0;
+	for (unsigned int i = 0; i < NRECORDS; i++) {
+		spe_test_record(&rec, i);
+		buf_len += spe_test_put_record(buf + buf_len, &rec);
+		for (unsigned int j = 0; j < i % 4; j++) {
+			buf[buf_len++] = 0x00;
+		}
+	}
+}
+
+/* Check the records from a context match the ones encoded */
+static void
+check_records(struct spe_decode_ctx *ctx, unsigned int *np)
+{
+	struct spe_record rec, expect;
+
+	while (spe_record_decode_next(ctx, &rec)) {
+		SPE_CHECK(*np < NRECORDS);
+		if (*np >= NRECORDS) {
+			return;
+		}
+		spe_test_record(&expect, *np);
+		SPE_CHECK(spe_test_record_equal(&rec, &expect));
+		(*np)++;
+	}
+}
+
+/* The whole buffer added at once */
+static void
+test_single(void)
+{
+	struct spe_decode_ctx *ctx;
+	struct spe_record rec;
+	unsigned int n;
+
+	ctx = spe_decode_ctx_alloc();
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf, buf_len));
+	n = 0;
+	check_records(ctx, &n);
+	SPE_CHECK(n == NRECORDS);
+	SPE_CHECK(!spe_record_decode_flush(ctx, &rec));
+	spe_decode_ctx_free(ctx);
+}
+
+/* One byte at a time so every packet is split across buffers */
+static void
+test_bytes(void)
+{
+	struct spe_decode_ctx *ctx;
+	unsigned int n;
+
+	ctx = spe_decode_ctx_alloc();
+	n = 0;
+	for (size_t i = 0; i < buf_len; i++) {
+		SPE_CHECK(spe_decode_ctx_add(ctx, SPE_FLAG_MUST_COPY,
+		    buf + i, 1));
+		check_records(ctx, &n);
+	}
+	SPE_CHECK(n == NRECORDS);
+	spe_decode_ctx_free(ctx);
+}
+
+static void
+test_batch(void)
+{
+	struct spe_decode_ctx *ctx;
+	struct spe_record recs[NRECORDS + 1], expect;
+	size_t count;
+
+	ctx = spe_decode_ctx_alloc();
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf, buf_len));
+	count = spe_record_decode_batch(ctx, recs, 10);
+	SPE_CHECK(count == 10);
+	count += spe_record_decode_batch(ctx, recs + count,
+	    NRECORDS + 1 - count);
+	SPE_CHECK(count == NRECORDS);
+	for (size_t i = 0; i < count; i++) {
+		spe_test_record(&expect, (unsigned int)i);
+		SPE_CHECK(spe_test_record_equal(&recs[i], &expect));
+	}
+	spe_decode_ctx_free(ctx);
+}
+
+/* A record without an end or timestamp is only returned by the flush */
+static void
+test_flush(void)
+{
+	struct spe_decode_ctx *ctx;
+	struct spe_record rec, expect;
+	uint8_t data[SPE_TEST_RECORD_MAX];
+	size_t len;
+
+	spe_test_record(&expect, 1);
+	len = spe_test_put_record(data, &expect);
+	/* Drop the end packet */
+	len--;
+	expect.present &= ~SPE_RECORD_END;
+
+	ctx = spe_decode_ctx_alloc();
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, data, len));
+	SPE_CHECK(!spe_record_decode_next(ctx, &rec));
+	SPE_CHECK(spe_record_decode_flush(ctx, &rec));
+	SPE_CHECK(spe_test_record_equal(&rec, &expect));
+	SPE_CHECK(!spe_record_decode_flush(ctx, &rec));
+	spe_decode_ctx_free(ctx);
+}
+
+int
+main(void)
+{
+	build();
+	test_single();
+	test_bytes();
+	test_batch();
+	test_flush();
+
+	return (spe_test_result());
+}
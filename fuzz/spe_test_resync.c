@@ -0,0 +1,235 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spe_test.h"
+
+#define	NRECORDS	9
+
+static uint8_t buf[(NRECORDS + 1) * (SPE_TEST_RECORD_MAX + 8)];
+static size_t buf_len;
+static uint64_t bad_start, bad_end;
+
+/* The records decoded and the bytes skipped */
+struct result {
+	struct spe_record recs[NRECORDS];
+	size_t count;
+	unsigned int skips;
+	uint64_t skip_start;
+	uint64_t skip_end;
+};
+
+/*
+ * Encode the test records with padding between them. Record bad has a
+ * second events packet so can't be valid and is skipped. Each record
+ * starts with a counter the record doesn't keep. It has a two byte header
+ * so the boundary after the bad record is split within a header.
+ */
+static void
+build(unsigned int bad)
+{
+	struct spe_record rec;
+
+	buf_len = 0;
+	for (unsigned int i = 0; i < NRECORDS; i++) {
+		spe_test_record(&rec, i);
+		if (i == bad) {
+			bad_start = buf_len;
+			buf_len += spe_test_put(buf + buf_len, 0x72, 0, 8);
+		}
+		buf[buf_len++] = 0x21;
+		buf_len += spe_test_put(buf + buf_len, 0x98, 0x22, 2);
+		buf_len += spe_test_put_record(buf + buf_len, &rec);
+		if (i == bad) {
+			bad_end = buf_len;
+		}
+		for (unsigned int j = 0; j < i % 4; j++) {
+			buf[buf_len++] = 0x00;
+		}
+	}
+}
+
+static void
+resync_cb(struct spe_decode_ctx *ctx, void *data, uint64_t start,
+    uint64_t end)
+{
+	struct result *res;
+
+	(void)ctx;
+
+	res = data;
+	res->skips++;
+	res->skip_start = start;
+	res->skip_end = end;
+}
+
+static struct spe_decode_ctx *
+resync_ctx(struct result *res)
+{
+	struct spe_decode_ctx *ctx;
+
+	memset(res, 0, sizeof(*res));
+	ctx = spe_decode_ctx_alloc();
+	spe_decode_ctx_set_resync_cb(ctx, resync_cb);
+	spe_packet_decode_set_callback_data(ctx, res);
+	return (ctx);
+}
+
+/* Decode the records available, or the ones left at the end if flush */
+static void
+collect(struct spe_decode_ctx *ctx, struct result *res, bool flush)
+{
+	struct spe_record rec;
+
+	while (flush ? spe_record_decode_flush(ctx, &rec) :
+	    spe_record_decode_next(ctx, &rec)) {
+		SPE_CHECK(res->count < NRECORDS);
+		if (res->count < NRECORDS) {
+			res->recs[res->count++] = rec;
+		}
+	}
+}
+
+static bool
+result_equal(const struct result *a, const struct result *b)
+{
+	if (a->count != b->count || a->skips != b->skips ||
+	    a->skip_start != b->skip_start || a->skip_end != b->skip_end) {
+		return (false);
+	}
+	for (size_t i = 0; i < a->count; i++) {
+		if (!spe_test_record_equal(&a->recs[i], &b->recs[i])) {
+			return (false);
+		}
+	}
+	return (true);
+}
+
+/* The whole buffer at once, only the bad record is dropped */
+static void
+test_single(unsigned int bad, struct result *ref)
+{
+	struct spe_decode_ctx *ctx;
+	struct spe_record expect;
+	size_t n;
+
+	ctx = resync_ctx(ref);
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf, buf_len));
+	collect(ctx, ref, false);
+	collect(ctx, ref, true);
+	spe_decode_ctx_free(ctx);
+
+	SPE_CHECK(ref->count == NRECORDS - 1);
+	SPE_CHECK(ref->skips == 1);
+	SPE_CHECK(ref->skip_start == bad_start);
+	SPE_CHECK(ref->skip_end == bad_end);
+	n = 0;
+	for (unsigned int i = 0; i < NRECORDS && n < ref->count; i++) {
+		if (i == bad) {
+			continue;
+		}
+		spe_test_record(&expect, i);
+		SPE_CHECK(spe_test_record_equal(&ref->recs[n], &expect));
+		n++;
+	}
+}
+
+/*
+ * Split the data in two at every offset, so the record boundary after the
+ * bad record is split across them at some point. The first buffer is
+ * released and overwritten before the second is added to check the data
+ * still needed for the scan is kept.
+ */
+static void
+test_split(const struct result *ref)
+{
+	struct spe_decode_ctx *ctx;
+	struct result res;
+	uint8_t first[sizeof(buf)];
+
+	for (size_t split = 1; split < buf_len; split++) {
+		ctx = resync_ctx(&res);
+		memcpy(first, buf, split);
+		SPE_CHECK(spe_decode_ctx_add(ctx, 0, first, split));
+		collect(ctx, &res, false);
+		SPE_CHECK(spe_decode_ctx_release(ctx, first));
+		memset(first, 0xff, split);
+		SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf + split,
+		    buf_len - split));
+		collect(ctx, &res, false);
+		collect(ctx, &res, true);
+		spe_decode_ctx_free(ctx);
+
+		SPE_CHECK(result_equal(&res, ref));
+	}
+}
+
+/* One byte at a time so every packet is split across buffers */
+static void
+test_bytes(const struct result *ref)
+{
+	struct spe_decode_ctx *ctx;
+	struct result res;
+
+	ctx = resync_ctx(&res);
+	for (size_t i = 0; i < buf_len; i++) {
+		SPE_CHECK(spe_decode_ctx_add(ctx, SPE_FLAG_MUST_COPY,
+		    buf + i, 1));
+		collect(ctx, &res, false);
+	}
+	collect(ctx, &res, true);
+	spe_decode_ctx_free(ctx);
+
+	SPE_CHECK(result_equal(&res, ref));
+}
+
+int
+main(void)
+{
+	/*
+	 * Records without a 0x01 or 0x71 byte in their payloads, so the first
+	 * boundary found is after them. The last is only known to be a
+	 * boundary once the end of the data is known.
+	 */
+	static const unsigned int bad[] = { 2, 5, NRECORDS - 1 };
+	struct result ref;
+
+	for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		build(bad[i]);
+		test_single(bad[i], &ref);
+		test_split(&ref);
+		test_bytes(&ref);
+	}
+
+	return (spe_test_result());
+}
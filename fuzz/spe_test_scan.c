@@ -0,0 +1,175 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spedecode_internal.h"
+#include "spe_test.h"
+
+/* Longer than the widest vector loop plus its tail */
+#define	SCAN_LEN	100
+
+static uint64_t rand_state = 0x9e3779b97f4a7c15ull;
+
+static uint32_t
+test_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return ((uint32_t)(rand_state >> 32));
+}
+
+static size_t
+find_ref(const uint8_t *buf, size_t off, size_t len)
+{
+	for (; off < len; off++) {
+		if (buf[off] == 0x01 || buf[off] == 0x71) {
+			return (off);
+		}
+	}
+	return (len);
+}
+
+static size_t
+skip_padding_ref(const uint8_t *buf, size_t off, size_t len)
+{
+	for (; off < len; off++) {
+		if (buf[off] != 0) {
+			return (off);
+		}
+	}
+	return (len);
+}
+
+static void
+check_scan(const uint8_t *buf, size_t off, size_t len)
+{
+	SPE_CHECK(spe_scan_find(buf, off, len) == find_ref(buf, off, len));
+	SPE_CHECK(spe_scan_skip_padding(buf, off, len) ==
+	    skip_padding_ref(buf, off, len));
+}
+
+/* Check every start offset, and every length from the start */
+static void
+check_scan_all(const uint8_t *buf, bool all_lens)
+{
+	for (size_t len = 0; len <= SCAN_LEN; len++) {
+		for (size_t off = 0; off <= len; off++) {
+			if (all_lens || len == SCAN_LEN || off == 0) {
+				check_scan(buf, off, len);
+			}
+		}
+	}
+}
+
+/*
+ * The vector loops in spe_scan_find and spe_scan_skip_padding give the
+ * same result as a scalar loop, at each alignment and with the matching
+ * byte in each lane.
+ */
+static void
+test_vector(void)
+{
+	static const uint8_t bytes[] = { 0x00, 0x01, 0x71, 0x70, 0xff };
+	uint8_t data[SCAN_LEN + 32];
+	uint8_t *buf;
+
+	for (size_t align = 0; align < 32; align++) {
+		buf = data + align;
+
+		/* A single match or non-zero byte at each offset */
+		for (size_t pos = 0; pos < SCAN_LEN; pos++) {
+			for (size_t i = 1; i < sizeof(bytes); i++) {
+				memset(buf, 0, SCAN_LEN);
+				buf[pos] = bytes[i];
+				check_scan_all(buf, false);
+			}
+		}
+
+		/* Mostly padding with a few other bytes */
+		for (int n = 0; n < 4; n++) {
+			for (size_t i = 0; i < SCAN_LEN; i++) {
+				buf[i] = test_rand() % 8 == 0 ?
+				    bytes[test_rand() % sizeof(bytes)] : 0;
+			}
+			check_scan_all(buf, true);
+		}
+	}
+}
+
+/*
+ * Running out of data after a boundary is valid, including part way
+ * through a two byte header.
+ */
+static void
+test_short(void)
+{
+	static const uint8_t end[] = { 0x01 };
+	static const uint8_t end_long[] = { 0x01, 0x20 };
+	static const uint8_t end_pad[] = { 0x01, 0x00, 0x00 };
+	static const uint8_t end_addr[] = { 0x01, 0xb0, 0x00 };
+	static const uint8_t end_unknown[] = { 0x01, 0x02, 0x01 };
+
+	SPE_CHECK(spe_scan_record_next(end, sizeof(end), 0) == 1);
+	SPE_CHECK(spe_scan_record_next(end_long, sizeof(end_long), 0) == 1);
+	SPE_CHECK(spe_scan_record_next(end_pad, sizeof(end_pad), 0) == 1);
+	SPE_CHECK(spe_scan_record_next(end_addr, sizeof(end_addr), 0) == 1);
+	/* 0x02 is unknown so the first 0x01 isn't followed by a record */
+	SPE_CHECK(spe_scan_record_next(end_unknown, sizeof(end_unknown),
+	    0) == 3);
+}
+
+/* A record of 32 packets without a terminator isn't a record */
+static void
+test_too_long(void)
+{
+	uint8_t buf[1 + (SPE_RECORD_MAX_PACKETS + 1) * 3];
+	size_t len;
+
+	len = 0;
+	buf[len++] = 0x01;
+	for (int i = 0; i <= SPE_RECORD_MAX_PACKETS; i++) {
+		len += spe_test_put(buf + len, 0x98, 0x202, 2);
+	}
+	SPE_CHECK(spe_scan_record_next(buf, len, 0) == len);
+}
+
+int
+main(void)
+{
+	test_vector();
+	test_short();
+	test_too_long();
+
+	return (spe_test_result());
+}
@@ -0,0 +1,294 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spe_test.h"
+
+#define	NRECORDS	16
+#define	MAX_PACKETS	(NRECORDS * 16)
+#define	NPARTS		5
+
+static uint8_t buf[NRECORDS * SPE_TEST_RECORD_MAX];
+static size_t buf_len;
+
+/* The packets decoded and the buffers passed to the release callback */
+struct result {
+	uint16_t header[MAX_PACKETS];
+	uint64_t data[MAX_PACKETS];
+	size_t count;
+	const void *released[NPARTS];
+	size_t released_count[NPARTS];	/* Packets decoded when released */
+	size_t nreleased;
+};
+
+static void
+build(void)
+{
+	struct spe_record rec;
+
+	buf_len = 0;
+	for (unsigned int i = 0; i < NRECORDS; i++) {
+		spe_test_record(&rec, i);
+		buf_len += spe_test_put_record(buf + buf_len, &rec);
+	}
+}
+
+static void
+packet_cb(struct spe_decode_ctx *ctx, void *data, spe_packet_type type,
+    uint16_t header, uint64_t payload)
+{
+	struct result *res;
+
+	(void)ctx;
+	(void)type;
+
+	res = data;
+	SPE_CHECK(res->count < MAX_PACKETS);
+	if (res->count < MAX_PACKETS) {
+		res->header[res->count] = header;
+		res->data[res->count] = payload;
+		res->count++;
+	}
+}
+
+static void
+release_cb(struct spe_decode_ctx *ctx, void *data, void *rel, size_t len)
+{
+	struct result *res;
+
+	(void)ctx;
+	(void)len;
+
+	res = data;
+	SPE_CHECK(res->nreleased < NPARTS);
+	if (res->nreleased < NPARTS) {
+		res->released[res->nreleased] = rel;
+		res->released_count[res->nreleased] = res->count;
+		res->nreleased++;
+	}
+}
+
+static struct spe_decode_ctx *
+result_ctx(struct result *res)
+{
+	struct spe_decode_ctx *ctx;
+
+	memset(res, 0, sizeof(*res));
+	ctx = spe_decode_ctx_alloc();
+	for (int i = 0; i < SPE_PKT_MAX; i++) {
+		spe_packet_decode_set_callback(ctx, (spe_packet_type)i,
+		    packet_cb);
+	}
+	spe_packet_decode_set_callback_data(ctx, res);
+	spe_decode_ctx_set_release_cb(ctx, release_cb, res);
+	return (ctx);
+}
+
+static bool
+packets_equal(const struct result *a, const struct result *b)
+{
+	if (a->count != b->count) {
+		return (false);
+	}
+	for (size_t i = 0; i < a->count; i++) {
+		if (a->header[i] != b->header[i] || a->data[i] != b->data[i]) {
+			return (false);
+		}
+	}
+	return (true);
+}
+
+static void
+decode_all(struct spe_decode_ctx *ctx)
+{
+	while (spe_packet_decode_next(ctx, SPE_PACKET_DECODE_SKIP_PADDING)) {
+		/* Do nada */
+	}
+}
+
+/*
+ * The packets with the header in the first len bytes of the data. The
+ * records have no padding so this follows the header lengths.
+ */
+static size_t
+packets_before(size_t len)
+{
+	size_t count, off;
+	uint16_t header;
+
+	count = 0;
+	for (off = 0; off < len; count++) {
+		header = buf[off];
+		off += 1 + (header < 0x20 ? 0 : 1 << ((header >> 4) & 3));
+	}
+	return (count);
+}
+
+/*
+ * Caller owned buffers are passed to the release callback once, in the
+ * order they were added, and only after the packets that start in them
+ * have been decoded.
+ */
+static void
+test_release_order(const struct result *ref)
+{
+	static uint8_t parts[NPARTS][sizeof(buf)];
+	struct spe_decode_ctx *ctx;
+	struct result res;
+	size_t ends[NPARTS], off, len;
+
+	ctx = result_ctx(&res);
+	off = 0;
+	for (size_t i = 0; i < NPARTS; i++) {
+		/* Uneven parts so some packets are split between them */
+		len = i == NPARTS - 1 ? buf_len - off : buf_len / NPARTS + i;
+		memcpy(parts[i], buf + off, len);
+		SPE_CHECK(spe_decode_ctx_add(ctx, 0, parts[i], len));
+		off += len;
+		ends[i] = off;
+	}
+	decode_all(ctx);
+	SPE_CHECK(packets_equal(&res, ref));
+
+	/* The last buffer is released once the decoder looks past it */
+	SPE_CHECK(res.nreleased == NPARTS);
+	spe_decode_ctx_free(ctx);
+	SPE_CHECK(res.nreleased == NPARTS);
+	for (size_t i = 0; i < res.nreleased; i++) {
+		SPE_CHECK(res.released[i] == parts[i]);
+		SPE_CHECK(res.released_count[i] >= packets_before(ends[i]));
+	}
+}
+
+/*
+ * spe_decode_ctx_release copies the data still needed so the caller can
+ * reuse the buffer straight away. A buffer that has been decoded is
+ * passed to the release callback by spe_decode_ctx_release, copies are
+ * owned by the context so are never passed to it.
+ */
+static void
+test_release_copy(const struct result *ref)
+{
+	static uint8_t first[sizeof(buf)], second[sizeof(buf)];
+	struct spe_decode_ctx *ctx;
+	struct result res;
+	size_t nreleased, split;
+
+	for (size_t decoded = 0; decoded < ref->count; decoded++) {
+		ctx = result_ctx(&res);
+		split = buf_len / 2;
+		memcpy(first, buf, split);
+		memcpy(second, buf + split, buf_len - split);
+		SPE_CHECK(spe_decode_ctx_add(ctx, 0, first, split));
+		SPE_CHECK(spe_decode_ctx_add(ctx, 0, second, buf_len - split));
+
+		while (res.count < decoded &&
+		    spe_packet_decode_next(ctx, 0)) {
+			/* Do nada */
+		}
+		/* The second buffer first, the order shouldn't matter */
+		SPE_CHECK(spe_decode_ctx_release(ctx, second));
+		SPE_CHECK(spe_decode_ctx_release(ctx, first));
+		nreleased = res.nreleased;
+		memset(first, 0xff, split);
+		memset(second, 0xff, buf_len - split);
+
+		decode_all(ctx);
+		spe_decode_ctx_free(ctx);
+		SPE_CHECK(packets_equal(&res, ref));
+		for (size_t i = nreleased; i < res.nreleased; i++) {
+			SPE_CHECK(res.released[i] != first &&
+			    res.released[i] != second);
+		}
+	}
+}
+
+/*
+ * A packet with a two byte header and 8 bytes of data split across two
+ * and three buffers at every offset is read through the stitch buffer.
+ */
+static void
+test_stitch(void)
+{
+	static const uint8_t pkt[] = {
+	    0x20, 0xb0, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88,
+	};
+	uint8_t a[sizeof(pkt)], b[sizeof(pkt)], c[sizeof(pkt)];
+	struct spe_decode_ctx *ctx;
+	struct result res;
+
+	for (size_t i = 1; i < sizeof(pkt); i++) {
+		for (size_t j = i; j < sizeof(pkt); j++) {
+			ctx = result_ctx(&res);
+			memcpy(a, pkt, i);
+			memcpy(b, pkt + i, j - i);
+			memcpy(c, pkt + j, sizeof(pkt) - j);
+			SPE_CHECK(spe_decode_ctx_add(ctx, 0, a, i));
+			decode_all(ctx);
+			if (j > i) {
+				SPE_CHECK(spe_decode_ctx_add(ctx, 0, b, j - i));
+				decode_all(ctx);
+			}
+			SPE_CHECK(res.count == 0);
+			SPE_CHECK(spe_decode_ctx_add(ctx, 0, c,
+			    sizeof(pkt) - j));
+			decode_all(ctx);
+			spe_decode_ctx_free(ctx);
+
+			SPE_CHECK(res.count == 1);
+			SPE_CHECK(res.header[0] == 0x20b0);
+			SPE_CHECK(res.data[0] == 0x8877665544332211ull);
+		}
+	}
+}
+
+int
+main(void)
+{
+	struct spe_decode_ctx *ctx;
+	struct result ref;
+
+	build();
+	ctx = result_ctx(&ref);
+	SPE_CHECK(spe_decode_ctx_add(ctx, 0, buf, buf_len));
+	decode_all(ctx);
+	spe_decode_ctx_free(ctx);
+	SPE_CHECK(ref.count > NRECORDS);
+	SPE_CHECK(ref.nreleased == 1);
+
+	test_release_order(&ref);
+	test_release_copy(&ref);
+	test_stitch();
+
+	return (spe_test_result());
+}
@@ -27,6 +27,7 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -35,6 +36,63 @@
 #include "spedecode.h"
 #include "spedecode_internal.h"
 
+/* The published storage size must be large enough for any build */
+_Static_assert(sizeof(struct spe_decode_ctx) <= SPE_DECODE_CTX_SIZE,
+    "SPE_DECODE_CTX_SIZE is too small");
+_Static_assert(_Alignof(struct spe_decode_ctx) <= SPE_DECODE_CTX_ALIGN,
+    "SPE_DECODE_CTX_ALIGN is too small");
+
+static void *
+spe_default_alloc(void *data, size_t size)
+{
+	(void)data;
+	return (malloc(size));
+}
+
+static void *
+spe_default_realloc(void *data, void *ptr, size_t size)
+{
+	(void)data;
+	return (realloc(ptr, size));
+}
+
+static void
+spe_default_free(void *data, void *ptr)
+{
+	(void)data;
+	free(ptr);
+}
+
+static const struct spe_allocator spe_default_allocator = {
+	.alloc_cb = spe_default_alloc,
+	.realloc_cb = spe_default_realloc,
+	.free_cb = spe_default_free,
+};
+
+/*
+ * Initialise a context in caller owned storage. Returns NULL if the
+ * storage is too small or not aligned for a context.
+ */
+struct spe_decode_ctx *
+spe_decode_ctx_init(void *storage, size_t size,
+    const struct spe_allocator *allocator)
+{
+	struct spe_decode_ctx *ctx;
+
+	if (storage == NULL || size < sizeof(*ctx) ||
+	    ((uintptr_t)storage % _Alignof(struct spe_decode_ctx)) != 0) {
+		return (NULL);
+	}
+
+	ctx = storage;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->header = true;
+	ctx->allocator = allocator != NULL ? *allocator :
+	    spe_default_allocator;
+
+	return (ctx);
+}
+
 /*
  * Allocates a new SPE context.
  */
@@ -43,16 +101,93 @@ spe_decode_ctx_alloc(void)
 {
 	struct spe_decode_ctx *ctx;
 
-	ctx = calloc(sizeof(*ctx), 1);
+	ctx = malloc(sizeof(*ctx));
 	if (ctx == NULL) {
 		return (NULL);
 	}
 
-	ctx->header = true;
+	spe_decode_ctx_init(ctx, sizeof(*ctx), NULL);
+	ctx->allocated = true;
 
 	return (ctx);
 }
 
+/*
+ * Drop the first segment. Segments we own are freed, otherwise the
+ * release callback is called if one has been set.
+ */
+static void
+spe_decode_ctx_drop(struct spe_decode_ctx *ctx)
+{
+	struct spe_segment *seg;
+
+	assert(ctx->nsegs > 0);
+	seg = &ctx->segs[0];
+	if (seg->own) {
+		SPE_LOG(ctx, 3, "Free buffer %p", seg->data);
+		spe_free(&ctx->allocator, seg->data);
+	} else if (ctx->release_cb != NULL) {
+		SPE_LOG(ctx, 3, "Release buffer %p", seg->data);
+		ctx->release_cb(ctx, ctx->release_cb_data, seg->data, seg->len);
+	}
+
+	ctx->nsegs--;
+	memmove(&ctx->segs[0], &ctx->segs[1],
+	    ctx->nsegs * sizeof(ctx->segs[0]));
+}
+
+/*
+ * Return the context to the state it was in after it was created so it
+ * can decode a new stream. The callbacks, log settings and allocator are
+ * kept, as is the buffer list so it doesn't need to be allocated again.
+ */
+void
+spe_decode_ctx_reset(struct spe_decode_ctx *ctx)
+{
+	while (ctx->nsegs > 0) {
+		spe_decode_ctx_drop(ctx);
+	}
+
+	ctx->buf = NULL;
+	ctx->off = 0;
+	ctx->len = 0;
+	ctx->buf_pos = 0;
+	ctx->header = true;
+	ctx->have_header = false;
+	ctx->last_header = 0;
+	ctx->last_header_len = 0;
+	memset(&ctx->last_info, 0, sizeof(ctx->last_info));
+	ctx->last_header_pos = 0;
+	memset(&ctx->record, 0, sizeof(ctx->record));
+	ctx->record_pos = 0;
+	ctx->record_packets = 0;
+	ctx->resync = false;
+	ctx->resync_start = 0;
+	ctx->resync_scan = 0;
+	ctx->end_pos = 0;
+	ctx->final = false;
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+}
+
+/*
+ * Release everything held by a context from spe_decode_ctx_init. The
+ * storage itself belongs to the caller.
+ */
+void
+spe_decode_ctx_fini(struct spe_decode_ctx *ctx)
+{
+	if (ctx == NULL) {
+		return;
+	}
+
+	while (ctx->nsegs > 0) {
+		spe_decode_ctx_drop(ctx);
+	}
+	spe_free(&ctx->allocator, ctx->segs);
+	ctx->segs = NULL;
+	ctx->segs_size = 0;
+}
+
 /*
  * Frees the SPE data context.
  */
@@ -63,10 +198,53 @@ spe_decode_ctx_free(struct spe_decode_ctx *ctx)
 		return;
 	}
 
-	if ((ctx->flags & SPE_OWN_BUF) != 0) {
-		free(ctx->buf);
+	spe_decode_ctx_fini(ctx);
+	if (ctx->allocated) {
+		free(ctx);
+	}
+}
+
+/*
+ * Read the counters kept by the context. Returns false, with the counters
+ * zeroed, if the library was built without SPE_STATS.
+ */
+bool
+spe_decode_ctx_get_stats(struct spe_decode_ctx *ctx,
+    struct spe_decode_stats *stats)
+{
+#if defined(SPE_STATS)
+	*stats = ctx->stats;
+	stats->bytes_added = ctx->end_pos;
+	stats->bytes_decoded = ctx->buf_pos + ctx->off;
+	return (true);
+#else
+	(void)ctx;
+	memset(stats, 0, sizeof(*stats));
+	return (false);
+#endif
+}
+
+/*
+ * Add one set of counters to another, e.g. from a context used to decode
+ * part of the data, or to total the contexts for several files.
+ */
+void
+spe_decode_stats_merge(struct spe_decode_stats *dst,
+    const struct spe_decode_stats *src)
+{
+	for (size_t i = 0; i < SPE_NITEMS(dst->packets); i++) {
+		dst->packets[i] += src->packets[i];
 	}
-	free(ctx);
+	dst->padding_bytes += src->padding_bytes;
+	dst->records += src->records;
+	dst->bytes_added += src->bytes_added;
+	dst->bytes_decoded += src->bytes_decoded;
+	dst->copies += src->copies;
+	dst->copy_bytes += src->copy_bytes;
+	dst->stitches += src->stitches;
+	dst->stitch_bytes += src->stitch_bytes;
+	dst->resyncs += src->resyncs;
+	dst->skipped_bytes += src->skipped_bytes;
 }
 
 void
@@ -75,114 +253,246 @@ spe_decode_ctx_set_log_level(struct spe_decode_ctx *ctx, int level)
 	ctx->log_level = level;
 }
 
+/*
+ * Set a function to be called when the context has finished with a buffer
+ * added without the SPE_FLAG_MUST_COPY flag. The buffer may be reused or
+ * freed once this has been called.
+ */
+void
+spe_decode_ctx_set_release_cb(struct spe_decode_ctx *ctx, spe_release_cb *cb,
+    void *data)
+{
+	ctx->release_cb = cb;
+	ctx->release_cb_data = data;
+}
+
+/*
+ * The earliest stream offset that may still be read. When recovering from
+ * corrupt data the scan for the next record boundary can go back to just
+ * after the start of the record being decoded.
+ */
+static uint64_t
+spe_decode_ctx_keep(const struct spe_decode_ctx *ctx)
+{
+	uint64_t pos;
+
+	pos = ctx->buf_pos + ctx->off;
+	if (ctx->resync_cb != NULL) {
+		if (ctx->resync) {
+			if (ctx->resync_scan < pos) {
+				pos = ctx->resync_scan;
+			}
+		} else if (ctx->record.present != 0 && ctx->record_pos < pos) {
+			pos = ctx->record_pos;
+		}
+	}
+
+	return (pos);
+}
+
+/*
+ * Drop any segments that won't be read again. If the current buffer is
+ * dropped the context is moved to the start of the next segment.
+ */
+void
+spe_decode_ctx_trim(struct spe_decode_ctx *ctx)
+{
+	struct spe_segment *seg;
+	uint64_t keep, pos;
+
+	keep = spe_decode_ctx_keep(ctx);
+	pos = ctx->buf_pos + ctx->off;
+	while (ctx->nsegs > 0) {
+		seg = &ctx->segs[0];
+		if (seg->pos + seg->len > keep) {
+			break;
+		}
+
+		if (ctx->buf == seg->data) {
+			ctx->buf = NULL;
+			ctx->buf_pos = pos;
+			ctx->off = 0;
+			ctx->len = 0;
+		}
+		spe_decode_ctx_drop(ctx);
+	}
+}
+
+/*
+ * Slow path of spe_decode_ctx_need. Ensure len bytes from the current
+ * offset are in the current buffer. If they span multiple segments they are
+ * copied into the stitch buffer. Returns false if there is not enough data.
+ */
+bool
+spe_decode_ctx_fill(struct spe_decode_ctx *ctx, size_t len)
+{
+	struct spe_segment *seg;
+	uint64_t pos;
+	size_t avail, copy, first, off;
+
+	assert(len <= sizeof(ctx->stitch));
+
+	spe_decode_ctx_trim(ctx);
+
+	/* Earlier segments may be kept to recover from corrupt data */
+	pos = ctx->buf_pos + ctx->off;
+	for (first = 0; first < ctx->nsegs; first++) {
+		seg = &ctx->segs[first];
+		if (pos < seg->pos + seg->len) {
+			break;
+		}
+	}
+	if (first == ctx->nsegs) {
+		return (false);
+	}
+	assert(seg->pos <= pos);
+
+	/* Move to the segment holding the current offset */
+	ctx->buf = seg->data;
+	ctx->buf_pos = seg->pos;
+	ctx->off = pos - seg->pos;
+	ctx->len = seg->len;
+	if (ctx->len - ctx->off >= len) {
+		return (true);
+	}
+
+	avail = ctx->len - ctx->off;
+	for (size_t i = first + 1; i < ctx->nsegs && avail < len; i++) {
+		avail += ctx->segs[i].len;
+	}
+	if (avail < len) {
+		return (false);
+	}
+
+	SPE_LOG(ctx, 3, "Stitch buffer at %"PRIx64, pos);
+	avail = 0;
+	off = pos - seg->pos;
+	for (size_t i = first; i < ctx->nsegs && avail < sizeof(ctx->stitch);
+	    i++) {
+		seg = &ctx->segs[i];
+		copy = seg->len - off;
+		if (copy > sizeof(ctx->stitch) - avail) {
+			copy = sizeof(ctx->stitch) - avail;
+		}
+		/* NOLINTNEXTLINE */
+		memcpy(ctx->stitch + avail, (uint8_t *)seg->data + off, copy);
+		avail += copy;
+		off = 0;
+	}
+
+	ctx->buf = ctx->stitch;
+	ctx->buf_pos = pos;
+	ctx->off = 0;
+	ctx->len = avail;
+	SPE_STATS_INC(ctx, stitches);
+	SPE_STATS_ADD(ctx, stitch_bytes, avail);
+
+	return (true);
+}
+
+/*
+ * Move the current offset to pos, which may be before it as long as the
+ * segment holding it has been kept.
+ */
+void
+spe_decode_ctx_seek(struct spe_decode_ctx *ctx, uint64_t pos)
+{
+	struct spe_segment *seg;
+
+	assert(pos <= ctx->end_pos);
+	for (size_t i = 0; i < ctx->nsegs; i++) {
+		seg = &ctx->segs[i];
+		if (pos < seg->pos + seg->len || i == ctx->nsegs - 1) {
+			assert(seg->pos <= pos);
+			ctx->buf = seg->data;
+			ctx->buf_pos = seg->pos;
+			ctx->off = pos - seg->pos;
+			ctx->len = seg->len;
+			return;
+		}
+	}
+
+	assert(pos == ctx->end_pos);
+	ctx->buf = NULL;
+	ctx->buf_pos = pos;
+	ctx->off = 0;
+	ctx->len = 0;
+}
+
 /*
  * Adds new data to the SPE context.
  *
  * The SPE_FLAG_MUST_COPY can be set to ensure data is copied rather than
  * referenced, e.g. if the data may change after this function returns.
  *
- * If the SPE_FLAG_MUST_COPY flag is unset spe_decode_ctx_release needs to
- * be called before freeing the buffer to ensure it's not referenced by
- * the SPE context.
+ * If the SPE_FLAG_MUST_COPY flag is unset the data is added to a list of
+ * buffers to decode without being copied. Packets that span two buffers
+ * are copied into a small internal buffer as they are read. Either a
+ * release callback needs to be set or spe_decode_ctx_release needs to be
+ * called before freeing the buffer to ensure it's not referenced by the
+ * SPE context.
  */
 bool
 spe_decode_ctx_add(struct spe_decode_ctx *ctx, uint32_t flags, void *data,
     size_t len)
 {
-	/* Release the current buffer if it's unused */
-	if (ctx->off == ctx->len && ctx->buf != NULL) {
-		SPE_LOG(ctx, 3, "Release buffer");
-		if ((ctx->flags & SPE_OWN_BUF) != 0) {
-			SPE_LOG(ctx, 3, "Free buffer %p", ctx->buf);
-			free(ctx->buf);
-		}
-		ctx->buf = NULL;
-		ctx->off = 0;
-		ctx->len = 0;
-	}
+	struct spe_segment *seg;
+	void *tmp;
 
-	if (ctx->buf == NULL) {
-		SPE_LOG(ctx, 3, "New buffer");
-		/*
-		 * No buffer, we can just use the given buffer, or allocate
-		 * a new buffer
-		 */
-		if ((flags & SPE_FLAG_MUST_COPY) == 0) {
-			SPE_LOG(ctx, 3, "Copy buffer");
-			ctx->buf = data;
-			/* We don't own the buffer */
-			ctx->flags &= ~SPE_OWN_BUF;
-		} else {
-			SPE_LOG(ctx, 3, "Alloc buffer");
-			ctx->buf = calloc(len, 1);
-			if (ctx->buf == NULL) {
-				SPE_LOG(ctx, 2,
-				    "Unable to allocate new buffer");
-				return (false);
-			}
-			/* NOLINTNEXTLINE */
-			memcpy(ctx->buf, data, len);
-			ctx->flags |= SPE_OWN_BUF;
-		}
-		ctx->len = len;
-		ctx->off = 0;
+	/* Release any buffers that have been used */
+	spe_decode_ctx_trim(ctx);
+
+	if (len == 0) {
 		return (true);
 	}
 
-	SPE_LOG(ctx, 3, "Copy into buffer");
-	if ((ctx->flags & SPE_OWN_BUF) != 0 && ctx->off == 0) {
-		void *tmp;
+	if (ctx->nsegs == ctx->segs_size) {
+		size_t new_size;
 
-		SPE_LOG(ctx, 3, "Realloc buffer");
-		/*
-		 * We own the buffer, and have not read from it, just realloc
-		 * it.
-		 */
-		tmp = realloc(ctx->buf, ctx->len + len);
+		new_size = ctx->segs_size == 0 ? 4 : ctx->segs_size * 2;
+		tmp = spe_realloc(&ctx->allocator, ctx->segs,
+		    new_size * sizeof(ctx->segs[0]));
 		if (tmp == NULL) {
+			SPE_LOG(ctx, 2, "Unable to allocate the buffer list");
 			return (false);
 		}
+		ctx->segs = tmp;
+		ctx->segs_size = new_size;
+	}
 
-		ctx->buf = tmp;
+	seg = &ctx->segs[ctx->nsegs];
+	if ((flags & SPE_FLAG_MUST_COPY) == 0) {
+		SPE_LOG(ctx, 3, "Add buffer %p", data);
+		seg->data = data;
+		/* We don't own the buffer */
+		seg->own = false;
 	} else {
-		void *tmp;
-		size_t tail_len;
-
-		SPE_LOG(ctx, 3, "Allocate new buffer");
-		/*
-		 * We don't own the buffer or some of it has been consumed
-		 * so we need to allocate one large enough for any remaining
-		 * data and the new data.
-		 */
-
-		assert(ctx->len >= ctx->off);
-		tail_len = ctx->len - ctx->off;
-		SPE_LOG(ctx, 3, "Buffer tail length %zx (%zx - %zx)", tail_len,
-		    ctx->len, ctx->off);
-		SPE_LOG(ctx, 3, "Buffer size %zx (%zx + %zx)", tail_len + len,
-		    tail_len, len);
-		tmp = calloc(tail_len + len, 1);
-		if (tmp == NULL) {
+		SPE_LOG(ctx, 3, "Alloc buffer");
+		seg->data = spe_alloc(&ctx->allocator, len);
+		if (seg->data == NULL) {
+			SPE_LOG(ctx, 2, "Unable to allocate new buffer");
 			return (false);
 		}
-
-		/* Copy the tail data */
 		/* NOLINTNEXTLINE */
-		memcpy(tmp, (uint8_t *)ctx->buf + ctx->off, tail_len);
-
-		if ((ctx->flags & SPE_OWN_BUF) != 0) {
-			free(ctx->buf);
-		}
-		ctx->buf = tmp;
-		ctx->off = 0;
-		ctx->len = tail_len;
-		ctx->flags |= SPE_OWN_BUF;
+		memcpy(seg->data, data, len);
+		seg->own = true;
+		SPE_STATS_INC(ctx, copies);
+		SPE_STATS_ADD(ctx, copy_bytes, len);
 	}
+	seg->len = len;
+	seg->pos = ctx->end_pos;
+	ctx->end_pos += len;
+	ctx->nsegs++;
+	ctx->final = false;
 
-	if (len > 0) {
-		/* NOLINTNEXTLINE */
-		memcpy((uint8_t *)ctx->buf + ctx->len, data, len);
-		ctx->len += len;
+	/* Start reading from the new buffer if there was nothing to read */
+	if (ctx->buf == NULL) {
+		assert(ctx->nsegs == 1);
+		assert(ctx->buf_pos + ctx->off == seg->pos);
+		ctx->buf = seg->data;
+		ctx->buf_pos = seg->pos;
+		ctx->off = 0;
+		ctx->len = len;
 	}
 
 	return (true);
@@ -196,26 +506,47 @@ spe_decode_ctx_add(struct spe_decode_ctx *ctx, uint32_t flags, void *data,
 bool
 spe_decode_ctx_release(struct spe_decode_ctx *ctx, void *buf)
 {
+	struct spe_segment *seg;
+	uint64_t keep, pos;
+	size_t off;
 	void *tmp;
-	size_t len;
 
-	if (ctx->buf == buf) {
-		assert((ctx->flags & SPE_OWN_BUF) == 0);
-		assert(ctx->len >= ctx->off);
+	spe_decode_ctx_trim(ctx);
 
-		len = ctx->len - ctx->off;
-		if (len == 0) {
-			ctx->buf = NULL;
-		} else {
-			tmp = calloc(len, 1);
-			if (tmp == NULL) {
-				return (false);
-			}
+	keep = spe_decode_ctx_keep(ctx);
+	pos = ctx->buf_pos + ctx->off;
+	for (size_t i = 0; i < ctx->nsegs; i++) {
+		seg = &ctx->segs[i];
+		if (seg->data != buf) {
+			continue;
+		}
+		assert(!seg->own);
+
+		off = 0;
+		if (keep > seg->pos) {
+			off = keep - seg->pos;
+		}
+		assert(off < seg->len);
+
+		tmp = spe_alloc(&ctx->allocator, seg->len - off);
+		if (tmp == NULL) {
+			return (false);
+		}
+
+		/* NOLINTNEXTLINE */
+		memcpy(tmp, (uint8_t *)seg->data + off, seg->len - off);
+		SPE_STATS_INC(ctx, copies);
+		SPE_STATS_ADD(ctx, copy_bytes, seg->len - off);
+		seg->data = tmp;
+		seg->pos += off;
+		seg->len -= off;
+		seg->own = true;
 
-			/* NOLINTNEXTLINE */
-			memcpy(tmp, (uint8_t *)ctx->buf + ctx->off, len);
+		if (ctx->buf == buf) {
 			ctx->buf = tmp;
-			ctx->flags |= SPE_OWN_BUF;
+			ctx->buf_pos = seg->pos;
+			ctx->off = pos - seg->pos;
+			ctx->len = seg->len;
 		}
 	}
 
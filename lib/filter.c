@@ -0,0 +1,650 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spedecode.h"
+
+/*
+ * Filter expressions over the fields of a record, e.g.
+ *
+ *   op_class == load_store && total_lat > 200 && el == 0
+ *
+ * The expression is compiled to instructions for a small stack machine.
+ * A field that is not in the record makes any comparison using it false.
+ *
+ *   expr  := and ( "||" and )*
+ *   and   := not ( "&&" not )*
+ *   not   := "!" not | cmp
+ *   cmp   := band ( ( "==" | "!=" | "<" | "<=" | ">" | ">=" ) band )?
+ *   band  := prim ( "&" prim )*
+ *   prim  := number | field | constant | "(" expr ")"
+ */
+
+enum spe_filter_op {
+	SPE_FILTER_CONST,	/* Push imm */
+	SPE_FILTER_LOAD,	/* Push a field */
+	SPE_FILTER_EQ,
+	SPE_FILTER_NE,
+	SPE_FILTER_LT,
+	SPE_FILTER_LE,
+	SPE_FILTER_GT,
+	SPE_FILTER_GE,
+	SPE_FILTER_BAND,
+	SPE_FILTER_BOOL,	/* Convert the top value to 0 or 1 */
+	SPE_FILTER_NOT,
+	SPE_FILTER_JF,		/* Jump if false, otherwise pop */
+	SPE_FILTER_JT,		/* Jump if true, otherwise pop */
+	SPE_FILTER_RET,
+};
+
+enum spe_filter_load {
+	SPE_FILTER_LOAD_ADDR,		/* Sign extended */
+	SPE_FILTER_LOAD_ADDR_RAW,	/* Without the top byte */
+	SPE_FILTER_LOAD_EL,
+	SPE_FILTER_LOAD_NS,
+	SPE_FILTER_LOAD_COUNTER,
+	SPE_FILTER_LOAD_EVENTS,
+	SPE_FILTER_LOAD_EVENT,
+	SPE_FILTER_LOAD_DATA_SOURCE,
+	SPE_FILTER_LOAD_OP_CLASS,
+	SPE_FILTER_LOAD_OP_SUBCLASS,
+	SPE_FILTER_LOAD_CONTEXT,
+	SPE_FILTER_LOAD_TIMESTAMP,
+	SPE_FILTER_LOAD_SOURCE,
+};
+
+struct spe_filter_insn {
+	uint8_t op;
+	uint8_t load;		/* spe_filter_load */
+	uint16_t idx;		/* Address or counter index, or event bit */
+	uint32_t arg;		/* Presence bits, or the jump target */
+	uint64_t imm;
+};
+
+/* The deepest stack an expression may use */
+#define	SPE_FILTER_STACK	32
+
+struct spe_filter {
+	size_t count;
+	struct spe_filter_insn insns[];
+};
+
+static const struct {
+	const char *name;
+	uint8_t load;
+	uint16_t idx;
+} spe_filter_fields[] = {
+	{ "pc", SPE_FILTER_LOAD_ADDR, SPE_ADDRESS_IDX_PC_VA },
+	{ "branch_target", SPE_FILTER_LOAD_ADDR, SPE_ADDRESS_IDX_B_TARGET },
+	{ "data_va", SPE_FILTER_LOAD_ADDR, SPE_ADDRESS_IDX_DATA_VA },
+	{ "data_pa", SPE_FILTER_LOAD_ADDR_RAW, SPE_ADDRESS_IDX_DATA_PA },
+	{ "prev_branch_target", SPE_FILTER_LOAD_ADDR,
+	    SPE_ADDRESS_IDX_PREV_B_TARGET },
+	{ "el", SPE_FILTER_LOAD_EL, SPE_ADDRESS_IDX_PC_VA },
+	{ "ns", SPE_FILTER_LOAD_NS, SPE_ADDRESS_IDX_PC_VA },
+	{ "total_lat", SPE_FILTER_LOAD_COUNTER, SPE_COUNTER_IDX_TOTAL_LAT },
+	{ "issue_lat", SPE_FILTER_LOAD_COUNTER, SPE_COUNTER_IDX_ISSUE_LAT },
+	{ "trans_lat", SPE_FILTER_LOAD_COUNTER, SPE_COUNTER_IDX_TRANS_LAT },
+	{ "events", SPE_FILTER_LOAD_EVENTS, 0 },
+	{ "data_source", SPE_FILTER_LOAD_DATA_SOURCE, 0 },
+	{ "op_class", SPE_FILTER_LOAD_OP_CLASS, 0 },
+	{ "op_subclass", SPE_FILTER_LOAD_OP_SUBCLASS, 0 },
+	{ "context", SPE_FILTER_LOAD_CONTEXT, 0 },
+	{ "timestamp", SPE_FILTER_LOAD_TIMESTAMP, 0 },
+	{ "source", SPE_FILTER_LOAD_SOURCE, 0 },
+	{ "exception", SPE_FILTER_LOAD_EVENT, SPE_EVENT_EXCEPTION },
+	{ "retired", SPE_FILTER_LOAD_EVENT, SPE_EVENT_RETIRED },
+	{ "l1d_access", SPE_FILTER_LOAD_EVENT, SPE_EVENT_L1D_ACCESS },
+	{ "l1d_refill", SPE_FILTER_LOAD_EVENT, SPE_EVENT_L1D_REFILL },
+	{ "tlb_access", SPE_FILTER_LOAD_EVENT, SPE_EVENT_TLB_ACCESS },
+	{ "tlb_walk", SPE_FILTER_LOAD_EVENT, SPE_EVENT_TLB_WALK },
+	{ "not_taken", SPE_FILTER_LOAD_EVENT, SPE_EVENT_NOT_TAKEN },
+	{ "mispredicted", SPE_FILTER_LOAD_EVENT, SPE_EVENT_MISPREDICTED },
+	{ "llc_access", SPE_FILTER_LOAD_EVENT, SPE_EVENT_LLC_ACCESS },
+	{ "llc_miss", SPE_FILTER_LOAD_EVENT, SPE_EVENT_LLC_MISS },
+	{ "remote_access", SPE_FILTER_LOAD_EVENT, SPE_EVENT_REMOTE_ACCESS },
+	{ "alignment", SPE_FILTER_LOAD_EVENT, SPE_EVENT_ALIGNMENT },
+	{ "transactional", SPE_FILTER_LOAD_EVENT, SPE_EVENT_TRANSACTIONAL },
+	{ "partial_pred", SPE_FILTER_LOAD_EVENT, SPE_EVENT_PARTIAL_PRED },
+	{ "empty_pred", SPE_FILTER_LOAD_EVENT, SPE_EVENT_EMPTY_PRED },
+};
+
+static const struct {
+	const char *name;
+	uint64_t val;
+} spe_filter_consts[] = {
+	{ "other", SPE_OPERATION_TYPE_OTHER },
+	{ "load_store", SPE_OPERATION_TYPE_LOAD_STORE },
+	{ "branch", SPE_OPERATION_TYPE_BRANCH },
+};
+
+struct spe_filter_parser {
+	const char *expr;
+	const char *pos;
+	struct spe_filter_insn *insns;
+	size_t count;
+	size_t size;
+	size_t depth;
+	char *err;
+	size_t errlen;
+	bool failed;
+};
+
+static void
+spe_filter_error(struct spe_filter_parser *p, const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	if (p->failed) {
+		return;
+	}
+	p->failed = true;
+	if (p->err == NULL || p->errlen == 0) {
+		return;
+	}
+
+	len = snprintf(p->err, p->errlen, "at offset %zu: ",
+	    (size_t)(p->pos - p->expr));
+	if (len < 0 || (size_t)len >= p->errlen) {
+		return;
+	}
+	va_start(args, fmt);
+	vsnprintf(p->err + len, p->errlen - len, fmt, args);
+	va_end(args);
+}
+
+static size_t
+spe_filter_emit(struct spe_filter_parser *p, uint8_t op)
+{
+	struct spe_filter_insn *insns;
+	size_t size;
+
+	if (p->failed) {
+		return (0);
+	}
+
+	if (p->count == p->size) {
+		size = p->size == 0 ? 16 : p->size * 2;
+		insns = realloc(p->insns, size * sizeof(*insns));
+		if (insns == NULL) {
+			spe_filter_error(p, "out of memory");
+			return (0);
+		}
+		p->insns = insns;
+		p->size = size;
+	}
+
+	/* Track how deep the stack may be */
+	switch (op) {
+	case SPE_FILTER_CONST:
+	case SPE_FILTER_LOAD:
+		if (++p->depth > SPE_FILTER_STACK) {
+			spe_filter_error(p, "expression is too complex");
+			return (0);
+		}
+		break;
+	case SPE_FILTER_EQ:
+	case SPE_FILTER_NE:
+	case SPE_FILTER_LT:
+	case SPE_FILTER_LE:
+	case SPE_FILTER_GT:
+	case SPE_FILTER_GE:
+	case SPE_FILTER_BAND:
+	case SPE_FILTER_JF:
+	case SPE_FILTER_JT:
+		p->depth--;
+		break;
+	default:
+		break;
+	}
+
+	memset(&p->insns[p->count], 0, sizeof(p->insns[p->count]));
+	p->insns[p->count].op = op;
+	return (p->count++);
+}
+
+static void
+spe_filter_space(struct spe_filter_parser *p)
+{
+	while (isspace((unsigned char)*p->pos)) {
+		p->pos++;
+	}
+}
+
+/* Consume the token if it is next */
+static bool
+spe_filter_accept(struct spe_filter_parser *p, const char *tok)
+{
+	size_t len;
+
+	spe_filter_space(p);
+	len = strlen(tok);
+	if (strncmp(p->pos, tok, len) != 0) {
+		return (false);
+	}
+	/* Don't split && or || into two & or | tokens */
+	if (len == 1 && (*tok == '&' || *tok == '|') && p->pos[1] == *tok) {
+		return (false);
+	}
+	/* Or take < from <= */
+	if (len == 1 && (*tok == '<' || *tok == '>' || *tok == '!') &&
+	    p->pos[1] == '=') {
+		return (false);
+	}
+
+	p->pos += len;
+	return (true);
+}
+
+static void spe_filter_parse_or(struct spe_filter_parser *);
+
+static void
+spe_filter_parse_prim(struct spe_filter_parser *p)
+{
+	const char *start;
+	char *end;
+	size_t len, i, idx;
+	uint64_t val;
+
+	spe_filter_space(p);
+	if (spe_filter_accept(p, "(")) {
+		spe_filter_parse_or(p);
+		if (!spe_filter_accept(p, ")")) {
+			spe_filter_error(p, "expected )");
+		}
+		return;
+	}
+
+	if (isdigit((unsigned char)*p->pos)) {
+		errno = 0;
+		val = strtoull(p->pos, &end, 0);
+		if (errno != 0 || isalnum((unsigned char)*end) ||
+		    *end == '_') {
+			spe_filter_error(p, "invalid number");
+			return;
+		}
+		p->pos = end;
+		idx = spe_filter_emit(p, SPE_FILTER_CONST);
+		if (!p->failed) {
+			p->insns[idx].imm = val;
+		}
+		return;
+	}
+
+	start = p->pos;
+	while (isalnum((unsigned char)*p->pos) || *p->pos == '_') {
+		p->pos++;
+	}
+	len = (size_t)(p->pos - start);
+	if (len == 0) {
+		spe_filter_error(p, "expected a field or number");
+		return;
+	}
+
+	for (i = 0; i < sizeof(spe_filter_fields) /
+	    sizeof(spe_filter_fields[0]); i++) {
+		if (strlen(spe_filter_fields[i].name) == len &&
+		    strncmp(spe_filter_fields[i].name, start, len) == 0) {
+			idx = spe_filter_emit(p, SPE_FILTER_LOAD);
+			if (!p->failed) {
+				p->insns[idx].load = spe_filter_fields[i].load;
+				p->insns[idx].idx = spe_filter_fields[i].idx;
+			}
+			return;
+		}
+	}
+	for (i = 0; i < sizeof(spe_filter_consts) /
+	    sizeof(spe_filter_consts[0]); i++) {
+		if (strlen(spe_filter_consts[i].name) == len &&
+		    strncmp(spe_filter_consts[i].name, start, len) == 0) {
+			idx = spe_filter_emit(p, SPE_FILTER_CONST);
+			if (!p->failed) {
+				p->insns[idx].imm = spe_filter_consts[i].val;
+			}
+			return;
+		}
+	}
+
+	p->pos = start;
+	spe_filter_error(p, "unknown field \"%.*s\"", (int)len, start);
+}
+
+static void
+spe_filter_parse_band(struct spe_filter_parser *p)
+{
+	spe_filter_parse_prim(p);
+	while (!p->failed && spe_filter_accept(p, "&")) {
+		spe_filter_parse_prim(p);
+		spe_filter_emit(p, SPE_FILTER_BAND);
+	}
+}
+
+static void
+spe_filter_parse_cmp(struct spe_filter_parser *p)
+{
+	static const struct {
+		const char *tok;
+		uint8_t op;
+	} ops[] = {
+		{ "==", SPE_FILTER_EQ },
+		{ "!=", SPE_FILTER_NE },
+		{ "<=", SPE_FILTER_LE },
+		{ ">=", SPE_FILTER_GE },
+		{ "<", SPE_FILTER_LT },
+		{ ">", SPE_FILTER_GT },
+	};
+
+	spe_filter_parse_band(p);
+	for (size_t i = 0; !p->failed && i < sizeof(ops) / sizeof(ops[0]);
+	    i++) {
+		if (spe_filter_accept(p, ops[i].tok)) {
+			spe_filter_parse_band(p);
+			spe_filter_emit(p, ops[i].op);
+			return;
+		}
+	}
+}
+
+static void
+spe_filter_parse_not(struct spe_filter_parser *p)
+{
+	if (spe_filter_accept(p, "!")) {
+		spe_filter_parse_not(p);
+		spe_filter_emit(p, SPE_FILTER_NOT);
+		return;
+	}
+
+	spe_filter_parse_cmp(p);
+}
+
+/*
+ * Parse a list of operands to && or ||. Each is converted to a boolean so
+ * the jump can leave it as the result when it short circuits.
+ */
+static void
+spe_filter_parse_list(struct spe_filter_parser *p, const char *tok,
+    uint8_t jump, void (*parse)(struct spe_filter_parser *))
+{
+	size_t *jumps, njumps, idx;
+
+	parse(p);
+	if (!spe_filter_accept(p, tok)) {
+		return;
+	}
+
+	jumps = NULL;
+	njumps = 0;
+	do {
+		spe_filter_emit(p, SPE_FILTER_BOOL);
+		idx = spe_filter_emit(p, jump);
+		jumps = realloc(jumps, (njumps + 1) * sizeof(*jumps));
+		if (jumps == NULL) {
+			spe_filter_error(p, "out of memory");
+			return;
+		}
+		jumps[njumps++] = idx;
+		parse(p);
+	} while (!p->failed && spe_filter_accept(p, tok));
+	spe_filter_emit(p, SPE_FILTER_BOOL);
+
+	if (!p->failed) {
+		for (size_t i = 0; i < njumps; i++) {
+			p->insns[jumps[i]].arg = (uint32_t)p->count;
+		}
+	}
+	free(jumps);
+}
+
+static void
+spe_filter_parse_and(struct spe_filter_parser *p)
+{
+	spe_filter_parse_list(p, "&&", SPE_FILTER_JF, spe_filter_parse_not);
+}
+
+static void
+spe_filter_parse_or(struct spe_filter_parser *p)
+{
+	spe_filter_parse_list(p, "||", SPE_FILTER_JT, spe_filter_parse_and);
+}
+
+/*
+ * Compile a filter expression. On error this returns NULL and, if err is
+ * not NULL, writes a description of the error to it.
+ */
+struct spe_filter *
+spe_filter_compile(const char *expr, char *err, size_t errlen)
+{
+	struct spe_filter_parser p = { 0 };
+	struct spe_filter *filter;
+
+	p.expr = expr;
+	p.pos = expr;
+	p.err = err;
+	p.errlen = errlen;
+
+	spe_filter_parse_or(&p);
+	spe_filter_space(&p);
+	if (*p.pos != '\0') {
+		spe_filter_error(&p, "unexpected \"%s\"", p.pos);
+	}
+	spe_filter_emit(&p, SPE_FILTER_BOOL);
+	spe_filter_emit(&p, SPE_FILTER_RET);
+	if (p.failed) {
+		free(p.insns);
+		return (NULL);
+	}
+
+	/* The presence bits each load needs */
+	for (size_t i = 0; i < p.count; i++) {
+		if (p.insns[i].op != SPE_FILTER_LOAD) {
+			continue;
+		}
+		switch (p.insns[i].load) {
+		case SPE_FILTER_LOAD_ADDR:
+		case SPE_FILTER_LOAD_ADDR_RAW:
+		case SPE_FILTER_LOAD_EL:
+		case SPE_FILTER_LOAD_NS:
+			p.insns[i].arg = SPE_RECORD_ADDR(p.insns[i].idx);
+			break;
+		case SPE_FILTER_LOAD_COUNTER:
+			p.insns[i].arg = SPE_RECORD_COUNTER(p.insns[i].idx);
+			break;
+		case SPE_FILTER_LOAD_EVENTS:
+		case SPE_FILTER_LOAD_EVENT:
+			p.insns[i].arg = SPE_RECORD_EVENTS;
+			break;
+		case SPE_FILTER_LOAD_DATA_SOURCE:
+			p.insns[i].arg = SPE_RECORD_DATA_SOURCE;
+			break;
+		case SPE_FILTER_LOAD_OP_CLASS:
+		case SPE_FILTER_LOAD_OP_SUBCLASS:
+			p.insns[i].arg = SPE_RECORD_OPERATION_TYPE;
+			break;
+		case SPE_FILTER_LOAD_CONTEXT:
+			p.insns[i].arg = SPE_RECORD_CONTEXT;
+			break;
+		case SPE_FILTER_LOAD_TIMESTAMP:
+			p.insns[i].arg = SPE_RECORD_TIMESTAMP;
+			break;
+		case SPE_FILTER_LOAD_SOURCE:
+			p.insns[i].arg = SPE_RECORD_SOURCE;
+			break;
+		}
+	}
+
+	filter = malloc(sizeof(*filter) + p.count * sizeof(p.insns[0]));
+	if (filter == NULL) {
+		if (err != NULL && errlen > 0) {
+			snprintf(err, errlen, "out of memory");
+		}
+		free(p.insns);
+		return (NULL);
+	}
+	filter->count = p.count;
+	memcpy(filter->insns, p.insns, p.count * sizeof(p.insns[0]));
+	free(p.insns);
+
+	return (filter);
+}
+
+void
+spe_filter_free(struct spe_filter *filter)
+{
+	free(filter);
+}
+
+static inline uint64_t
+spe_filter_load(const struct spe_filter_insn *insn,
+    const struct spe_record *rec)
+{
+	switch (insn->load) {
+	case SPE_FILTER_LOAD_ADDR:
+		return (SPE_ADDRESS_ADDR_SE(rec->addr[insn->idx]));
+	case SPE_FILTER_LOAD_ADDR_RAW:
+		return (SPE_ADDRESS_ADDR(rec->addr[insn->idx]));
+	case SPE_FILTER_LOAD_EL:
+		return (SPE_ADDRESS_EL(rec->addr[insn->idx]));
+	case SPE_FILTER_LOAD_NS:
+		return (SPE_ADDRESS_NS(rec->addr[insn->idx]));
+	case SPE_FILTER_LOAD_COUNTER:
+		return (rec->counter[insn->idx]);
+	case SPE_FILTER_LOAD_EVENTS:
+		return (rec->events);
+	case SPE_FILTER_LOAD_EVENT:
+		return (SPE_EVENTS(rec->events, insn->idx));
+	case SPE_FILTER_LOAD_DATA_SOURCE:
+		return (rec->data_source);
+	case SPE_FILTER_LOAD_OP_CLASS:
+		return (rec->op_class);
+	case SPE_FILTER_LOAD_OP_SUBCLASS:
+		return (rec->op_subclass);
+	case SPE_FILTER_LOAD_CONTEXT:
+		return (rec->context);
+	case SPE_FILTER_LOAD_TIMESTAMP:
+		return (rec->timestamp);
+	case SPE_FILTER_LOAD_SOURCE:
+		return (rec->source);
+	}
+
+	return (0);
+}
+
+/*
+ * Returns true if the record matches the filter. Each stack entry has a
+ * flag for if the value is valid, it is cleared when a field is missing
+ * from the record.
+ */
+bool
+spe_filter_match(const struct spe_filter *filter, const struct spe_record *rec)
+{
+	const struct spe_filter_insn *insn;
+	uint64_t val[SPE_FILTER_STACK];
+	bool valid[SPE_FILTER_STACK];
+	size_t sp, pc;
+	bool res;
+
+	sp = 0;
+	for (pc = 0; pc < filter->count; pc++) {
+		insn = &filter->insns[pc];
+		switch (insn->op) {
+		case SPE_FILTER_CONST:
+			val[sp] = insn->imm;
+			valid[sp] = true;
+			sp++;
+			break;
+		case SPE_FILTER_LOAD:
+			valid[sp] = (rec->present & insn->arg) == insn->arg;
+			val[sp] = spe_filter_load(insn, rec);
+			sp++;
+			break;
+		case SPE_FILTER_BAND:
+			sp--;
+			val[sp - 1] &= val[sp];
+			valid[sp - 1] = valid[sp - 1] && valid[sp];
+			break;
+		case SPE_FILTER_BOOL:
+			val[sp - 1] = valid[sp - 1] && val[sp - 1] != 0;
+			valid[sp - 1] = true;
+			break;
+		case SPE_FILTER_NOT:
+			val[sp - 1] = !(valid[sp - 1] && val[sp - 1] != 0);
+			valid[sp - 1] = true;
+			break;
+		case SPE_FILTER_JF:
+		case SPE_FILTER_JT:
+			if ((val[sp - 1] != 0) == (insn->op == SPE_FILTER_JT)) {
+				/* The jump target is the instruction after */
+				pc = insn->arg - 1;
+			} else {
+				sp--;
+			}
+			break;
+		case SPE_FILTER_RET:
+			assert(sp == 1);
+			return (val[0] != 0);
+		default:
+			sp--;
+			switch (insn->op) {
+			case SPE_FILTER_EQ:
+				res = val[sp - 1] == val[sp];
+				break;
+			case SPE_FILTER_NE:
+				res = val[sp - 1] != val[sp];
+				break;
+			case SPE_FILTER_LT:
+				res = val[sp - 1] < val[sp];
+				break;
+			case SPE_FILTER_LE:
+				res = val[sp - 1] <= val[sp];
+				break;
+			case SPE_FILTER_GT:
+				res = val[sp - 1] > val[sp];
+				break;
+			default:
+				res = val[sp - 1] >= val[sp];
+				break;
+			}
+			val[sp - 1] = valid[sp - 1] && valid[sp] && res;
+			valid[sp - 1] = true;
+			break;
+		}
+	}
+
+	return (false);
+}
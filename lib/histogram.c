@@ -0,0 +1,175 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "spedecode.h"
+
+/*
+ * A log-linear histogram as used by HdrHistogram. Values below
+ * 2^SPE_HIST_SUB_BITS each have their own bucket. Above that each power of
+ * two is split into 2^(SPE_HIST_SUB_BITS - 1) buckets, so the bucket width
+ * is at most 1/16th of the value.
+ */
+#define	SPE_HIST_SUB_COUNT	(1u << SPE_HIST_SUB_BITS)
+#define	SPE_HIST_HALF_COUNT	(1u << (SPE_HIST_SUB_BITS - 1))
+
+static inline unsigned int
+spe_hist_msb(uint64_t val)
+{
+	assert(val != 0);
+#if defined(_MSC_VER)
+	unsigned long idx;
+
+	_BitScanReverse64(&idx, val);
+	return ((unsigned int)idx);
+#else
+	return (63 - (unsigned int)__builtin_clzll(val));
+#endif
+}
+
+static inline size_t
+spe_hist_bucket(uint64_t val)
+{
+	unsigned int shift;
+
+	if (val < SPE_HIST_SUB_COUNT) {
+		return ((size_t)val);
+	}
+
+	shift = spe_hist_msb(val) - SPE_HIST_SUB_BITS + 1;
+	return ((size_t)shift * SPE_HIST_HALF_COUNT + (size_t)(val >> shift));
+}
+
+/* The largest value that is counted in a bucket */
+static uint64_t
+spe_hist_bucket_max(size_t bucket)
+{
+	unsigned int shift;
+	uint64_t mant;
+
+	if (bucket < SPE_HIST_SUB_COUNT) {
+		return (bucket);
+	}
+
+	shift = (unsigned int)(bucket / SPE_HIST_HALF_COUNT) - 1;
+	mant = bucket - (size_t)shift * SPE_HIST_HALF_COUNT;
+	return (((mant + 1) << shift) - 1);
+}
+
+void
+spe_hist_init(struct spe_hist *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->min = UINT64_MAX;
+}
+
+void
+spe_hist_add(struct spe_hist *hist, uint64_t val)
+{
+	size_t bucket;
+
+	bucket = spe_hist_bucket(val);
+	assert(bucket < SPE_HIST_BUCKETS);
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->sum += val;
+	if (val < hist->min) {
+		hist->min = val;
+	}
+	if (val > hist->max) {
+		hist->max = val;
+	}
+}
+
+/*
+ * Add the values from src to dst, e.g. to combine histograms built on
+ * different threads.
+ */
+void
+spe_hist_merge(struct spe_hist *dst, const struct spe_hist *src)
+{
+	for (size_t i = 0; i < SPE_HIST_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min) {
+		dst->min = src->min;
+	}
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+/*
+ * Returns the value at the given percentile. This is the largest value in
+ * the bucket holding the percentile so is within the bucket precision of
+ * the real value.
+ */
+uint64_t
+spe_hist_percentile(const struct spe_hist *hist, double pct)
+{
+	uint64_t rank, seen, val;
+
+	if (hist->count == 0) {
+		return (0);
+	}
+
+	if (pct <= 0.0) {
+		return (hist->min);
+	}
+	if (pct >= 100.0) {
+		return (hist->max);
+	}
+
+	/* The number of values at or below the percentile, at least 1 */
+	rank = (uint64_t)(pct / 100.0 * (double)hist->count + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	seen = 0;
+	for (size_t i = 0; i < SPE_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			val = spe_hist_bucket_max(i);
+			return (val > hist->max ? hist->max : val);
+		}
+	}
+
+	return (hist->max);
+}
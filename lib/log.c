@@ -0,0 +1,266 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if !defined(_MSC_VER)
+#include <stdatomic.h>
+#endif
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spedecode_internal.h"
+
+/*
+ * Without pthreads the contexts are only used from a single thread, see
+ * parallel.c, so the ring doesn't need to be atomic.
+ */
+#if !defined(_MSC_VER)
+typedef atomic_size_t spe_atomic_size;
+typedef atomic_uint_fast64_t spe_atomic_u64;
+#define	spe_atomic_load(p)		\
+	atomic_load_explicit((p), memory_order_acquire)
+#define	spe_atomic_load_relaxed(p)	\
+	atomic_load_explicit((p), memory_order_relaxed)
+#define	spe_atomic_store(p, v)		\
+	atomic_store_explicit((p), (v), memory_order_release)
+#define	spe_atomic_cas(p, oldp, v)	\
+	atomic_compare_exchange_weak_explicit((p), (oldp), (v),	\
+	    memory_order_relaxed, memory_order_relaxed)
+#define	spe_atomic_inc(p)		\
+	atomic_fetch_add_explicit((p), 1, memory_order_relaxed)
+#else
+typedef size_t spe_atomic_size;
+typedef uint64_t spe_atomic_u64;
+#define	spe_atomic_load(p)		(*(p))
+#define	spe_atomic_load_relaxed(p)	(*(p))
+#define	spe_atomic_store(p, v)		(*(p) = (v))
+#define	spe_atomic_cas(p, oldp, v)	(*(p) = (v), true)
+#define	spe_atomic_inc(p)		((*(p))++)
+#endif
+
+/*
+ * The highest level of message built into the library.
+ */
+int
+spe_log_level_max(void)
+{
+	return (SPE_LOG_LEVEL);
+}
+
+/*
+ * Format a log message and pass it to the context's log callback, or print
+ * it to stderr if there is none. Only called through SPE_LOG.
+ */
+void
+spe_log(struct spe_decode_ctx *ctx, int level, const char *func, int line,
+    const char *fmt, ...)
+{
+	char msg[SPE_LOG_MSG_SIZE];
+	va_list args;
+	int len;
+
+	len = snprintf(msg, sizeof(msg), "%s:%d ", func, line);
+	if (len < 0 || (size_t)len >= sizeof(msg)) {
+		len = 0;
+	}
+	va_start(args, fmt);
+	vsnprintf(msg + len, sizeof(msg) - (size_t)len, fmt, args);
+	va_end(args);
+
+	if (ctx->log_cb != NULL) {
+		ctx->log_cb(ctx, ctx->log_cb_data, level, msg);
+	} else {
+		fprintf(stderr, "%s\n", msg);
+	}
+}
+
+/*
+ * Set a function to be called with each log message in place of printing
+ * it. The message has no trailing newline and is only valid during the
+ * call.
+ */
+void
+spe_decode_ctx_set_log_cb(struct spe_decode_ctx *ctx, spe_log_cb *cb,
+    void *data)
+{
+	ctx->log_cb = cb;
+	ctx->log_cb_data = data;
+}
+
+/*
+ * A bounded ring of log messages. Each slot has a sequence number that says
+ * if it's free for the writer at a given position, or holds a message for
+ * the reader at that position. Writers claim a position by moving the tail,
+ * fill the slot, then publish it by updating the sequence number, so any
+ * number of threads can log to the same ring without a lock. When the ring
+ * is full new messages are dropped and counted.
+ */
+struct spe_log_slot {
+	spe_atomic_size seq;
+	int level;
+	char msg[SPE_LOG_MSG_SIZE];
+};
+
+struct spe_log_ring {
+	struct spe_log_slot *slots;
+	size_t mask;
+	spe_atomic_size head;		/* Next position to read */
+	spe_atomic_size tail;		/* Next position to write */
+	spe_atomic_u64 dropped;
+};
+
+/*
+ * Allocate a ring with space for at least count messages.
+ */
+struct spe_log_ring *
+spe_log_ring_alloc(size_t count)
+{
+	struct spe_log_ring *ring;
+	size_t size;
+
+	size = 2;
+	while (size < count) {
+		if (size > SIZE_MAX / 2 / sizeof(*ring->slots)) {
+			return (NULL);
+		}
+		size *= 2;
+	}
+
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL) {
+		return (NULL);
+	}
+	ring->slots = calloc(size, sizeof(*ring->slots));
+	if (ring->slots == NULL) {
+		free(ring);
+		return (NULL);
+	}
+	ring->mask = size - 1;
+	for (size_t i = 0; i < size; i++) {
+		spe_atomic_store(&ring->slots[i].seq, i);
+	}
+
+	return (ring);
+}
+
+void
+spe_log_ring_free(struct spe_log_ring *ring)
+{
+	if (ring == NULL) {
+		return;
+	}
+
+	free(ring->slots);
+	free(ring);
+}
+
+/*
+ * A log callback that adds messages to the ring passed as its data.
+ */
+void
+spe_log_ring_cb(struct spe_decode_ctx *ctx, void *data, int level,
+    const char *msg)
+{
+	struct spe_log_ring *ring;
+	struct spe_log_slot *slot;
+	size_t pos, seq;
+
+	(void)ctx;
+
+	ring = data;
+	pos = spe_atomic_load_relaxed(&ring->tail);
+	while (true) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = spe_atomic_load(&slot->seq);
+		if (seq == pos) {
+			/* The slot is free, try to claim it */
+			if (spe_atomic_cas(&ring->tail, &pos, pos + 1)) {
+				break;
+			}
+		} else if ((ptrdiff_t)(seq - pos) < 0) {
+			/* The reader hasn't caught up */
+			spe_atomic_inc(&ring->dropped);
+			return;
+		} else {
+			/* Another writer claimed it first */
+			pos = spe_atomic_load_relaxed(&ring->tail);
+		}
+	}
+
+	slot->level = level;
+	strncpy(slot->msg, msg, sizeof(slot->msg) - 1);
+	slot->msg[sizeof(slot->msg) - 1] = '\0';
+	spe_atomic_store(&slot->seq, pos + 1);
+}
+
+/*
+ * Remove the oldest message from the ring. Returns false if it's empty.
+ */
+bool
+spe_log_ring_read(struct spe_log_ring *ring, struct spe_log_entry *entry)
+{
+	struct spe_log_slot *slot;
+	size_t pos, seq;
+
+	pos = spe_atomic_load_relaxed(&ring->head);
+	while (true) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = spe_atomic_load(&slot->seq);
+		if (seq == pos + 1) {
+			if (spe_atomic_cas(&ring->head, &pos, pos + 1)) {
+				break;
+			}
+		} else if ((ptrdiff_t)(seq - (pos + 1)) < 0) {
+			/* Empty, or the next message is still being written */
+			return (false);
+		} else {
+			pos = spe_atomic_load_relaxed(&ring->head);
+		}
+	}
+
+	entry->level = slot->level;
+	memcpy(entry->msg, slot->msg, sizeof(entry->msg));
+	/* Free the slot for the writer one lap later */
+	spe_atomic_store(&slot->seq, pos + ring->mask + 1);
+
+	return (true);
+}
+
+/*
+ * The number of messages dropped as the ring was full.
+ */
+uint64_t
+spe_log_ring_dropped(struct spe_log_ring *ring)
+{
+	return (spe_atomic_load_relaxed(&ring->dropped));
+}
@@ -52,8 +52,7 @@ spe_packet_peek_header(struct spe_decode_ctx *ctx, uint16_t *headerp,
 		return (false);
 	}
 
-	assert(ctx->off <= ctx->len);
-	if (ctx->off == ctx->len) {
+	if (!spe_decode_ctx_need(ctx, 1)) {
 		return (false);
 	}
 
@@ -63,7 +62,7 @@ spe_packet_peek_header(struct spe_decode_ctx *ctx, uint16_t *headerp,
 	/* Handle the extended header */
 	if (header >= 0x20 && header < 0x40) {
 		/* The second half of the header is missing */
-		if (ctx->off + 1 == ctx->len) {
+		if (!spe_decode_ctx_need(ctx, 2)) {
 			return (false);
 		}
 		header <<= 8;
@@ -84,6 +83,16 @@ spe_packet_get_header(struct spe_decode_ctx *ctx, int flags, uint16_t *headerp,
 	int header_len;
 	uint16_t header;
 
+	/*
+	 * The header has already been read, e.g. the data was incomplete
+	 * the last time this packet was decoded.
+	 */
+	if (!ctx->header && ctx->have_header) {
+		*headerp = ctx->last_header;
+		*header_lenp = ctx->last_header_len;
+		return (true);
+	}
+
 	do {
 		if (!spe_packet_peek_header(ctx, &header, &header_len)) {
 			return (false);
@@ -94,10 +103,18 @@ spe_packet_get_header(struct spe_decode_ctx *ctx, int flags, uint16_t *headerp,
 
 		ctx->last_header = header;
 		ctx->last_header_len = header_len;
+		ctx->last_info = *spe_header_lookup(header, header_len);
+		ctx->last_header_pos = ctx->buf_pos + ctx->off;
 		ctx->have_header = true;
 		ctx->off += header_len;
 		assert(ctx->off <= ctx->len);
-	} while (header == 0 && (flags & SPE_HEADER_SKIP_PADDING) != 0);
+		if (header == 0 && (flags & SPE_HEADER_SKIP_PADDING) != 0) {
+			SPE_STATS_INC(ctx, padding_bytes);
+			continue;
+		}
+		SPE_STATS_INC(ctx, packets[ctx->last_info.type]);
+		break;
+	} while (true);
 
 	ctx->header = false;
 	*headerp = header;
@@ -110,7 +127,6 @@ bool
 spe_packet_data_len(struct spe_decode_ctx *ctx, int *data_lenp)
 {
 	int data_len;
-	uint16_t header;
 
 	if (ctx->header) {
 		SPE_LOG(ctx, 1, "Not in data");
@@ -118,25 +134,13 @@ spe_packet_data_len(struct spe_decode_ctx *ctx, int *data_lenp)
 		return (false);
 	}
 
-	/* There are no packets to skip */
-	if (ctx->off == ctx->len) {
-		SPE_LOG(ctx, 2, "No data to read");
-		return (false);
-	}
-
-	header = ctx->last_header;
-
 	assert(ctx->last_header_len > 0);
 	assert(ctx->last_header_len <= 2);
 
-	if (header < 0x20) {
-		data_len = 0;
-	} else {
-		/* The data length is encoded in the header */
-		data_len = 1 << ((header >> 4) & 3);
-	}
+	/* Found when the header was read */
+	data_len = ctx->last_info.data_len;
 
-	if ((size_t)data_len > (ctx->len - ctx->off)) {
+	if (!spe_decode_ctx_need(ctx, data_len)) {
 		SPE_LOG(ctx, 1, "Data too long");
 		return (false);
 	}
@@ -182,3 +186,75 @@ spe_packet_skip(struct spe_decode_ctx *ctx)
 {
 	return (spe_packet_get_data(ctx, NULL, NULL));
 }
+
+/*
+ * Used by spe_packet_next when spe_packet_get_header has been called but
+ * the data has not yet been read, or the packet isn't entirely within the
+ * current buffer.
+ */
+bool
+spe_packet_next_slow(struct spe_decode_ctx *ctx, bool skip_padding,
+    struct spe_packet *pkt)
+{
+	const struct spe_header_info *info;
+	const uint8_t *buf;
+	uint64_t data;
+	uint16_t header;
+	int data_len, header_len;
+
+	if (!ctx->header) {
+		if (!spe_packet_get_data(ctx, &pkt->data, &data_len)) {
+			SPE_LOG(ctx, 2, "No packet data");
+			return (false);
+		}
+
+		pkt->offset = ctx->last_header_pos;
+		pkt->header = ctx->last_header;
+		pkt->info = ctx->last_info;
+		return (true);
+	}
+
+	do {
+		if (!spe_decode_ctx_need(ctx, 1)) {
+			return (false);
+		}
+		buf = ctx->buf;
+		if (buf[ctx->off] != 0 || !skip_padding) {
+			break;
+		}
+		ctx->off++;
+		SPE_STATS_INC(ctx, padding_bytes);
+	} while (true);
+
+	header = buf[ctx->off];
+	header_len = 1;
+	if (header >= 0x20 && header < 0x40) {
+		if (!spe_decode_ctx_need(ctx, 2)) {
+			return (false);
+		}
+		buf = ctx->buf;
+		header = (uint16_t)(header << 8) | buf[ctx->off + 1];
+		header_len = 2;
+	}
+
+	info = spe_header_lookup(header, header_len);
+	if (!spe_decode_ctx_need(ctx, header_len + info->data_len)) {
+		return (false);
+	}
+	buf = ctx->buf;
+
+	data = 0;
+	for (int i = info->data_len - 1; i >= 0; i--) {
+		data <<= 8;
+		data |= buf[ctx->off + header_len + i];
+	}
+
+	pkt->data = data;
+	pkt->offset = ctx->buf_pos + ctx->off;
+	pkt->header = header;
+	pkt->info = *info;
+	ctx->off += header_len + info->data_len;
+	SPE_STATS_INC(ctx, packets[info->type]);
+
+	return (true);
+}
@@ -33,72 +33,119 @@
 
 #define	PADDING_VAL			0x00
 #define	PADDING_MASK			0xff
-#define	PADDING_WIDTH			1
 
 #define	END_VAL				0x01
 #define	END_MASK			0xff
-#define	END_WIDTH			1
 
 #define	TIMESTAMP_VAL			0x71
 #define	TIMESTAMP_MASK			0xff
-#define	TIMESTAMP_WIDTH			1
 
 #define	EVENTS_VAL			0x42
 #define	EVENTS_MASK			0xcf
-#define	EVENTS_WIDTH			1
 
 #define	DATA_SOURCE_VAL			0x43
 #define	DATA_SOURCE_MASK		0xcf
-#define	DATA_SOURCE_WIDTH		1
 
 #define	CONTEXT_VAL			0x64
 #define	CONTEXT_MASK			0xfc
-#define	CONTEXT_WIDTH			1
 
 #define	OPERATION_TYPE_VAL		0x48
 #define	OPERATION_TYPE_MASK		0xfc
-#define	OPERATION_TYPE_WIDTH		1
 
 #define	ADDRESS_SHORT_VAL		0xb0
 #define	ADDRESS_SHORT_MASK		0xf8
-#define	ADDRESS_SHORT_WIDTH		1
 
 #define	ADDRESS_LONG_VAL		0x20b0
 #define	ADDRESS_LONG_MASK		0xfcf8
-#define	ADDRESS_LONG_WIDTH		2
 
 #define	COUNTER_SHORT_VAL		0x98
 #define	COUNTER_SHORT_MASK		0xf8
-#define	COUNTER_SHORT_WIDTH		1
 
 #define	COUNTER_LONG_VAL		0x2098
 #define	COUNTER_LONG_MASK		0xfcf8
-#define	COUNTER_LONG_WIDTH		2
-
-static struct {
-	uint16_t val;
-	uint16_t mask;
-	uint8_t width;
-	spe_packet_type type;
-#define	SPE_ENTRY(_type, _extra)					\
+
+/*
+ * The header tables are built by the preprocessor so there is nothing to
+ * initialise at run time. SPE_HDR_MATCH is true when the header h matches
+ * one of the packet encodings above.
+ */
+#define	SPE_HDR_MATCH(h, _type)	(((h) & _type ## _MASK) == _type ## _VAL)
+
+#define	SPE_HDR_SHORT_TYPE(h)						\
+	(SPE_HDR_MATCH(h, ADDRESS_SHORT) ? SPE_PKT_ADDRESS :		\
+	 SPE_HDR_MATCH(h, CONTEXT) ? SPE_PKT_CONTEXT :			\
+	 SPE_HDR_MATCH(h, COUNTER_SHORT) ? SPE_PKT_COUNTER :		\
+	 SPE_HDR_MATCH(h, DATA_SOURCE) ? SPE_PKT_DATA_SOURCE :		\
+	 SPE_HDR_MATCH(h, END) ? SPE_PKT_END :				\
+	 SPE_HDR_MATCH(h, EVENTS) ? SPE_PKT_EVENTS :			\
+	 SPE_HDR_MATCH(h, OPERATION_TYPE) ? SPE_PKT_OPERATION_TYPE :	\
+	 SPE_HDR_MATCH(h, PADDING) ? SPE_PKT_PADDING :			\
+	 SPE_HDR_MATCH(h, TIMESTAMP) ? SPE_PKT_TIMESTAMP :		\
+	 SPE_PKT_UNKNOWN)
+
+#define	SPE_HDR_LONG_TYPE(h)						\
+	(SPE_HDR_MATCH(h, ADDRESS_LONG) ? SPE_PKT_ADDRESS :		\
+	 SPE_HDR_MATCH(h, COUNTER_LONG) ? SPE_PKT_COUNTER :		\
+	 SPE_PKT_UNKNOWN)
+
+/* The data length is encoded in the header */
+#define	SPE_HDR_DATA_LEN(h)						\
+	((h) < 0x20 ? 0 : 1 << (((h) >> 4) & 3))
+
+/* As SPE_ADDRESS_INDEX and SPE_COUNTER_INDEX */
+#define	SPE_HDR_INDEX(h)	((((h) & 0x0300) >> 5) | ((h) & 0x0007))
+
+#define	SPE_HDR_INFO(_type, h)						\
 	{								\
-		.val = _type ## _extra ## _VAL,				\
-		.mask = _type ## _extra ## _MASK,			\
-		.width = _type ## _extra ## _WIDTH,			\
-		.type = SPE_PKT_ ## _type,				\
+		.type = (uint8_t)(_type),				\
+		.data_len = (uint8_t)SPE_HDR_DATA_LEN(h),		\
+		.index = (uint8_t)SPE_HDR_INDEX(h),			\
 	}
-} spe_headers[] = {
-	SPE_ENTRY(ADDRESS, _SHORT),
-	SPE_ENTRY(ADDRESS, _LONG),
-	SPE_ENTRY(CONTEXT, ),
-	SPE_ENTRY(COUNTER, _SHORT),
-	SPE_ENTRY(COUNTER, _LONG),
-	SPE_ENTRY(DATA_SOURCE, ),
-	SPE_ENTRY(END, ),
-	SPE_ENTRY(EVENTS, ),
-	SPE_ENTRY(OPERATION_TYPE, ),
-	SPE_ENTRY(PADDING, ),
-	SPE_ENTRY(TIMESTAMP, ),
+#define	SPE_HDR_SHORT(h)	SPE_HDR_INFO(SPE_HDR_SHORT_TYPE(h), h)
+#define	SPE_HDR_LONG(h)		SPE_HDR_INFO(SPE_HDR_LONG_TYPE(h), h)
+
+#define	SPE_HDR_4(f, h)		f((h) + 0x0), f((h) + 0x1),		\
+				f((h) + 0x2), f((h) + 0x3)
+#define	SPE_HDR_16(f, h)	SPE_HDR_4(f, (h) + 0x00),		\
+				SPE_HDR_4(f, (h) + 0x04),		\
+				SPE_HDR_4(f, (h) + 0x08),		\
+				SPE_HDR_4(f, (h) + 0x0c)
+#define	SPE_HDR_64(f, h)	SPE_HDR_16(f, (h) + 0x00),		\
+				SPE_HDR_16(f, (h) + 0x10),		\
+				SPE_HDR_16(f, (h) + 0x20),		\
+				SPE_HDR_16(f, (h) + 0x30)
+#define	SPE_HDR_256(f, h)	SPE_HDR_64(f, (h) + 0x00),		\
+				SPE_HDR_64(f, (h) + 0x40),		\
+				SPE_HDR_64(f, (h) + 0x80),		\
+				SPE_HDR_64(f, (h) + 0xc0)
+
+/* All one byte headers */
+const struct spe_header_info spe_header_short[256] = {
+	SPE_HDR_256(SPE_HDR_SHORT, 0x00),
+};
+
+/*
+ * Extended headers 0x2000 - 0x23ff. Only these can hold a known packet,
+ * the rest of the extended header space only needs the data length.
+ */
+const struct spe_header_info spe_header_long[1024] = {
+	SPE_HDR_256(SPE_HDR_LONG, 0x2000),
+	SPE_HDR_256(SPE_HDR_LONG, 0x2100),
+	SPE_HDR_256(SPE_HDR_LONG, 0x2200),
+	SPE_HDR_256(SPE_HDR_LONG, 0x2300),
+};
+
+/* Indexed by the data length field of the header */
+const struct spe_header_info spe_header_long_unknown[4] = {
+	SPE_HDR_LONG(0x2400), SPE_HDR_LONG(0x2410),
+	SPE_HDR_LONG(0x2420), SPE_HDR_LONG(0x2430),
+};
+
+/* Indexed by the data length to keep only the payload bytes of a load */
+const uint64_t spe_payload_mask[9] = {
+	0x0000000000000000ull, 0x00000000000000ffull, 0x000000000000ffffull,
+	0x0000000000ffffffull, 0x00000000ffffffffull, 0x000000ffffffffffull,
+	0x0000ffffffffffffull, 0x00ffffffffffffffull, 0xffffffffffffffffull,
 };
 
 void
@@ -132,47 +179,86 @@ spe_packet_decode_type(struct spe_decode_ctx *ctx, uint16_t header,
 		return (SPE_PKT_INVALID);
 	}
 
-	for (size_t i = 0; i < SPE_NITEMS(spe_headers); i++) {
-		assert(spe_headers[i].width >= 1);
-		assert(spe_headers[i].width <= 2);
-
-		if (spe_headers[i].width == header_len &&
-		    (header & spe_headers[i].mask) == spe_headers[i].val) {
-			return (spe_headers[i].type);
-		}
+	if (header_len == 0) {
+		return (SPE_PKT_UNKNOWN);
 	}
 
-	return (SPE_PKT_UNKNOWN);
+	return ((spe_packet_type)spe_header_lookup(header, header_len)->type);
 }
 
+/*
+ * Decode the next packet and pass it to the callback for its type. The
+ * payload is only read when there is a callback.
+ */
 bool
 spe_packet_decode_next(struct spe_decode_ctx *ctx, int flags)
 {
+	const struct spe_header_info *info;
+	struct spe_packet pkt;
 	spe_packet_cb *cb;
-	spe_packet_type type;
 	uint64_t data;
 	uint16_t header;
-	int header_len, data_len, header_flags;
+	int header_len;
+	bool skip_padding;
 
-	header_flags = 0;
-	if ((flags & SPE_PACKET_DECODE_SKIP_PADDING) != 0) {
-		header_flags |= SPE_HEADER_SKIP_PADDING;
-	}
-	if (!spe_packet_get_header(ctx, header_flags, &header, &header_len)) {
-		SPE_LOG(ctx, 2, "No packet header");
-		return (false);
-	}
+	skip_padding = (flags & SPE_PACKET_DECODE_SKIP_PADDING) != 0;
+	info = spe_packet_header_fast(ctx, skip_padding, &header,
+	    &header_len);
+	if (info == NULL) {
+		if (!spe_packet_next_slow(ctx, skip_padding, &pkt)) {
+			SPE_LOG(ctx, 2, "No packet");
+			return (false);
+		}
 
-	if (!spe_packet_get_data(ctx, &data, &data_len)) {
-		SPE_LOG(ctx, 2, "No packet header");
-		return (false);
+		cb = ctx->packet_cb[pkt.info.type];
+		if (cb != NULL) {
+			cb(ctx, ctx->packet_cb_data,
+			    (spe_packet_type)pkt.info.type, pkt.header,
+			    pkt.data);
+		}
+		return (true);
 	}
 
-	type = spe_packet_decode_type(ctx, header, header_len);
-	cb = ctx->packet_cb[type];
+	cb = ctx->packet_cb[info->type];
+	data = 0;
+	if (cb != NULL) {
+		data = spe_packet_payload(ctx, header_len, info);
+	}
+	ctx->off += header_len + info->data_len;
+	SPE_STATS_INC(ctx, packets[info->type]);
 	if (cb != NULL) {
-		cb(ctx, ctx->packet_cb_data, type, header, data);
+		cb(ctx, ctx->packet_cb_data, (spe_packet_type)info->type,
+		    header, data);
 	}
 
 	return (true);
 }
+
+/*
+ * Decode up to max packets into the batch arrays. Returns the number of
+ * packets decoded. This will stop early when the end of the data is
+ * reached. A packet that is only partially in the buffer is left to be
+ * decoded once more data has been added.
+ */
+size_t
+spe_packet_decode_batch(struct spe_decode_ctx *ctx, int flags,
+    struct spe_packet_batch *batch, size_t max)
+{
+	struct spe_packet pkt;
+	size_t count;
+	bool skip_padding;
+
+	skip_padding = (flags & SPE_PACKET_DECODE_SKIP_PADDING) != 0;
+	for (count = 0; count < max; count++) {
+		if (!spe_packet_next(ctx, skip_padding, &pkt)) {
+			break;
+		}
+
+		batch->type[count] = pkt.info.type;
+		batch->header[count] = pkt.header;
+		batch->data[count] = pkt.data;
+		batch->offset[count] = pkt.offset;
+	}
+
+	return (count);
+}
@@ -0,0 +1,428 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if !defined(_MSC_VER)
+#include <pthread.h>
+#define	SPE_THREADS
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spedecode_internal.h"
+
+/* Aim for chunks around this size */
+#define	SPE_PARALLEL_CHUNK_SIZE		(1024 * 1024)
+/* How many chunks per thread may be decoded ahead of the output */
+#define	SPE_PARALLEL_WINDOW		4
+
+struct spe_chunk {
+	size_t start;
+	size_t end;
+	size_t stop;		/* Where decoding stopped */
+	void *data;
+	struct spe_decode_stats stats;
+	bool done;
+	bool failed;
+};
+
+struct spe_parallel {
+	const uint8_t *buf;
+	uint64_t pos;		/* Stream offset of buf */
+	const struct spe_parallel_ops *ops;
+	void *priv;
+	int flags;
+	int log_level;
+	spe_log_cb *log_cb;
+	void *log_cb_data;
+	spe_resync_cb *resync_cb;
+	const struct spe_allocator *allocator;	/* Calling thread only */
+
+	struct spe_chunk *chunks;
+	size_t nchunks;
+	size_t window;
+#if defined(SPE_THREADS)
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+	size_t next_chunk;	/* The next chunk for a worker to decode */
+	size_t next_done;	/* The next chunk to pass to chunk_done */
+	bool failed;
+};
+
+/*
+ * Decode the next packet, or with a decode_next operation whatever it
+ * decodes, e.g. the next record.
+ */
+static bool
+spe_parallel_next(const struct spe_parallel_ops *ops, int flags,
+    struct spe_decode_ctx *ctx)
+{
+	if (ops->decode_next != NULL) {
+		return (ops->decode_next(ctx, ctx->packet_cb_data));
+	}
+
+	return (spe_packet_decode_next(ctx, flags));
+}
+
+/*
+ * Decode the data from start to end in a new context on the stack. Returns
+ * false if the chunk couldn't be started. The chunk stop is set to the
+ * offset of the first packet that was not decoded, this will be end unless
+ * the last packet in the range is incomplete.
+ */
+static bool
+spe_parallel_decode(struct spe_parallel *par, size_t idx, size_t start,
+    size_t end, struct spe_chunk *chunk)
+{
+	struct spe_decode_ctx chunk_ctx, *ctx;
+	void *data;
+	size_t off;
+
+	/*
+	 * This may run on a worker thread so use malloc, the allocator of the
+	 * calling context isn't required to be thread safe.
+	 */
+	ctx = spe_decode_ctx_init(&chunk_ctx, sizeof(chunk_ctx), NULL);
+	spe_decode_ctx_set_log_level(ctx, par->log_level);
+	spe_decode_ctx_set_log_cb(ctx, par->log_cb, par->log_cb_data);
+	spe_decode_ctx_set_resync_cb(ctx, par->resync_cb);
+	/* Use the same stream offsets as the calling context */
+	ctx->buf_pos = ctx->end_pos = par->pos + start;
+
+	data = par->ops->chunk_start(ctx, par->priv, idx);
+	if (data == NULL) {
+		spe_decode_ctx_fini(ctx);
+		return (false);
+	}
+	spe_packet_decode_set_callback_data(ctx, data);
+
+	/* The buffer is only read so won't be modified */
+	if (!spe_decode_ctx_add(ctx, 0, (void *)(uintptr_t)(par->buf + start),
+	    end - start)) {
+		par->ops->chunk_discard(par->priv, idx, data);
+		spe_decode_ctx_fini(ctx);
+		return (false);
+	}
+	/* Any record boundary is checked against the chunk data only */
+	ctx->final = true;
+
+	while (spe_parallel_next(par->ops, par->flags, ctx)) {
+		/* Do nada */
+	}
+
+	/* The next chunk starts at a record boundary */
+	if (ctx->resync) {
+		spe_record_resync_end(ctx, par->pos + end);
+	}
+
+	/* Find the start of any incomplete packet or record */
+	off = (size_t)(ctx->buf_pos + ctx->off - par->pos - start);
+	if (ctx->record.present != 0) {
+		off = (size_t)(ctx->record_pos - par->pos - start);
+	} else if (!ctx->header) {
+		off = (size_t)(ctx->last_header_pos - par->pos - start);
+	}
+	assert(off <= end - start);
+
+	/*
+	 * Remove the packets after off from the counters, they are decoded
+	 * again as part of the next chunk.
+	 */
+	chunk->stats = ctx->stats;
+#if defined(SPE_STATS)
+	if (ctx->record.present != 0) {
+		memcpy(chunk->stats.packets, ctx->record_stats.packets,
+		    sizeof(chunk->stats.packets));
+		chunk->stats.padding_bytes = ctx->record_stats.padding_bytes;
+	} else if (!ctx->header) {
+		chunk->stats.packets[ctx->last_info.type]--;
+	}
+#endif
+	spe_decode_ctx_fini(ctx);
+
+	chunk->data = data;
+	chunk->stop = start + off;
+
+	return (true);
+}
+
+#if defined(SPE_THREADS)
+static void *
+spe_parallel_worker(void *arg)
+{
+	struct spe_parallel *par;
+	struct spe_chunk *chunk;
+	size_t idx;
+
+	par = arg;
+	pthread_mutex_lock(&par->lock);
+	while (true) {
+		/* Don't get too far ahead of the output */
+		while (!par->failed && par->next_chunk < par->nchunks &&
+		    par->next_chunk >= par->next_done + par->window) {
+			pthread_cond_wait(&par->cond, &par->lock);
+		}
+		if (par->failed || par->next_chunk == par->nchunks) {
+			break;
+		}
+
+		idx = par->next_chunk++;
+		chunk = &par->chunks[idx];
+		pthread_mutex_unlock(&par->lock);
+
+		chunk->failed = !spe_parallel_decode(par, idx, chunk->start,
+		    chunk->end, chunk);
+
+		pthread_mutex_lock(&par->lock);
+		chunk->done = true;
+		pthread_cond_broadcast(&par->cond);
+	}
+	pthread_mutex_unlock(&par->lock);
+
+	return (NULL);
+}
+#endif
+
+/*
+ * Split the data at record boundaries. The boundaries are only likely to be
+ * correct, this is checked as each chunk is passed to chunk_done.
+ */
+static bool
+spe_parallel_split(struct spe_parallel *par, size_t len)
+{
+	size_t count, off, next;
+
+	count = len / SPE_PARALLEL_CHUNK_SIZE + 1;
+	par->chunks = spe_alloc_array(par->allocator, count,
+	    sizeof(*par->chunks));
+	if (par->chunks == NULL) {
+		return (false);
+	}
+	memset(par->chunks, 0, count * sizeof(*par->chunks));
+
+	par->nchunks = 0;
+	off = 0;
+	while (off < len) {
+		next = len;
+		if (len - off > SPE_PARALLEL_CHUNK_SIZE) {
+			next = spe_scan_record_next(par->buf, len,
+			    off + SPE_PARALLEL_CHUNK_SIZE);
+		}
+
+		assert(par->nchunks < count);
+		par->chunks[par->nchunks].start = off;
+		par->chunks[par->nchunks].end = next;
+		par->nchunks++;
+		off = next;
+	}
+
+	return (true);
+}
+
+/*
+ * Decode the data in the context using multiple threads. Any buffers other
+ * than the last are decoded on the calling thread. The last is split
+ * into chunks that are each decoded in a new context. The chunk_start
+ * operation is called, possibly from a worker thread, to set the callbacks
+ * on the new context and returns the callback data for the chunk. Once a
+ * chunk has been decoded chunk_done is called with this data on the
+ * calling thread in the order the chunks appear in the buffer.
+ *
+ * If a chunk boundary turns out not to be on a packet boundary the worker
+ * result for the next chunk is passed to chunk_discard and the chunk is
+ * decoded again from the correct offset, so the packets seen by chunk_done
+ * are the same as from calling spe_packet_decode_next on the context.
+ *
+ * As with spe_packet_decode_next an incomplete packet at the end of the
+ * data is left in the context.
+ *
+ * If the decode_next operation is set it is used in place of
+ * spe_packet_decode_next, and is passed the callback data of the context
+ * being decoded. This allows records to be decoded with
+ * spe_record_decode_next, chunks then end before any incomplete record so
+ * each record is seen once, and the earlier buffers are decoded until the
+ * current record is complete.
+ */
+bool
+spe_decode_parallel(struct spe_decode_ctx *ctx, int flags,
+    unsigned int nthreads, const struct spe_parallel_ops *ops, void *priv)
+{
+	struct spe_parallel par = { 0 };
+	struct spe_chunk *chunk;
+#if defined(SPE_THREADS)
+	pthread_t *threads;
+	size_t nstarted;
+#endif
+	size_t i, pos;
+	bool ret;
+
+	/*
+	 * Finish any packet started with spe_packet_get_header and decode
+	 * the earlier buffers until we are in the last one. Segments kept
+	 * while looking for a record boundary are dropped first.
+	 */
+	spe_decode_ctx_trim(ctx);
+	while (!ctx->header || ctx->record.present != 0 || ctx->resync ||
+	    ctx->nsegs > 1 ||
+	    (ctx->nsegs == 1 && ctx->buf != ctx->segs[0].data)) {
+		if (!spe_parallel_next(ops, flags, ctx)) {
+			return (true);
+		}
+		spe_decode_ctx_trim(ctx);
+	}
+
+	if (ctx->nsegs == 0) {
+		return (true);
+	}
+
+	assert(ctx->off <= ctx->len);
+	par.buf = (const uint8_t *)ctx->buf + ctx->off;
+	par.pos = ctx->buf_pos + ctx->off;
+	par.ops = ops;
+	par.priv = priv;
+	par.flags = flags;
+	par.log_level = ctx->log_level;
+	par.log_cb = ctx->log_cb;
+	par.log_cb_data = ctx->log_cb_data;
+	par.resync_cb = ctx->resync_cb;
+	par.allocator = &ctx->allocator;
+	if (!spe_parallel_split(&par, ctx->len - ctx->off)) {
+		SPE_LOG(ctx, 2, "Unable to allocate the chunks");
+		return (false);
+	}
+
+#if !defined(SPE_THREADS)
+	nthreads = 0;
+#else
+	if (nthreads > par.nchunks) {
+		nthreads = par.nchunks;
+	}
+	/* The calling thread will decode a single chunk itself */
+	if (nthreads <= 1) {
+		nthreads = 0;
+	}
+	par.window = (size_t)nthreads * SPE_PARALLEL_WINDOW;
+	pthread_mutex_init(&par.lock, NULL);
+	pthread_cond_init(&par.cond, NULL);
+
+	threads = NULL;
+	nstarted = 0;
+	if (nthreads > 0) {
+		threads = spe_alloc_array(par.allocator, nthreads,
+		    sizeof(*threads));
+		if (threads == NULL) {
+			nthreads = 0;
+		}
+	}
+	for (; nstarted < nthreads; nstarted++) {
+		if (pthread_create(&threads[nstarted], NULL,
+		    spe_parallel_worker, &par) != 0) {
+			SPE_LOG(ctx, 2, "Unable to create a thread");
+			break;
+		}
+	}
+#endif
+
+	ret = true;
+	pos = 0;
+	for (i = 0; i < par.nchunks; i++) {
+		chunk = &par.chunks[i];
+
+#if defined(SPE_THREADS)
+		if (nstarted > 0) {
+			pthread_mutex_lock(&par.lock);
+			while (!chunk->done) {
+				pthread_cond_wait(&par.cond, &par.lock);
+			}
+			pthread_mutex_unlock(&par.lock);
+		} else
+#endif
+		{
+			chunk->done = true;
+			chunk->failed = !spe_parallel_decode(&par, i,
+			    chunk->start, chunk->end, chunk);
+		}
+
+		if (!chunk->failed && pos != chunk->start) {
+			/*
+			 * The previous chunk ended in a packet that continues
+			 * into this chunk so it started at the wrong offset.
+			 */
+			SPE_LOG(ctx, 3, "Chunk %zu moved from %zx to %zx", i,
+			    chunk->start, pos);
+			ops->chunk_discard(priv, i, chunk->data);
+			chunk->failed = !spe_parallel_decode(&par, i, pos,
+			    chunk->end, chunk);
+		}
+		if (chunk->failed) {
+			ret = false;
+			break;
+		}
+
+		ops->chunk_done(priv, i, chunk->data);
+		spe_decode_stats_merge(&ctx->stats, &chunk->stats);
+		pos = chunk->stop;
+
+#if defined(SPE_THREADS)
+		pthread_mutex_lock(&par.lock);
+		par.next_done = i + 1;
+		pthread_cond_broadcast(&par.cond);
+		pthread_mutex_unlock(&par.lock);
+#endif
+	}
+
+#if defined(SPE_THREADS)
+	pthread_mutex_lock(&par.lock);
+	par.failed = !ret;
+	pthread_cond_broadcast(&par.cond);
+	pthread_mutex_unlock(&par.lock);
+	for (size_t j = 0; j < nstarted; j++) {
+		pthread_join(threads[j], NULL);
+	}
+	spe_free(par.allocator, threads);
+	pthread_cond_destroy(&par.cond);
+	pthread_mutex_destroy(&par.lock);
+
+	/* Release any chunks the workers decoded after a failure */
+	for (i++; i < par.nchunks; i++) {
+		chunk = &par.chunks[i];
+		if (chunk->done && !chunk->failed) {
+			ops->chunk_discard(priv, i, chunk->data);
+		}
+	}
+#endif
+	spe_free(par.allocator, par.chunks);
+
+	ctx->off += pos;
+
+	return (ret);
+}
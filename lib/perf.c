@@ -0,0 +1,211 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "spedecode.h"
+
+/*
+ * Read the AUX data from a perf.data file in memory. The parts of the
+ * format used are from the Linux perf tool and its UAPI headers. The AUX
+ * data is stored after each PERF_RECORD_AUXTRACE record, outside of the
+ * size of the record itself.
+ */
+#define	SPE_PERF_MAGIC			0x32454c4946524550ull	/* PERFILE2 */
+#define	SPE_PERF_RECORD_AUX		11
+#define	SPE_PERF_RECORD_AUXTRACE	71
+#define	SPE_PERF_AUX_FLAG_TRUNCATED	0x01
+
+struct spe_perf_section {
+	uint64_t offset;
+	uint64_t size;
+};
+
+/* The header of a file written by perf record */
+struct spe_perf_file_header {
+	uint64_t magic;
+	uint64_t size;
+	uint64_t attr_size;
+	struct spe_perf_section attrs;
+	struct spe_perf_section data;
+	struct spe_perf_section event_types;
+	uint64_t features[4];
+};
+
+/* The header of a file written by perf record -o - */
+struct spe_perf_pipe_header {
+	uint64_t magic;
+	uint64_t size;
+};
+
+struct spe_perf_event_header {
+	uint32_t type;
+	uint16_t misc;
+	uint16_t size;
+};
+
+struct spe_perf_auxtrace {
+	struct spe_perf_event_header header;
+	uint64_t size;
+	uint64_t offset;
+	uint64_t reference;
+	uint32_t idx;
+	uint32_t tid;
+	uint32_t cpu;
+	uint32_t reserved;
+};
+
+struct spe_perf_aux {
+	struct spe_perf_event_header header;
+	uint64_t aux_offset;
+	uint64_t aux_size;
+	uint64_t flags;
+};
+
+/*
+ * Start reading a perf.data file. Returns false if the file is not in a
+ * format that can be read, e.g. it is from a host with a different byte
+ * order.
+ */
+bool
+spe_perf_open(struct spe_perf *perf, const void *buf, size_t len)
+{
+	struct spe_perf_file_header hdr;
+	struct spe_perf_pipe_header pipe;
+
+	memset(perf, 0, sizeof(*perf));
+	if (len < sizeof(pipe)) {
+		return (false);
+	}
+
+	memcpy(&pipe, buf, sizeof(pipe));
+	if (pipe.magic != SPE_PERF_MAGIC) {
+		return (false);
+	}
+
+	perf->buf = buf;
+	if (pipe.size == sizeof(pipe)) {
+		/* The records follow the header until the end of the file */
+		perf->off = sizeof(pipe);
+		perf->end = len;
+		return (true);
+	}
+
+	if (pipe.size != sizeof(hdr) || len < sizeof(hdr)) {
+		return (false);
+	}
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.data.offset > len) {
+		return (false);
+	}
+
+	perf->off = (size_t)hdr.data.offset;
+	/*
+	 * The size is only written when perf exits cleanly, if it is missing
+	 * or the file was truncated read to the end of the file.
+	 */
+	if (hdr.data.size == 0 || hdr.data.size > len - hdr.data.offset) {
+		perf->end = len;
+	} else {
+		perf->end = (size_t)(hdr.data.offset + hdr.data.size);
+	}
+
+	return (true);
+}
+
+/*
+ * Find the next range of AUX data. The data is within the buffer passed to
+ * spe_perf_open so can be added to a decode context without copying it.
+ * Each AUX buffer, identified by the idx, is a separate stream of packets
+ * so should be decoded in its own context. Returns false at the end of the
+ * data, or if a record is invalid in which case the error field is set.
+ */
+bool
+spe_perf_next_aux(struct spe_perf *perf, struct spe_perf_aux_data *aux)
+{
+	struct spe_perf_event_header hdr;
+	struct spe_perf_auxtrace trace;
+	struct spe_perf_aux info;
+	const uint8_t *rec;
+	size_t avail;
+
+	while (!perf->error && perf->off < perf->end) {
+		avail = perf->end - perf->off;
+		rec = (const uint8_t *)perf->buf + perf->off;
+		if (avail < sizeof(hdr)) {
+			perf->error = true;
+			break;
+		}
+
+		memcpy(&hdr, rec, sizeof(hdr));
+		if (hdr.size < sizeof(hdr) || hdr.size > avail) {
+			perf->error = true;
+			break;
+		}
+		perf->off += hdr.size;
+
+		switch (hdr.type) {
+		case SPE_PERF_RECORD_AUX:
+			if (hdr.size < sizeof(info)) {
+				perf->error = true;
+				break;
+			}
+			memcpy(&info, rec, sizeof(info));
+			if ((info.flags & SPE_PERF_AUX_FLAG_TRUNCATED) != 0) {
+				perf->truncated++;
+			}
+			break;
+		case SPE_PERF_RECORD_AUXTRACE:
+			if (hdr.size < sizeof(trace)) {
+				perf->error = true;
+				break;
+			}
+			memcpy(&trace, rec, sizeof(trace));
+			if (trace.size > perf->end - perf->off) {
+				perf->error = true;
+				break;
+			}
+
+			aux->data = rec + hdr.size;
+			aux->size = (size_t)trace.size;
+			aux->offset = trace.offset;
+			aux->idx = trace.idx;
+			aux->tid = trace.tid;
+			aux->cpu = trace.cpu;
+			perf->off += (size_t)trace.size;
+			return (true);
+		default:
+			break;
+		}
+	}
+
+	return (false);
+}
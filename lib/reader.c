@@ -0,0 +1,1270 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#if !defined(_MSC_VER)
+#include <pthread.h>
+#include <unistd.h>
+#define	SPE_THREADS
+#else
+#include <io.h>
+#define	read		_read
+#endif
+
+#if defined(SPE_HAVE_IO_URING)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(SPE_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(SPE_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(SPE_HAVE_LZ4)
+#include <lz4frame.h>
+#endif
+
+#include "spedecode.h"
+#include "spedecode_internal.h"
+
+/*
+ * Read data on a separate thread, decompressing it if needed, and add it
+ * to a context in fixed size blocks. While the context decodes one block
+ * the thread fills the next so reading and decompressing overlaps with
+ * decoding. The thread may read up to depth blocks ahead, there is one
+ * more block for the context to hold. A block is reused once the context
+ * releases it. If the context holds every block, e.g. the data it keeps to
+ * find a record boundary spans them all, another is allocated.
+ */
+
+/* Compressed data is read in blocks of this size */
+#define	SPE_READER_IN_SIZE	(128 * 1024)
+
+#if defined(SPE_HAVE_IO_URING)
+/*
+ * Reading a file with io_uring keeps a read in flight for each buffer.
+ * The buffers are used in order of their file offset, once a buffer has
+ * been used a read of the next block of the file is started in it. When
+ * the file isn't compressed the buffers are added to the context directly
+ * and are used once the context releases them.
+ */
+struct spe_uring_buf {
+	uint8_t *buf;
+	uint64_t off;		/* File offset of buf */
+	size_t len;		/* Bytes read */
+	size_t pos;		/* Bytes used */
+	bool busy;		/* A read is in flight */
+	bool done;		/* Full or at the end of the file */
+	bool held;		/* Added to the context */
+};
+
+struct spe_uring {
+	int ring_fd;
+	int fd;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct spe_uring_buf *bufs;
+	size_t nbufs;
+	size_t max_bufs;	/* Most reads that can be in flight */
+	size_t buf_size;
+	size_t head;
+	uint64_t next_off;
+	bool eof;
+	bool error;
+};
+#endif
+
+struct spe_reader_block {
+	uint8_t *buf;
+	size_t len;
+};
+
+struct spe_reader {
+	spe_read_cb *read_cb;
+	void *read_cb_data;
+	spe_compress_type type;
+	bool detected;
+	const char *error;
+
+	/* Compressed data waiting to be decompressed */
+	uint8_t *in;
+	size_t in_len;
+	size_t in_pos;
+	bool in_eof;
+	bool frame_end;		/* The data so far ends a compressed frame */
+#if defined(SPE_HAVE_ZLIB)
+	z_stream zs;
+	bool zs_init;
+#endif
+#if defined(SPE_HAVE_ZSTD)
+	ZSTD_DCtx *zstd;
+#endif
+#if defined(SPE_HAVE_LZ4)
+	LZ4F_dctx *lz4;
+#endif
+
+	int fd;
+#if defined(SPE_HAVE_IO_URING)
+	struct spe_uring *uring;
+#endif
+	bool direct;			/* Add the uring buffers directly */
+
+	size_t block_size;
+	size_t nblocks;
+	uint8_t **blocks;
+	uint8_t **free;
+	size_t nfree;
+	struct spe_reader_block *full;
+	size_t full_head;
+	size_t nfull;
+	uint8_t **used;			/* Added to the context */
+	size_t nused;
+	bool started;
+	bool done;			/* No more blocks will be filled */
+	bool stop;
+
+#if defined(SPE_THREADS)
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool thread_started;
+#endif
+};
+
+spe_compress_type
+spe_compress_detect(const void *data, size_t len)
+{
+	static const struct {
+		uint8_t magic[4];
+		size_t len;
+		spe_compress_type type;
+	} formats[] = {
+		{ { 0x1f, 0x8b }, 2, SPE_COMPRESS_GZIP },
+		{ { 0x28, 0xb5, 0x2f, 0xfd }, 4, SPE_COMPRESS_ZSTD },
+		{ { 0x04, 0x22, 0x4d, 0x18 }, 4, SPE_COMPRESS_LZ4 },
+	};
+
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		if (len >= formats[i].len &&
+		    memcmp(data, formats[i].magic, formats[i].len) == 0) {
+			return (formats[i].type);
+		}
+	}
+
+	return (SPE_COMPRESS_NONE);
+}
+
+#if defined(SPE_HAVE_IO_URING)
+/* Start a read of the rest of a buffer */
+static bool
+spe_uring_submit(struct spe_uring *uring, size_t idx)
+{
+	struct spe_uring_buf *buf;
+	struct io_uring_sqe *sqe;
+	unsigned int tail;
+	long ret;
+
+	buf = &uring->bufs[idx];
+	tail = *uring->sq_tail;
+	sqe = &uring->sqes[tail & *uring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = uring->fd;
+	sqe->off = buf->off + buf->len;
+	sqe->addr = (uint64_t)(uintptr_t)(buf->buf + buf->len);
+	sqe->len = (uint32_t)(uring->buf_size - buf->len);
+	sqe->user_data = idx;
+	uring->sq_array[tail & *uring->sq_mask] = tail & *uring->sq_mask;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		ret = syscall(__NR_io_uring_enter, uring->ring_fd, 1, 0, 0,
+		    NULL, 0);
+	} while (ret == -1 && errno == EINTR);
+	if (ret != 1) {
+		uring->error = true;
+		return (false);
+	}
+
+	buf->busy = true;
+	return (true);
+}
+
+/*
+ * Wait for at least one read to complete. Returns false if waiting failed,
+ * a read that failed sets the error flag.
+ */
+static bool
+spe_uring_wait(struct spe_uring *uring)
+{
+	struct spe_uring_buf *buf;
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	long ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, uring->ring_fd, 0, 1,
+		    IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == -1) {
+		uring->error = true;
+		return (false);
+	}
+
+	head = *uring->cq_head;
+	while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &uring->cqes[head & *uring->cq_mask];
+		buf = &uring->bufs[cqe->user_data];
+		buf->busy = false;
+		if (cqe->res > 0) {
+			buf->len += (size_t)cqe->res;
+			buf->done = buf->len == uring->buf_size;
+		} else if (cqe->res == 0) {
+			buf->done = true;
+		} else if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+			uring->error = true;
+		}
+		head++;
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+		/* Finish a short read */
+		if (!buf->done && !uring->error) {
+			spe_uring_submit(uring, (size_t)(buf - uring->bufs));
+		}
+	}
+
+	return (true);
+}
+
+static void
+spe_uring_free(struct spe_uring *uring)
+{
+	if (uring == NULL) {
+		return;
+	}
+
+	/* The kernel may still be writing to the buffers */
+	for (size_t i = 0; uring->bufs != NULL && i < uring->nbufs; i++) {
+		while (uring->bufs[i].busy) {
+			if (!spe_uring_wait(uring)) {
+				break;
+			}
+		}
+	}
+
+	if (uring->sqes != NULL) {
+		munmap(uring->sqes, uring->sqes_size);
+	}
+	if (uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring) {
+		munmap(uring->cq_ring, uring->cq_ring_size);
+	}
+	if (uring->sq_ring != NULL) {
+		munmap(uring->sq_ring, uring->sq_ring_size);
+	}
+	if (uring->ring_fd != -1) {
+		close(uring->ring_fd);
+	}
+	for (size_t i = 0; uring->bufs != NULL && i < uring->nbufs; i++) {
+		free(uring->bufs[i].buf);
+	}
+	free(uring->bufs);
+	free(uring);
+}
+
+/*
+ * Set up an io_uring to read a regular file. Returns NULL if the file
+ * can't be read this way, e.g. it's a pipe or the kernel doesn't support
+ * io_uring, the file is then read with read(2).
+ */
+static struct spe_uring *
+spe_uring_alloc(int fd, size_t buf_size, size_t depth)
+{
+	struct io_uring_params params;
+	struct spe_uring *uring;
+	struct stat sb;
+	uint8_t *sq, *cq;
+	off_t off;
+
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) ||
+	    buf_size > UINT32_MAX) {
+		return (NULL);
+	}
+	off = lseek(fd, 0, SEEK_CUR);
+	if (off == -1) {
+		return (NULL);
+	}
+
+	uring = calloc(1, sizeof(*uring));
+	if (uring == NULL) {
+		return (NULL);
+	}
+	uring->fd = fd;
+	uring->buf_size = buf_size;
+	uring->next_off = (uint64_t)off;
+
+	memset(&params, 0, sizeof(params));
+	uring->ring_fd = (int)syscall(__NR_io_uring_setup, (unsigned int)depth,
+	    &params);
+	if (uring->ring_fd == -1 || params.sq_entries < depth) {
+		goto fail;
+	}
+
+	/* Map the rings, these may be a single mapping */
+	uring->sq_ring_size = params.sq_off.array +
+	    params.sq_entries * sizeof(unsigned int);
+	uring->cq_ring_size = params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0 &&
+	    uring->cq_ring_size > uring->sq_ring_size) {
+		uring->sq_ring_size = uring->cq_ring_size;
+	}
+	sq = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		goto fail;
+	}
+	uring->sq_ring = sq;
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+		    IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			goto fail;
+		}
+	}
+	uring->cq_ring = cq;
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		goto fail;
+	}
+
+	uring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	uring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	uring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	uring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	uring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	uring->nbufs = depth;
+	/* Without NODROP completions that don't fit in the queue are lost */
+	uring->max_bufs = SIZE_MAX;
+	if ((params.features & IORING_FEAT_NODROP) == 0) {
+		uring->max_bufs = params.cq_entries;
+	}
+	uring->bufs = calloc(depth, sizeof(*uring->bufs));
+	if (uring->bufs == NULL) {
+		goto fail;
+	}
+	for (size_t i = 0; i < depth; i++) {
+		uring->bufs[i].buf = malloc(buf_size);
+		if (uring->bufs[i].buf == NULL) {
+			goto fail;
+		}
+	}
+
+	/* Start reading the first blocks */
+	for (size_t i = 0; i < depth; i++) {
+		uring->bufs[i].off = uring->next_off;
+		uring->next_off += buf_size;
+		if (!spe_uring_submit(uring, i)) {
+			goto fail;
+		}
+	}
+
+	return (uring);
+
+fail:
+	spe_uring_free(uring);
+	return (NULL);
+}
+
+/* A read callback that takes the data from the buffers in order */
+static bool
+spe_uring_read(void *data, void *out, size_t len, size_t *lenp)
+{
+	struct spe_uring *uring;
+	struct spe_uring_buf *buf;
+
+	uring = data;
+	while (!uring->eof) {
+		buf = &uring->bufs[uring->head];
+		while (!buf->done) {
+			if (uring->error || !buf->busy ||
+			    !spe_uring_wait(uring)) {
+				return (false);
+			}
+		}
+
+		if (buf->pos < buf->len) {
+			break;
+		}
+
+		/* A block that isn't full is the end of the file */
+		if (buf->len < uring->buf_size) {
+			uring->eof = true;
+			break;
+		}
+
+		/* Read the next block into the used buffer */
+		buf->off = uring->next_off;
+		buf->len = 0;
+		buf->pos = 0;
+		buf->done = false;
+		uring->next_off += uring->buf_size;
+		if (!spe_uring_submit(uring, uring->head)) {
+			return (false);
+		}
+		uring->head = (uring->head + 1) % uring->nbufs;
+	}
+
+	if (uring->eof) {
+		*lenp = 0;
+		return (true);
+	}
+
+	if (len > buf->len - buf->pos) {
+		len = buf->len - buf->pos;
+	}
+	memcpy(out, buf->buf + buf->pos, len);
+	buf->pos += len;
+	*lenp = len;
+
+	return (true);
+}
+
+/*
+ * Add a buffer when the context holds all of them. It's placed before the
+ * oldest buffer the context holds so the buffers stay in file order.
+ */
+static bool
+spe_uring_grow(struct spe_uring *uring)
+{
+	struct spe_uring_buf *bufs;
+	uint8_t *buf;
+
+	if (uring->nbufs == uring->max_bufs) {
+		return (false);
+	}
+	buf = malloc(uring->buf_size);
+	if (buf == NULL) {
+		return (false);
+	}
+	bufs = realloc(uring->bufs, (uring->nbufs + 1) * sizeof(*bufs));
+	if (bufs == NULL) {
+		free(buf);
+		return (false);
+	}
+	uring->bufs = bufs;
+
+	/* No reads are in flight so the indices can change */
+	memmove(&bufs[uring->head + 1], &bufs[uring->head],
+	    (uring->nbufs - uring->head) * sizeof(*bufs));
+	uring->nbufs++;
+	memset(&bufs[uring->head], 0, sizeof(*bufs));
+	bufs[uring->head].buf = buf;
+	bufs[uring->head].off = uring->next_off;
+	uring->next_off += uring->buf_size;
+
+	return (spe_uring_submit(uring, uring->head));
+}
+
+/*
+ * Decide if the buffers can be added to the context directly, this needs
+ * the data to be uncompressed.
+ */
+static bool
+spe_uring_direct(struct spe_uring *uring)
+{
+	struct spe_uring_buf *buf;
+
+	buf = &uring->bufs[uring->head];
+	while (!buf->done) {
+		if (uring->error || !buf->busy || !spe_uring_wait(uring)) {
+			return (false);
+		}
+	}
+
+	return (spe_compress_detect(buf->buf, buf->len) == SPE_COMPRESS_NONE);
+}
+
+/*
+ * Add the next buffer to the context without copying it. Returns false at
+ * the end of the file or on error.
+ */
+static bool
+spe_uring_add(struct spe_reader *reader, struct spe_decode_ctx *ctx)
+{
+	struct spe_uring *uring;
+	struct spe_uring_buf *buf;
+
+	uring = reader->uring;
+	if (uring->eof) {
+		return (false);
+	}
+
+	buf = &uring->bufs[uring->head];
+	if (buf->held && !spe_uring_grow(uring)) {
+		reader->error = "Unable to allocate a read buffer";
+		return (false);
+	}
+	buf = &uring->bufs[uring->head];
+	while (!buf->done) {
+		if (uring->error || !buf->busy || !spe_uring_wait(uring)) {
+			reader->error = "Unable to read the data";
+			return (false);
+		}
+	}
+	if (uring->error) {
+		reader->error = "Unable to read the data";
+		return (false);
+	}
+
+	/* A block that isn't full is the end of the file */
+	if (buf->len < uring->buf_size) {
+		uring->eof = true;
+		if (buf->len == 0) {
+			return (false);
+		}
+	}
+
+	buf->held = true;
+	uring->head = (uring->head + 1) % uring->nbufs;
+	if (!spe_decode_ctx_add(ctx, 0, buf->buf, buf->len)) {
+		reader->error = "Unable to add the data to the context";
+		return (false);
+	}
+
+	return (true);
+}
+
+/* Read the next block of the file into a buffer the context released */
+static void
+spe_uring_release(struct spe_uring *uring, void *data)
+{
+	struct spe_uring_buf *buf;
+
+	for (size_t i = 0; i < uring->nbufs; i++) {
+		buf = &uring->bufs[i];
+		if (buf->buf != data) {
+			continue;
+		}
+
+		assert(buf->held);
+		buf->held = false;
+		buf->len = 0;
+		buf->pos = 0;
+		buf->done = false;
+		if (uring->eof || uring->error) {
+			/* Nothing more will be read */
+			buf->done = true;
+			break;
+		}
+		buf->off = uring->next_off;
+		uring->next_off += uring->buf_size;
+		spe_uring_submit(uring, i);
+		break;
+	}
+}
+#endif
+
+/*
+ * Read more compressed data, keeping any that hasn't been used yet.
+ * Returns false on error.
+ */
+static bool
+spe_reader_read(struct spe_reader *reader)
+{
+	size_t len;
+
+	if (reader->in_pos > 0) {
+		memmove(reader->in, reader->in + reader->in_pos,
+		    reader->in_len - reader->in_pos);
+		reader->in_len -= reader->in_pos;
+		reader->in_pos = 0;
+	}
+	if (reader->in_len == SPE_READER_IN_SIZE) {
+		reader->error = "Invalid compressed data";
+		return (false);
+	}
+
+	if (!reader->read_cb(reader->read_cb_data,
+	    reader->in + reader->in_len, SPE_READER_IN_SIZE - reader->in_len,
+	    &len)) {
+		reader->error = "Unable to read the data";
+		return (false);
+	}
+	if (len == 0) {
+		reader->in_eof = true;
+	}
+	reader->in_len += len;
+
+	return (true);
+}
+
+/* Find the format from the start of the data and set up to decompress it */
+static bool
+spe_reader_detect(struct spe_reader *reader)
+{
+	reader->detected = true;
+	while (reader->in_len < 4 && !reader->in_eof) {
+		if (!spe_reader_read(reader)) {
+			return (false);
+		}
+	}
+
+	reader->type = spe_compress_detect(reader->in, reader->in_len);
+	switch (reader->type) {
+	case SPE_COMPRESS_NONE:
+		reader->frame_end = true;
+		return (true);
+	case SPE_COMPRESS_GZIP:
+#if defined(SPE_HAVE_ZLIB)
+		/* Add 32 to the window bits to accept gzip and zlib headers */
+		if (inflateInit2(&reader->zs, 15 + 32) != Z_OK) {
+			reader->error = "Unable to initialise zlib";
+			return (false);
+		}
+		reader->zs_init = true;
+		return (true);
+#else
+		reader->error = "Built without gzip support";
+		return (false);
+#endif
+	case SPE_COMPRESS_ZSTD:
+#if defined(SPE_HAVE_ZSTD)
+		reader->zstd = ZSTD_createDCtx();
+		if (reader->zstd == NULL) {
+			reader->error = "Unable to initialise zstd";
+			return (false);
+		}
+		return (true);
+#else
+		reader->error = "Built without zstd support";
+		return (false);
+#endif
+	case SPE_COMPRESS_LZ4:
+#if defined(SPE_HAVE_LZ4)
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&reader->lz4,
+		    LZ4F_VERSION))) {
+			reader->error = "Unable to initialise lz4";
+			return (false);
+		}
+		return (true);
+#else
+		reader->error = "Built without lz4 support";
+		return (false);
+#endif
+	}
+
+	reader->error = "Unknown compression";
+	return (false);
+}
+
+/*
+ * Decompress what can be from the input into buf, starting at *lenp.
+ * Returns false on error.
+ */
+static bool
+spe_reader_step(struct spe_reader *reader, uint8_t *buf, size_t size,
+    size_t *lenp)
+{
+	size_t len;
+
+	switch (reader->type) {
+	case SPE_COMPRESS_NONE:
+		len = reader->in_len - reader->in_pos;
+		if (len > 0) {
+			/* Data read while finding the format */
+			if (len > size - *lenp) {
+				len = size - *lenp;
+			}
+			memcpy(buf + *lenp, reader->in + reader->in_pos, len);
+			reader->in_pos += len;
+		} else if (!reader->in_eof) {
+			/* Read directly into the block */
+			if (!reader->read_cb(reader->read_cb_data,
+			    buf + *lenp, size - *lenp, &len)) {
+				reader->error = "Unable to read the data";
+				return (false);
+			}
+			if (len == 0) {
+				reader->in_eof = true;
+			}
+		}
+		*lenp += len;
+		return (true);
+#if defined(SPE_HAVE_ZLIB)
+	case SPE_COMPRESS_GZIP: {
+		int ret;
+
+		reader->zs.next_in = reader->in + reader->in_pos;
+		reader->zs.avail_in = (uInt)(reader->in_len - reader->in_pos);
+		reader->zs.next_out = buf + *lenp;
+		reader->zs.avail_out = (uInt)(size - *lenp);
+		ret = inflate(&reader->zs, Z_NO_FLUSH);
+		reader->in_pos = reader->in_len - reader->zs.avail_in;
+		*lenp = size - reader->zs.avail_out;
+		if (ret == Z_STREAM_END) {
+			/* There may be another member after this one */
+			reader->frame_end = true;
+			inflateReset(&reader->zs);
+		} else if (ret == Z_OK) {
+			reader->frame_end = false;
+		} else if (ret != Z_BUF_ERROR) {
+			reader->error = "Invalid gzip data";
+			return (false);
+		}
+		return (true);
+	}
+#endif
+#if defined(SPE_HAVE_ZSTD)
+	case SPE_COMPRESS_ZSTD: {
+		ZSTD_inBuffer in;
+		ZSTD_outBuffer out;
+		size_t ret;
+
+		in.src = reader->in + reader->in_pos;
+		in.size = reader->in_len - reader->in_pos;
+		in.pos = 0;
+		out.dst = buf;
+		out.size = size;
+		out.pos = *lenp;
+		ret = ZSTD_decompressStream(reader->zstd, &out, &in);
+		if (ZSTD_isError(ret)) {
+			reader->error = "Invalid zstd data";
+			return (false);
+		}
+		/* Without new data this returns the size of the next header */
+		if (in.pos > 0 || out.pos != *lenp) {
+			reader->frame_end = ret == 0;
+		}
+		reader->in_pos += in.pos;
+		*lenp = out.pos;
+		return (true);
+	}
+#endif
+#if defined(SPE_HAVE_LZ4)
+	case SPE_COMPRESS_LZ4: {
+		size_t in_len, ret;
+
+		in_len = reader->in_len - reader->in_pos;
+		len = size - *lenp;
+		ret = LZ4F_decompress(reader->lz4, buf + *lenp, &len,
+		    reader->in + reader->in_pos, &in_len, NULL);
+		if (LZ4F_isError(ret)) {
+			reader->error = "Invalid lz4 data";
+			return (false);
+		}
+		if (in_len > 0 || len > 0) {
+			reader->frame_end = ret == 0;
+		}
+		reader->in_pos += in_len;
+		*lenp += len;
+		return (true);
+	}
+#endif
+	default:
+		break;
+	}
+
+	reader->error = "Unknown compression";
+	return (false);
+}
+
+/*
+ * Fill a block with the next data. Returns the length, this is only less
+ * than the block size at the end of the data or on error.
+ */
+static size_t
+spe_reader_fill(struct spe_reader *reader, uint8_t *buf)
+{
+	size_t in_pos, len, prev_len;
+
+	if (!reader->detected && !spe_reader_detect(reader)) {
+		return (0);
+	}
+
+	len = 0;
+	while (len < reader->block_size && reader->error == NULL) {
+		in_pos = reader->in_pos;
+		prev_len = len;
+		if (!spe_reader_step(reader, buf, reader->block_size, &len)) {
+			break;
+		}
+		if (len != prev_len || reader->in_pos != in_pos) {
+			continue;
+		}
+
+		/* Nothing was decompressed so more data is needed */
+		if (reader->in_eof) {
+			if (!reader->frame_end) {
+				reader->error = "Truncated compressed data";
+			}
+			break;
+		}
+		if (!spe_reader_read(reader)) {
+			break;
+		}
+	}
+
+	return (len);
+}
+
+#if defined(SPE_THREADS)
+static void *
+spe_reader_thread(void *arg)
+{
+	struct spe_reader *reader;
+	uint8_t *buf;
+	size_t len;
+
+	reader = arg;
+	pthread_mutex_lock(&reader->lock);
+	while (true) {
+		while (reader->nfree == 0 && !reader->stop) {
+			pthread_cond_wait(&reader->cond, &reader->lock);
+		}
+		if (reader->stop) {
+			break;
+		}
+		buf = reader->free[--reader->nfree];
+		pthread_mutex_unlock(&reader->lock);
+
+		len = spe_reader_fill(reader, buf);
+
+		pthread_mutex_lock(&reader->lock);
+		if (len == 0) {
+			reader->free[reader->nfree++] = buf;
+			break;
+		}
+		reader->full[(reader->full_head + reader->nfull) %
+		    reader->nblocks].buf = buf;
+		reader->full[(reader->full_head + reader->nfull) %
+		    reader->nblocks].len = len;
+		reader->nfull++;
+		pthread_cond_broadcast(&reader->cond);
+	}
+	reader->done = true;
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+
+	return (NULL);
+}
+#endif
+
+static void
+spe_reader_release(struct spe_decode_ctx *ctx, void *priv, void *buf,
+    size_t len)
+{
+	struct spe_reader *reader;
+
+	(void)ctx;
+	(void)len;
+
+	reader = priv;
+#if defined(SPE_HAVE_IO_URING)
+	if (reader->direct) {
+		spe_uring_release(reader->uring, buf);
+		return;
+	}
+#endif
+#if defined(SPE_THREADS)
+	pthread_mutex_lock(&reader->lock);
+#endif
+	for (size_t i = 0; i < reader->nused; i++) {
+		if (reader->used[i] == buf) {
+			reader->used[i] = reader->used[--reader->nused];
+			break;
+		}
+	}
+	reader->free[reader->nfree++] = buf;
+#if defined(SPE_THREADS)
+	pthread_cond_broadcast(&reader->cond);
+	pthread_mutex_unlock(&reader->lock);
+#endif
+}
+
+/*
+ * Add a block when the context holds all of them. With threads this is
+ * called with the lock held while the reader thread is waiting for a free
+ * block. Returns false if it couldn't be allocated.
+ */
+static bool
+spe_reader_grow(struct spe_reader *reader)
+{
+	struct spe_reader_block *full;
+	uint8_t *block, **tmp;
+	size_t n;
+
+	assert(reader->nfull == 0);
+	n = reader->nblocks + 1;
+	block = malloc(reader->block_size);
+	if (block == NULL) {
+		return (false);
+	}
+
+	/* The arrays may be larger than needed if one of these fails */
+	tmp = realloc(reader->blocks, n * sizeof(*tmp));
+	if (tmp == NULL) {
+		goto fail;
+	}
+	reader->blocks = tmp;
+	tmp = realloc(reader->free, n * sizeof(*tmp));
+	if (tmp == NULL) {
+		goto fail;
+	}
+	reader->free = tmp;
+	tmp = realloc(reader->used, n * sizeof(*tmp));
+	if (tmp == NULL) {
+		goto fail;
+	}
+	reader->used = tmp;
+	full = realloc(reader->full, n * sizeof(*full));
+	if (full == NULL) {
+		goto fail;
+	}
+	reader->full = full;
+
+	/* The full ring is empty so can start again from the beginning */
+	reader->full_head = 0;
+	reader->blocks[reader->nblocks] = block;
+	reader->nblocks = n;
+	reader->free[reader->nfree++] = block;
+
+	return (true);
+
+fail:
+	free(block);
+	return (false);
+}
+
+/*
+ * Allocate a reader to read the data with read_cb. The data is added to
+ * the context in blocks of block_size bytes, with up to depth blocks read
+ * ahead of the context. The block size must be at least
+ * SPE_READER_BLOCK_MIN.
+ */
+struct spe_reader *
+spe_reader_alloc(spe_read_cb *read_cb, void *data, size_t block_size,
+    size_t depth)
+{
+	struct spe_reader *reader;
+
+	if (block_size < SPE_READER_BLOCK_MIN || depth == 0) {
+		return (NULL);
+	}
+
+	reader = calloc(1, sizeof(*reader));
+	if (reader == NULL) {
+		return (NULL);
+	}
+
+#if defined(SPE_THREADS)
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_cond_init(&reader->cond, NULL);
+#endif
+	reader->read_cb = read_cb;
+	reader->read_cb_data = data;
+	reader->fd = -1;
+	reader->block_size = block_size;
+	reader->nblocks = depth + 1;
+	reader->in = malloc(SPE_READER_IN_SIZE);
+	reader->blocks = calloc(reader->nblocks, sizeof(*reader->blocks));
+	reader->free = calloc(reader->nblocks, sizeof(*reader->free));
+	reader->full = calloc(reader->nblocks, sizeof(*reader->full));
+	reader->used = calloc(reader->nblocks, sizeof(*reader->used));
+	if (reader->in == NULL || reader->blocks == NULL ||
+	    reader->free == NULL || reader->full == NULL ||
+	    reader->used == NULL) {
+		spe_reader_free(reader, NULL);
+		return (NULL);
+	}
+	for (size_t i = 0; i < reader->nblocks; i++) {
+		reader->blocks[i] = malloc(block_size);
+		if (reader->blocks[i] == NULL) {
+			spe_reader_free(reader, NULL);
+			return (NULL);
+		}
+		reader->free[reader->nfree++] = reader->blocks[i];
+	}
+
+	return (reader);
+}
+
+static bool
+spe_reader_fd_read(void *data, void *buf, size_t len, size_t *lenp)
+{
+	struct spe_reader *reader;
+	long read_len;
+
+	reader = data;
+	do {
+		read_len = (long)read(reader->fd, buf, (unsigned int)len);
+	} while (read_len == -1 && errno == EINTR);
+	if (read_len == -1) {
+		return (false);
+	}
+
+	*lenp = (size_t)read_len;
+	return (true);
+}
+
+/*
+ * As spe_reader_alloc, reading from a file descriptor. A regular file is
+ * read with io_uring when it's available, keeping a read in flight for
+ * each block the reader is ahead of the context. Otherwise the reads are
+ * made one at a time on the reader's thread.
+ */
+struct spe_reader *
+spe_reader_alloc_fd(int fd, size_t block_size, size_t depth)
+{
+	struct spe_reader *reader;
+
+	reader = spe_reader_alloc(spe_reader_fd_read, NULL, block_size, depth);
+	if (reader == NULL) {
+		return (NULL);
+	}
+
+	reader->fd = fd;
+	reader->read_cb_data = reader;
+#if defined(SPE_HAVE_IO_URING)
+	reader->uring = spe_uring_alloc(fd, block_size, depth);
+	if (reader->uring != NULL) {
+		reader->read_cb = spe_uring_read;
+		reader->read_cb_data = reader->uring;
+	}
+#endif
+
+	return (reader);
+}
+
+/*
+ * Add the next block to the context. Returns false at the end of the data
+ * or on error, spe_reader_error returns the error if there was one. The
+ * reader owns the context's release callback until it is freed.
+ */
+bool
+spe_reader_add(struct spe_reader *reader, struct spe_decode_ctx *ctx)
+{
+	struct spe_reader_block block;
+
+	if (!reader->started) {
+		reader->started = true;
+		spe_decode_ctx_set_release_cb(ctx, spe_reader_release, reader);
+#if defined(SPE_HAVE_IO_URING)
+		/* The io_uring reads ahead so a thread isn't needed */
+		if (reader->uring != NULL && spe_uring_direct(reader->uring)) {
+			reader->direct = true;
+			reader->detected = true;
+			for (size_t i = 0; i < reader->nblocks; i++) {
+				free(reader->blocks[i]);
+				reader->blocks[i] = NULL;
+			}
+			reader->nfree = 0;
+		}
+#endif
+#if defined(SPE_THREADS)
+		if (!reader->direct && pthread_create(&reader->thread, NULL,
+		    spe_reader_thread, reader) == 0) {
+			reader->thread_started = true;
+		}
+#endif
+	}
+
+	/* Release the blocks the context has finished with */
+	spe_decode_ctx_add(ctx, 0, NULL, 0);
+
+#if defined(SPE_HAVE_IO_URING)
+	if (reader->direct) {
+		return (spe_uring_add(reader, ctx));
+	}
+#endif
+
+#if defined(SPE_THREADS)
+	if (reader->thread_started) {
+		pthread_mutex_lock(&reader->lock);
+		while (reader->nfull == 0 && !reader->done) {
+			if (reader->nused == reader->nblocks) {
+				/* The context holds every block */
+				if (!spe_reader_grow(reader)) {
+					reader->error =
+					    "Unable to allocate a read block";
+					pthread_mutex_unlock(&reader->lock);
+					return (false);
+				}
+				pthread_cond_broadcast(&reader->cond);
+			}
+			pthread_cond_wait(&reader->cond, &reader->lock);
+		}
+		if (reader->nfull == 0) {
+			pthread_mutex_unlock(&reader->lock);
+			return (false);
+		}
+		block = reader->full[reader->full_head];
+		reader->full_head = (reader->full_head + 1) %
+		    reader->nblocks;
+		reader->nfull--;
+		reader->used[reader->nused++] = block.buf;
+		pthread_mutex_unlock(&reader->lock);
+	} else
+#endif
+	{
+		/* Fill the block on this thread */
+		if (reader->done) {
+			return (false);
+		}
+		if (reader->nfree == 0 && !spe_reader_grow(reader)) {
+			reader->error = "Unable to allocate a read block";
+			return (false);
+		}
+		block.buf = reader->free[--reader->nfree];
+		block.len = spe_reader_fill(reader, block.buf);
+		if (block.len == 0) {
+			reader->free[reader->nfree++] = block.buf;
+			reader->done = true;
+			return (false);
+		}
+		reader->used[reader->nused++] = block.buf;
+	}
+
+	if (!spe_decode_ctx_add(ctx, 0, block.buf, block.len)) {
+		reader->error = "Unable to add the data to the context";
+		return (false);
+	}
+
+	return (true);
+}
+
+const char *
+spe_reader_error(const struct spe_reader *reader)
+{
+	return (reader->error);
+}
+
+/*
+ * Stop reading and free the reader. Any part of a block the context hasn't
+ * decoded is copied so the context can still be used. As the thread may
+ * be in the read callback this waits for the read to return.
+ */
+bool
+spe_reader_free(struct spe_reader *reader, struct spe_decode_ctx *ctx)
+{
+	bool ret;
+
+	if (reader == NULL) {
+		return (true);
+	}
+
+#if defined(SPE_THREADS)
+	if (reader->thread_started) {
+		pthread_mutex_lock(&reader->lock);
+		reader->stop = true;
+		pthread_cond_broadcast(&reader->cond);
+		pthread_mutex_unlock(&reader->lock);
+		pthread_join(reader->thread, NULL);
+	}
+	pthread_mutex_destroy(&reader->lock);
+	pthread_cond_destroy(&reader->cond);
+#endif
+
+	ret = true;
+	if (ctx != NULL && reader->started) {
+		spe_decode_ctx_set_release_cb(ctx, NULL, NULL);
+		for (size_t i = 0; i < reader->nused; i++) {
+			if (!spe_decode_ctx_release(ctx, reader->used[i])) {
+				ret = false;
+			}
+		}
+#if defined(SPE_HAVE_IO_URING)
+		for (size_t i = 0; reader->direct && i < reader->uring->nbufs;
+		    i++) {
+			if (reader->uring->bufs[i].held &&
+			    !spe_decode_ctx_release(ctx,
+			    reader->uring->bufs[i].buf)) {
+				ret = false;
+			}
+		}
+#endif
+	}
+
+#if defined(SPE_HAVE_ZLIB)
+	if (reader->zs_init) {
+		inflateEnd(&reader->zs);
+	}
+#endif
+#if defined(SPE_HAVE_ZSTD)
+	ZSTD_freeDCtx(reader->zstd);
+#endif
+#if defined(SPE_HAVE_LZ4)
+	if (reader->lz4 != NULL) {
+		LZ4F_freeDecompressionContext(reader->lz4);
+	}
+#endif
+#if defined(SPE_HAVE_IO_URING)
+	spe_uring_free(reader->uring);
+#endif
+	for (size_t i = 0; reader->blocks != NULL && i < reader->nblocks;
+	    i++) {
+		free(reader->blocks[i]);
+	}
+	free(reader->blocks);
+	free(reader->free);
+	free(reader->full);
+	free(reader->used);
+	free(reader->in);
+	free(reader);
+
+	return (ret);
+}
@@ -0,0 +1,385 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spedecode.h"
+
+/*
+ * A columnar file of decoded records. The file header is followed by
+ * blocks of up to SPE_RECFILE_BLOCK_RECORDS records. Each block has a
+ * header with the offset of each column from the start of the block, the
+ * columns are arrays of one field from every record in the block. The file
+ * header, blocks, and columns all start on a SPE_RECFILE_ALIGN boundary so
+ * when the file is mapped the columns can be read with aligned vector
+ * loads. All values are in the host byte order, this is checked by the
+ * reader.
+ */
+#define	SPE_RECFILE_MAGIC	"SPERECS"
+#define	SPE_RECFILE_VERSION	2
+#define	SPE_RECFILE_ORDER	0x01020304u
+#define	SPE_RECFILE_ALIGN	64
+#define	SPE_RECFILE_BLOCK_MAGIC	0x4b4c4253u	/* "SBLK" */
+
+struct spe_recfile_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t order;
+	uint32_t header_size;
+	uint32_t block_header_size;
+	uint32_t columns;
+	uint32_t block_records;
+	uint8_t pad[32];
+};
+
+struct spe_recfile_block_header {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t size;		/* Including this header and padding */
+	uint64_t offset[SPE_RECFILE_COLS];
+	uint8_t pad[48];
+};
+
+#define	SPE_RECFILE_ALIGNED(x)	\
+    (((x) + SPE_RECFILE_ALIGN - 1) & ~(size_t)(SPE_RECFILE_ALIGN - 1))
+
+/* The size of one value in each column */
+static const uint8_t spe_recfile_col_size[SPE_RECFILE_COLS] = {
+	[SPE_RECFILE_COL_PRESENT] = sizeof(uint32_t),
+	[SPE_RECFILE_COL_ADDR(0)] = sizeof(uint64_t),
+	[SPE_RECFILE_COL_ADDR(1)] = sizeof(uint64_t),
+	[SPE_RECFILE_COL_ADDR(2)] = sizeof(uint64_t),
+	[SPE_RECFILE_COL_ADDR(3)] = sizeof(uint64_t),
+	[SPE_RECFILE_COL_ADDR(4)] = sizeof(uint64_t),
+	[SPE_RECFILE_COL_COUNTER(0)] = sizeof(uint16_t),
+	[SPE_RECFILE_COL_COUNTER(1)] = sizeof(uint16_t),
+	[SPE_RECFILE_COL_COUNTER(2)] = sizeof(uint16_t),
+	[SPE_RECFILE_COL_EVENTS] = sizeof(uint64_t),
+	[SPE_RECFILE_COL_DATA_SOURCE] = sizeof(uint64_t),
+	[SPE_RECFILE_COL_OP_CLASS] = sizeof(uint8_t),
+	[SPE_RECFILE_COL_OP_SUBCLASS] = sizeof(uint8_t),
+	[SPE_RECFILE_COL_CONTEXT] = sizeof(uint32_t),
+	[SPE_RECFILE_COL_TIMESTAMP] = sizeof(uint64_t),
+	[SPE_RECFILE_COL_SOURCE] = sizeof(uint32_t),
+};
+
+struct spe_recfile_writer {
+	spe_recfile_write_cb *write;
+	void *write_data;
+	bool failed;
+	size_t count;
+	void *cols[SPE_RECFILE_COLS];
+};
+
+static bool
+spe_recfile_out(struct spe_recfile_writer *w, const void *buf, size_t len)
+{
+	if (!w->failed && len > 0 && !w->write(w->write_data, buf, len)) {
+		w->failed = true;
+	}
+
+	return (!w->failed);
+}
+
+static bool
+spe_recfile_pad(struct spe_recfile_writer *w, size_t len)
+{
+	static const uint8_t zero[SPE_RECFILE_ALIGN];
+
+	assert(len < SPE_RECFILE_ALIGN);
+	return (spe_recfile_out(w, zero, len));
+}
+
+/*
+ * Create a writer. The file header is written immediately, the records
+ * are written a block at a time with the write callback.
+ */
+struct spe_recfile_writer *
+spe_recfile_writer_alloc(spe_recfile_write_cb *cb, void *data)
+{
+	struct spe_recfile_header hdr;
+	struct spe_recfile_writer *w;
+
+	/* The headers keep the columns aligned */
+	assert(sizeof(hdr) % SPE_RECFILE_ALIGN == 0);
+	assert(sizeof(struct spe_recfile_block_header) % SPE_RECFILE_ALIGN ==
+	    0);
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL) {
+		return (NULL);
+	}
+	w->write = cb;
+	w->write_data = data;
+
+	for (size_t i = 0; i < SPE_RECFILE_COLS; i++) {
+		w->cols[i] = malloc(SPE_RECFILE_BLOCK_RECORDS *
+		    spe_recfile_col_size[i]);
+		if (w->cols[i] == NULL) {
+			spe_recfile_writer_free(w);
+			return (NULL);
+		}
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SPE_RECFILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = SPE_RECFILE_VERSION;
+	hdr.order = SPE_RECFILE_ORDER;
+	hdr.header_size = sizeof(hdr);
+	hdr.block_header_size = sizeof(struct spe_recfile_block_header);
+	hdr.columns = SPE_RECFILE_COLS;
+	hdr.block_records = SPE_RECFILE_BLOCK_RECORDS;
+	if (!spe_recfile_out(w, &hdr, sizeof(hdr))) {
+		spe_recfile_writer_free(w);
+		return (NULL);
+	}
+
+	return (w);
+}
+
+static bool
+spe_recfile_flush(struct spe_recfile_writer *w)
+{
+	struct spe_recfile_block_header hdr;
+	size_t off, len;
+
+	if (w->count == 0) {
+		return (!w->failed);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SPE_RECFILE_BLOCK_MAGIC;
+	hdr.count = (uint32_t)w->count;
+	off = sizeof(hdr);
+	for (size_t i = 0; i < SPE_RECFILE_COLS; i++) {
+		hdr.offset[i] = off;
+		off = SPE_RECFILE_ALIGNED(off + w->count *
+		    spe_recfile_col_size[i]);
+	}
+	hdr.size = off;
+
+	spe_recfile_out(w, &hdr, sizeof(hdr));
+	for (size_t i = 0; i < SPE_RECFILE_COLS; i++) {
+		len = w->count * spe_recfile_col_size[i];
+		spe_recfile_out(w, w->cols[i], len);
+		spe_recfile_pad(w, SPE_RECFILE_ALIGNED(len) - len);
+	}
+	w->count = 0;
+
+	return (!w->failed);
+}
+
+#define	SPE_RECFILE_COL(w, col, type)	((type *)(w)->cols[(col)])
+
+/*
+ * Add a record to the file. Returns false if a write failed.
+ */
+bool
+spe_recfile_write(struct spe_recfile_writer *w, const struct spe_record *rec)
+{
+	size_t i;
+
+	i = w->count;
+	SPE_RECFILE_COL(w, SPE_RECFILE_COL_PRESENT, uint32_t)[i] =
+	    rec->present;
+	for (size_t j = 0; j < SPE_RECORD_ADDR_MAX; j++) {
+		SPE_RECFILE_COL(w, SPE_RECFILE_COL_ADDR(j), uint64_t)[i] =
+		    rec->addr[j];
+	}
+	for (size_t j = 0; j < SPE_RECORD_COUNTER_MAX; j++) {
+		SPE_RECFILE_COL(w, SPE_RECFILE_COL_COUNTER(j), uint16_t)[i] =
+		    rec->counter[j];
+	}
+	SPE_RECFILE_COL(w, SPE_RECFILE_COL_EVENTS, uint64_t)[i] = rec->events;
+	SPE_RECFILE_COL(w, SPE_RECFILE_COL_DATA_SOURCE, uint64_t)[i] =
+	    rec->data_source;
+	SPE_RECFILE_COL(w, SPE_RECFILE_COL_OP_CLASS, uint8_t)[i] =
+	    rec->op_class;
+	SPE_RECFILE_COL(w, SPE_RECFILE_COL_OP_SUBCLASS, uint8_t)[i] =
+	    rec->op_subclass;
+	SPE_RECFILE_COL(w, SPE_RECFILE_COL_CONTEXT, uint32_t)[i] =
+	    rec->context;
+	SPE_RECFILE_COL(w, SPE_RECFILE_COL_TIMESTAMP, uint64_t)[i] =
+	    rec->timestamp;
+	SPE_RECFILE_COL(w, SPE_RECFILE_COL_SOURCE, uint32_t)[i] = rec->source;
+
+	if (++w->count == SPE_RECFILE_BLOCK_RECORDS) {
+		return (spe_recfile_flush(w));
+	}
+
+	return (!w->failed);
+}
+
+/*
+ * Write any remaining records and free the writer. Returns false if any
+ * write failed.
+ */
+bool
+spe_recfile_writer_free(struct spe_recfile_writer *w)
+{
+	bool ret;
+
+	if (w == NULL) {
+		return (true);
+	}
+
+	ret = spe_recfile_flush(w);
+	for (size_t i = 0; i < SPE_RECFILE_COLS; i++) {
+		free(w->cols[i]);
+	}
+	free(w);
+
+	return (ret);
+}
+
+/*
+ * Start reading a file in memory, e.g. from mmap. The buffer should be
+ * aligned to SPE_RECFILE_ALIGN for the columns to be aligned. Returns
+ * false if this is not a record file this version can read.
+ */
+bool
+spe_recfile_open(struct spe_recfile *file, const void *buf, size_t len)
+{
+	struct spe_recfile_header hdr;
+
+	memset(file, 0, sizeof(*file));
+	if (len < sizeof(hdr)) {
+		return (false);
+	}
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (memcmp(hdr.magic, SPE_RECFILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != SPE_RECFILE_VERSION ||
+	    hdr.order != SPE_RECFILE_ORDER ||
+	    hdr.header_size != sizeof(hdr) ||
+	    hdr.block_header_size != sizeof(struct spe_recfile_block_header) ||
+	    hdr.columns != SPE_RECFILE_COLS) {
+		return (false);
+	}
+
+	file->buf = buf;
+	file->len = len;
+	file->off = sizeof(hdr);
+
+	return (true);
+}
+
+/*
+ * Return the next block of records. Returns false at the end of the file,
+ * or if the block is invalid in which case the error field is set.
+ */
+bool
+spe_recfile_next_block(struct spe_recfile *file,
+    struct spe_recfile_block *block)
+{
+	struct spe_recfile_block_header hdr;
+	const uint8_t *base;
+	const void *cols[SPE_RECFILE_COLS];
+	size_t avail;
+
+	if (file->error || file->off == file->len) {
+		return (false);
+	}
+
+	avail = file->len - file->off;
+	if (avail < sizeof(hdr)) {
+		file->error = true;
+		return (false);
+	}
+
+	base = (const uint8_t *)file->buf + file->off;
+	memcpy(&hdr, base, sizeof(hdr));
+	if (hdr.magic != SPE_RECFILE_BLOCK_MAGIC || hdr.size > avail ||
+	    hdr.size % SPE_RECFILE_ALIGN != 0 ||
+	    hdr.count > SPE_RECFILE_BLOCK_RECORDS) {
+		file->error = true;
+		return (false);
+	}
+
+	for (size_t i = 0; i < SPE_RECFILE_COLS; i++) {
+		if (hdr.offset[i] < sizeof(hdr) ||
+		    hdr.offset[i] % SPE_RECFILE_ALIGN != 0 ||
+		    hdr.offset[i] > hdr.size ||
+		    hdr.size - hdr.offset[i] <
+		    (uint64_t)hdr.count * spe_recfile_col_size[i]) {
+			file->error = true;
+			return (false);
+		}
+		cols[i] = base + hdr.offset[i];
+	}
+
+	block->count = hdr.count;
+	block->present = cols[SPE_RECFILE_COL_PRESENT];
+	for (size_t i = 0; i < SPE_RECORD_ADDR_MAX; i++) {
+		block->addr[i] = cols[SPE_RECFILE_COL_ADDR(i)];
+	}
+	for (size_t i = 0; i < SPE_RECORD_COUNTER_MAX; i++) {
+		block->counter[i] = cols[SPE_RECFILE_COL_COUNTER(i)];
+	}
+	block->events = cols[SPE_RECFILE_COL_EVENTS];
+	block->data_source = cols[SPE_RECFILE_COL_DATA_SOURCE];
+	block->op_class = cols[SPE_RECFILE_COL_OP_CLASS];
+	block->op_subclass = cols[SPE_RECFILE_COL_OP_SUBCLASS];
+	block->context = cols[SPE_RECFILE_COL_CONTEXT];
+	block->timestamp = cols[SPE_RECFILE_COL_TIMESTAMP];
+	block->source = cols[SPE_RECFILE_COL_SOURCE];
+
+	file->off += (size_t)hdr.size;
+
+	return (true);
+}
+
+/*
+ * Gather one record from a block.
+ */
+void
+spe_recfile_block_record(const struct spe_recfile_block *block, size_t idx,
+    struct spe_record *rec)
+{
+	assert(idx < block->count);
+
+	rec->present = block->present[idx];
+	for (size_t i = 0; i < SPE_RECORD_ADDR_MAX; i++) {
+		rec->addr[i] = block->addr[i][idx];
+	}
+	for (size_t i = 0; i < SPE_RECORD_COUNTER_MAX; i++) {
+		rec->counter[i] = block->counter[i][idx];
+	}
+	rec->events = block->events[idx];
+	rec->data_source = block->data_source[idx];
+	rec->op_class = block->op_class[idx];
+	rec->op_subclass = block->op_subclass[idx];
+	rec->context = block->context[idx];
+	rec->timestamp = block->timestamp[idx];
+	rec->source = block->source[idx];
+}
@@ -0,0 +1,327 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "spedecode.h"
+#include "spedecode_internal.h"
+
+/*
+ * Add a packet to the record. Returns true if this is the last packet in
+ * the record.
+ */
+static bool
+spe_record_add(struct spe_record *rec, const struct spe_packet *pkt)
+{
+	switch (pkt->info.type) {
+	case SPE_PKT_ADDRESS:
+		if (pkt->info.index < SPE_RECORD_ADDR_MAX) {
+			rec->addr[pkt->info.index] = pkt->data;
+			rec->present |= SPE_RECORD_ADDR(pkt->info.index);
+		}
+		break;
+	case SPE_PKT_COUNTER:
+		if (pkt->info.index < SPE_RECORD_COUNTER_MAX) {
+			rec->counter[pkt->info.index] = (uint16_t)pkt->data;
+			rec->present |= SPE_RECORD_COUNTER(pkt->info.index);
+		}
+		break;
+	case SPE_PKT_CONTEXT:
+		rec->context = (uint32_t)pkt->data;
+		rec->present |= SPE_RECORD_CONTEXT;
+		break;
+	case SPE_PKT_DATA_SOURCE:
+		rec->data_source = pkt->data;
+		rec->present |= SPE_RECORD_DATA_SOURCE;
+		break;
+	case SPE_PKT_EVENTS:
+		rec->events = pkt->data;
+		rec->present |= SPE_RECORD_EVENTS;
+		break;
+	case SPE_PKT_OPERATION_TYPE:
+		rec->op_class = SPE_OPERATION_TYPE_CLASS(pkt->header);
+		rec->op_subclass = (uint8_t)pkt->data;
+		rec->present |= SPE_RECORD_OPERATION_TYPE;
+		break;
+	case SPE_PKT_END:
+		rec->present |= SPE_RECORD_END;
+		return (true);
+	case SPE_PKT_TIMESTAMP:
+		/* This is the last packet in this record (if enabled) */
+		rec->timestamp = pkt->data;
+		rec->present |= SPE_RECORD_TIMESTAMP;
+		return (true);
+	default:
+		break;
+	}
+
+	return (false);
+}
+
+/*
+ * Check a packet could be part of the current record. Corrupt data shows
+ * up as unknown headers, a field seen twice, or a record that doesn't end.
+ */
+static bool
+spe_record_plausible(const struct spe_decode_ctx *ctx,
+    const struct spe_packet *pkt)
+{
+	uint32_t bit;
+
+	switch (pkt->info.type) {
+	case SPE_PKT_INVALID:
+	case SPE_PKT_UNKNOWN:
+		return (false);
+	case SPE_PKT_ADDRESS:
+		bit = pkt->info.index < SPE_RECORD_ADDR_MAX ?
+		    SPE_RECORD_ADDR(pkt->info.index) : 0;
+		break;
+	case SPE_PKT_COUNTER:
+		bit = pkt->info.index < SPE_RECORD_COUNTER_MAX ?
+		    SPE_RECORD_COUNTER(pkt->info.index) : 0;
+		break;
+	case SPE_PKT_CONTEXT:
+		bit = SPE_RECORD_CONTEXT;
+		break;
+	case SPE_PKT_DATA_SOURCE:
+		bit = SPE_RECORD_DATA_SOURCE;
+		break;
+	case SPE_PKT_EVENTS:
+		bit = SPE_RECORD_EVENTS;
+		break;
+	case SPE_PKT_OPERATION_TYPE:
+		bit = SPE_RECORD_OPERATION_TYPE;
+		break;
+	default:
+		bit = 0;
+		break;
+	}
+
+	if ((ctx->record.present & bit) != 0) {
+		return (false);
+	}
+	return (ctx->record_packets < SPE_RECORD_MAX_PACKETS);
+}
+
+/*
+ * Report the bytes skipped up to end and leave recovery.
+ */
+void
+spe_record_resync_end(struct spe_decode_ctx *ctx, uint64_t end)
+{
+	assert(ctx->resync);
+	assert(end >= ctx->resync_start);
+
+	ctx->resync = false;
+	SPE_STATS_ADD(ctx, skipped_bytes, end - ctx->resync_start);
+	SPE_LOG(ctx, 2, "Skipped %"PRIx64" - %"PRIx64, ctx->resync_start,
+	    end);
+	ctx->resync_cb(ctx, ctx->packet_cb_data, ctx->resync_start, end);
+}
+
+/*
+ * Drop the record holding a bad packet and start looking for the next
+ * record boundary from just after its start.
+ */
+static void
+spe_record_resync_start(struct spe_decode_ctx *ctx,
+    const struct spe_packet *pkt)
+{
+	ctx->resync_start = ctx->record.present != 0 ? ctx->record_pos :
+	    pkt->offset;
+	ctx->resync_scan = ctx->resync_start + 1;
+	ctx->resync = true;
+	memset(&ctx->record, 0, sizeof(ctx->record));
+	SPE_STATS_INC(ctx, resyncs);
+}
+
+/*
+ * Scan for the next record boundary from resync_scan. The segments are
+ * kept from there so the scan follows the stream across them, including
+ * a boundary where the packets around it are split between two segments.
+ * Returns false if more data is needed to find it.
+ */
+static bool
+spe_record_resync(struct spe_decode_ctx *ctx)
+{
+	const struct spe_segment *seg;
+	uint64_t pos, start;
+	size_t next, off;
+	bool more;
+
+	for (size_t i = 0; i < ctx->nsegs; i++) {
+		seg = &ctx->segs[i];
+		if (ctx->resync_scan >= seg->pos + seg->len) {
+			continue;
+		}
+
+		off = 0;
+		if (ctx->resync_scan > seg->pos) {
+			off = (size_t)(ctx->resync_scan - seg->pos);
+		}
+		while (true) {
+			next = spe_scan_record_next_partial(seg->data, seg->len,
+			    off, &more);
+			if (!more) {
+				break;
+			}
+
+			/* Check the boundary with the following segments */
+			switch (spe_scan_ctx_boundary(ctx, i, seg->pos + next,
+			    &start)) {
+			case SPE_SCAN_BOUNDARY:
+				goto found;
+			case SPE_SCAN_MORE:
+				ctx->resync_scan = seg->pos + next;
+				goto more;
+			case SPE_SCAN_NONE:
+				break;
+			}
+			off = next + 1;
+		}
+		if (next < seg->len) {
+			start = seg->pos + next;
+			goto found;
+		}
+		ctx->resync_scan = seg->pos + seg->len;
+	}
+
+more:
+	/* Let the segments before the scan be released */
+	pos = ctx->buf_pos + ctx->off;
+	if (ctx->resync_scan > pos) {
+		spe_decode_ctx_seek(ctx, ctx->resync_scan);
+	}
+	return (false);
+
+found:
+	spe_decode_ctx_seek(ctx, start);
+	spe_record_resync_end(ctx, start);
+	return (true);
+}
+
+void
+spe_decode_ctx_set_resync_cb(struct spe_decode_ctx *ctx, spe_resync_cb *cb)
+{
+	ctx->resync_cb = cb;
+}
+
+/*
+ * Decode the next complete record. Returns false when more data is needed,
+ * any packets already read are kept in the context so a record may be
+ * split across calls to spe_decode_ctx_add.
+ */
+bool
+spe_record_decode_next(struct spe_decode_ctx *ctx, struct spe_record *rec)
+{
+	struct spe_packet pkt;
+
+	while (true) {
+		if (ctx->resync && !spe_record_resync(ctx)) {
+			return (false);
+		}
+		if (!spe_packet_next(ctx, true, &pkt)) {
+			return (false);
+		}
+
+		if (ctx->record.present == 0) {
+			ctx->record_pos = pkt.offset;
+			ctx->record_packets = 0;
+#if defined(SPE_STATS)
+			ctx->record_stats = ctx->stats;
+			ctx->record_stats.packets[pkt.info.type]--;
+#endif
+		}
+		if (ctx->resync_cb != NULL) {
+			if (!spe_record_plausible(ctx, &pkt)) {
+				spe_record_resync_start(ctx, &pkt);
+				continue;
+			}
+			ctx->record_packets++;
+		}
+		if (spe_record_add(&ctx->record, &pkt)) {
+			*rec = ctx->record;
+			memset(&ctx->record, 0, sizeof(ctx->record));
+			SPE_STATS_INC(ctx, records);
+			return (true);
+		}
+	}
+}
+
+/*
+ * Decode up to max records. Returns the number of records decoded.
+ */
+size_t
+spe_record_decode_batch(struct spe_decode_ctx *ctx, struct spe_record *recs,
+    size_t max)
+{
+	size_t count;
+
+	for (count = 0; count < max; count++) {
+		if (!spe_record_decode_next(ctx, &recs[count])) {
+			break;
+		}
+	}
+
+	return (count);
+}
+
+/*
+ * Return the records left at the end of the data. When recovering from
+ * corrupt data a record boundary near the end may only be found once it's
+ * known no more data will be added, these records are returned first then
+ * any partial record, e.g. when the last record has no end or timestamp
+ * packet. Call until it returns false.
+ */
+bool
+spe_record_decode_flush(struct spe_decode_ctx *ctx, struct spe_record *rec)
+{
+	ctx->final = true;
+	if (spe_record_decode_next(ctx, rec)) {
+		return (true);
+	}
+
+	/* The data ended while looking for a record boundary */
+	if (ctx->resync) {
+		spe_record_resync_end(ctx, ctx->end_pos);
+	}
+
+	if (ctx->record.present == 0) {
+		return (false);
+	}
+
+	*rec = ctx->record;
+	memset(&ctx->record, 0, sizeof(ctx->record));
+	SPE_STATS_INC(ctx, records);
+
+	return (true);
+}
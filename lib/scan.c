@@ -0,0 +1,468 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#include <immintrin.h>
+#define	SPE_SCAN_SSE2
+#if defined(__AVX2__)
+#define	SPE_SCAN_AVX2
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define	SPE_SCAN_NEON
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "spedecode.h"
+#include "spedecode_internal.h"
+
+#define	SPE_SCAN_END			0x01
+#define	SPE_SCAN_TIMESTAMP		0x71
+#define	SPE_SCAN_TIMESTAMP_LEN		9
+
+#if defined(SPE_SCAN_SSE2) || defined(SPE_SCAN_NEON)
+static inline unsigned int
+spe_ctz64(uint64_t val)
+{
+	assert(val != 0);
+#if defined(_MSC_VER)
+	unsigned long idx;
+
+	_BitScanForward64(&idx, val);
+	return ((unsigned int)idx);
+#else
+	return ((unsigned int)__builtin_ctzll(val));
+#endif
+}
+#endif
+
+/*
+ * Find the next end or timestamp header byte at or after off. Returns len
+ * if there are none. Either byte could also be part of a packet payload so
+ * these are only possible record boundaries.
+ */
+size_t
+spe_scan_find(const uint8_t *buf, size_t off, size_t len)
+{
+#if defined(SPE_SCAN_AVX2)
+	const __m256i end32 = _mm256_set1_epi8(SPE_SCAN_END);
+	const __m256i ts32 = _mm256_set1_epi8(SPE_SCAN_TIMESTAMP);
+
+	for (; off + 32 <= len; off += 32) {
+		__m256i val, match;
+		uint32_t mask;
+
+		val = _mm256_loadu_si256((const __m256i *)(buf + off));
+		match = _mm256_or_si256(_mm256_cmpeq_epi8(val, end32),
+		    _mm256_cmpeq_epi8(val, ts32));
+		mask = (uint32_t)_mm256_movemask_epi8(match);
+		if (mask != 0) {
+			return (off + spe_ctz64(mask));
+		}
+	}
+#endif
+#if defined(SPE_SCAN_SSE2)
+	const __m128i end16 = _mm_set1_epi8(SPE_SCAN_END);
+	const __m128i ts16 = _mm_set1_epi8(SPE_SCAN_TIMESTAMP);
+
+	for (; off + 16 <= len; off += 16) {
+		__m128i val, match;
+		uint32_t mask;
+
+		val = _mm_loadu_si128((const __m128i *)(buf + off));
+		match = _mm_or_si128(_mm_cmpeq_epi8(val, end16),
+		    _mm_cmpeq_epi8(val, ts16));
+		mask = (uint32_t)_mm_movemask_epi8(match);
+		if (mask != 0) {
+			return (off + spe_ctz64(mask));
+		}
+	}
+#elif defined(SPE_SCAN_NEON)
+	const uint8x16_t end16 = vdupq_n_u8(SPE_SCAN_END);
+	const uint8x16_t ts16 = vdupq_n_u8(SPE_SCAN_TIMESTAMP);
+
+	for (; off + 16 <= len; off += 16) {
+		uint8x16_t val, match;
+		uint64_t mask;
+
+		val = vld1q_u8(buf + off);
+		match = vorrq_u8(vceqq_u8(val, end16), vceqq_u8(val, ts16));
+		/* Narrow to 4 bits per byte to get a mask in a register */
+		mask = vget_lane_u64(vreinterpret_u64_u8(
+		    vshrn_n_u16(vreinterpretq_u16_u8(match), 4)), 0);
+		if (mask != 0) {
+			return (off + spe_ctz64(mask) / 4);
+		}
+	}
+#endif
+
+	for (; off < len; off++) {
+		if (buf[off] == SPE_SCAN_END ||
+		    buf[off] == SPE_SCAN_TIMESTAMP) {
+			return (off);
+		}
+	}
+
+	return (len);
+}
+
+/*
+ * Skip a run of padding bytes. Returns the offset of the first non-zero
+ * byte at or after off, or len if there are none.
+ */
+size_t
+spe_scan_skip_padding(const uint8_t *buf, size_t off, size_t len)
+{
+#if defined(SPE_SCAN_SSE2)
+	const __m128i zero16 = _mm_setzero_si128();
+
+	for (; off + 16 <= len; off += 16) {
+		__m128i val;
+		uint32_t mask;
+
+		val = _mm_loadu_si128((const __m128i *)(buf + off));
+		mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(val, zero16));
+		if (mask != 0xffff) {
+			return (off + spe_ctz64(~mask & 0xffff));
+		}
+	}
+#elif defined(SPE_SCAN_NEON)
+	for (; off + 16 <= len; off += 16) {
+		uint64_t mask;
+
+		mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(
+		    vreinterpretq_u16_u8(vtstq_u8(vld1q_u8(buf + off),
+		    vdupq_n_u8(0xff))), 4)), 0);
+		if (mask != 0) {
+			return (off + spe_ctz64(mask) / 4);
+		}
+	}
+#endif
+
+	for (; off < len; off++) {
+		if (buf[off] != 0) {
+			return (off);
+		}
+	}
+
+	return (len);
+}
+
+/*
+ * Check the packets from off look like a valid record. Each must have a
+ * known header and the record must finish with an end or timestamp packet
+ * within SPE_RECORD_MAX_PACKETS packets. Running out of data counts as valid
+ * as there is nothing to say otherwise. On success *nextp is set to the
+ * offset of the terminating packet.
+ */
+static bool
+spe_scan_validate(const uint8_t *buf, size_t off, size_t len, size_t *nextp)
+{
+	const struct spe_header_info *info;
+	uint16_t header;
+	int header_len;
+
+	for (int i = 0; i < SPE_RECORD_MAX_PACKETS; i++) {
+		while (off < len && buf[off] == 0) {
+			off++;
+		}
+		if (off == len) {
+			break;
+		}
+
+		header = buf[off];
+		header_len = 1;
+		if (header >= 0x20 && header < 0x40) {
+			if (off + 1 == len) {
+				/* Ran out of data in the header */
+				off = len;
+				break;
+			}
+			header = (uint16_t)(header << 8) | buf[off + 1];
+			header_len = 2;
+		}
+
+		info = spe_header_lookup(header, header_len);
+		switch (info->type) {
+		case SPE_PKT_END:
+		case SPE_PKT_TIMESTAMP:
+			*nextp = off;
+			return (true);
+		case SPE_PKT_UNKNOWN:
+			return (false);
+		default:
+			break;
+		}
+
+		off += header_len + info->data_len;
+		if (off >= len) {
+			break;
+		}
+	}
+
+	if (off < len) {
+		/* Too many packets for a single record */
+		return (false);
+	}
+
+	*nextp = len;
+	return (true);
+}
+
+/*
+ * Returns the length of the packet starting with a possible terminating
+ * header byte at off.
+ */
+static size_t
+spe_scan_term_len(const uint8_t *buf, size_t off)
+{
+	return (buf[off] == SPE_SCAN_TIMESTAMP ? SPE_SCAN_TIMESTAMP_LEN : 1);
+}
+
+/*
+ * Find the first record boundary after off. If morep is set the data may
+ * continue after len so a possible boundary that can't be checked without
+ * it stops the scan, *morep is set and the offset of its end or timestamp
+ * header is returned.
+ */
+static inline size_t
+spe_scan_next(const uint8_t *buf, size_t len, size_t off, bool *morep)
+{
+	size_t next, start;
+
+	while (off < len) {
+		off = spe_scan_find(buf, off, len);
+		if (off == len) {
+			break;
+		}
+
+		start = off + spe_scan_term_len(buf, off);
+		if (start > len) {
+			if (morep != NULL) {
+				*morep = true;
+				return (off);
+			}
+		} else if (spe_scan_validate(buf, start, len, &next)) {
+			if (next < len || morep == NULL) {
+				return (start);
+			}
+			*morep = true;
+			return (off);
+		}
+		off++;
+	}
+
+	return (len);
+}
+
+/*
+ * Find the start of the first record after off, i.e. the offset just after
+ * the end or timestamp packet of the previous record. Returns len if no
+ * record boundary is found.
+ */
+size_t
+spe_scan_record_next(const void *data, size_t len, size_t off)
+{
+	return (spe_scan_next(data, len, off, NULL));
+}
+
+/*
+ * As spe_scan_record_next for a buffer the stream continues after. If a
+ * possible boundary needs the following data to check *morep is set and
+ * the offset of its end or timestamp header is returned, it can then be
+ * checked with spe_scan_ctx_boundary.
+ */
+size_t
+spe_scan_record_next_partial(const void *data, size_t len, size_t off,
+    bool *morep)
+{
+	*morep = false;
+	return (spe_scan_next(data, len, off, morep));
+}
+
+/* Reads the segments of a context by stream offset */
+struct spe_scan_cursor {
+	const struct spe_decode_ctx *ctx;
+	size_t seg;
+};
+
+/*
+ * Read the byte at pos, which must not be before the previous read.
+ * Returns false if it hasn't been added yet.
+ */
+static inline bool
+spe_scan_byte(struct spe_scan_cursor *cur, uint64_t pos, uint8_t *bytep)
+{
+	const struct spe_segment *seg;
+
+	for (; cur->seg < cur->ctx->nsegs; cur->seg++) {
+		seg = &cur->ctx->segs[cur->seg];
+		if (pos < seg->pos + seg->len) {
+			assert(pos >= seg->pos);
+			*bytep = ((const uint8_t *)seg->data)[pos - seg->pos];
+			return (true);
+		}
+	}
+
+	return (false);
+}
+
+/*
+ * Check the possible record boundary after the end or timestamp header at
+ * stream offset term in segment seg of a context, reading across the
+ * following segments the same way spe_scan_validate reads a buffer. The
+ * start of the following record is stored in *startp. Returns
+ * SPE_SCAN_MORE if this needs data that hasn't been added, unless the
+ * context is final when the end of the data is handled as
+ * spe_scan_record_next does.
+ */
+enum spe_scan_result
+spe_scan_ctx_boundary(const struct spe_decode_ctx *ctx, size_t seg,
+    uint64_t term, uint64_t *startp)
+{
+	const struct spe_header_info *info;
+	struct spe_scan_cursor cur;
+	uint64_t pos;
+	uint16_t header;
+	uint8_t byte;
+	int header_len;
+
+	cur.ctx = ctx;
+	cur.seg = seg;
+	if (!spe_scan_byte(&cur, term, &byte)) {
+		/* The header should be in the context */
+		return (SPE_SCAN_NONE);
+	}
+	pos = term + (byte == SPE_SCAN_TIMESTAMP ? SPE_SCAN_TIMESTAMP_LEN : 1);
+	*startp = pos;
+	if (pos > ctx->end_pos) {
+		return (ctx->final ? SPE_SCAN_NONE : SPE_SCAN_MORE);
+	}
+
+	for (int i = 0; i < SPE_RECORD_MAX_PACKETS; i++) {
+		while (spe_scan_byte(&cur, pos, &byte) && byte == 0) {
+			pos++;
+		}
+		if (pos == ctx->end_pos) {
+			goto out;
+		}
+
+		header = byte;
+		header_len = 1;
+		if (header >= 0x20 && header < 0x40) {
+			if (!spe_scan_byte(&cur, pos + 1, &byte)) {
+				goto out;
+			}
+			header = (uint16_t)(header << 8) | byte;
+			header_len = 2;
+		}
+
+		info = spe_header_lookup(header, header_len);
+		switch (info->type) {
+		case SPE_PKT_END:
+		case SPE_PKT_TIMESTAMP:
+			return (SPE_SCAN_BOUNDARY);
+		case SPE_PKT_UNKNOWN:
+			return (SPE_SCAN_NONE);
+		default:
+			break;
+		}
+
+		pos += (uint64_t)header_len + info->data_len;
+		if (pos >= ctx->end_pos) {
+			goto out;
+		}
+	}
+
+	/* Too many packets for a single record */
+	return (SPE_SCAN_NONE);
+
+out:
+	/* Ran out of data */
+	return (ctx->final ? SPE_SCAN_BOUNDARY : SPE_SCAN_MORE);
+}
+
+/*
+ * Find up to max record start offsets after off, which must be the start
+ * of a record, e.g. from spe_scan_record_next or the last offset from a
+ * previous call. Returns the number of offsets found.
+ *
+ * Once a record boundary is known the following boundaries are found by
+ * following the header length rules the same way the decoder does. This
+ * doesn't need to check for unknown packets as it can't lose sync.
+ */
+size_t
+spe_scan_records(const void *data, size_t len, size_t off, size_t *offsets,
+    size_t max)
+{
+	const uint8_t *buf;
+	size_t count;
+	uint16_t header;
+	int header_len;
+
+	buf = data;
+	count = 0;
+	while (count < max) {
+		if (off < len && buf[off] == 0) {
+			off = spe_scan_skip_padding(buf, off, len);
+		}
+		if (off == len) {
+			break;
+		}
+
+		header = buf[off];
+		header_len = 1;
+		if (header >= 0x20 && header < 0x40) {
+			if (off + 1 == len) {
+				break;
+			}
+			header = (uint16_t)(header << 8) | buf[off + 1];
+			header_len = 2;
+		}
+
+		off += header_len + spe_header_lookup(header,
+		    header_len)->data_len;
+		if (off >= len) {
+			break;
+		}
+
+		if (header == SPE_SCAN_END || header == SPE_SCAN_TIMESTAMP) {
+			offsets[count++] = off;
+		}
+	}
+
+	return (count);
+}
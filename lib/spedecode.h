@@ -36,10 +36,90 @@ struct spe_decode_ctx *spe_decode_ctx_alloc(void);
 void spe_decode_ctx_free(struct spe_decode_ctx *);
 void spe_decode_ctx_set_log_level(struct spe_decode_ctx *, int);
 
+/*
+ * A context can be placed in caller owned storage of SPE_DECODE_CTX_SIZE
+ * bytes aligned to SPE_DECODE_CTX_ALIGN with spe_decode_ctx_init, and is
+ * cleaned up with spe_decode_ctx_fini. The internal buffers are allocated
+ * with the allocator, or malloc if it is NULL. Each function is passed the
+ * allocator data as its first argument. It is only called from the thread
+ * using the context, spe_decode_parallel uses malloc for its chunk contexts.
+ */
+#define	SPE_DECODE_CTX_SIZE	1024
+#define	SPE_DECODE_CTX_ALIGN	16
+
+struct spe_allocator {
+	void *(*alloc_cb)(void *, size_t);
+	void *(*realloc_cb)(void *, void *, size_t);
+	void (*free_cb)(void *, void *);
+	void *data;
+};
+
+struct spe_decode_ctx *spe_decode_ctx_init(void *, size_t,
+    const struct spe_allocator *);
+void spe_decode_ctx_fini(struct spe_decode_ctx *);
+void spe_decode_ctx_reset(struct spe_decode_ctx *);
+
+/*
+ * Log messages are only built in up to the SPE_LOG_LEVEL the library was
+ * built with, this is returned by spe_log_level_max. By default they are
+ * printed to stderr, a callback can be set to handle them instead, e.g.
+ * spe_log_ring_cb to keep them in memory.
+ */
+#define	SPE_LOG_MSG_SIZE	128
+int spe_log_level_max(void);
+typedef void (spe_log_cb)(struct spe_decode_ctx *, void *, int, const char *);
+void spe_decode_ctx_set_log_cb(struct spe_decode_ctx *, spe_log_cb *, void *);
+
+struct spe_log_entry {
+	int level;
+	char msg[SPE_LOG_MSG_SIZE];
+};
+
+struct spe_log_ring;
+
+struct spe_log_ring *spe_log_ring_alloc(size_t);
+void spe_log_ring_free(struct spe_log_ring *);
+void spe_log_ring_cb(struct spe_decode_ctx *, void *, int, const char *);
+bool spe_log_ring_read(struct spe_log_ring *, struct spe_log_entry *);
+uint64_t spe_log_ring_dropped(struct spe_log_ring *);
+
 #define	SPE_FLAG_MUST_COPY	0x01	/* We must copy the data before using */
 bool spe_decode_ctx_add(struct spe_decode_ctx *, uint32_t, void *, size_t);
 bool spe_decode_ctx_release(struct spe_decode_ctx *, void *);
 
+typedef void (spe_release_cb)(struct spe_decode_ctx *, void *, void *, size_t);
+void spe_decode_ctx_set_release_cb(struct spe_decode_ctx *, spe_release_cb *,
+    void *);
+
+/*
+ * Read data on a separate thread and add it to a context in fixed size
+ * blocks, reading up to depth blocks ahead. Data compressed with gzip,
+ * zstd, or lz4 is decompressed when the library was built with support
+ * for it. The read callback reads up to len bytes into buf, setting *lenp
+ * to the number read or 0 at the end of the data, and returns false on
+ * error. spe_reader_alloc_fd reads from a file descriptor, using io_uring
+ * to keep depth reads in flight when it's available. Blocks must be at
+ * least SPE_READER_BLOCK_MIN bytes.
+ */
+typedef enum {
+	SPE_COMPRESS_NONE,
+	SPE_COMPRESS_GZIP,
+	SPE_COMPRESS_ZSTD,
+	SPE_COMPRESS_LZ4,
+} spe_compress_type;
+
+spe_compress_type spe_compress_detect(const void *, size_t);
+
+#define	SPE_READER_BLOCK_MIN	4096
+
+typedef bool (spe_read_cb)(void *, void *, size_t, size_t *);
+struct spe_reader;
+struct spe_reader *spe_reader_alloc(spe_read_cb *, void *, size_t, size_t);
+struct spe_reader *spe_reader_alloc_fd(int, size_t, size_t);
+bool spe_reader_add(struct spe_reader *, struct spe_decode_ctx *);
+const char *spe_reader_error(const struct spe_reader *);
+bool spe_reader_free(struct spe_reader *, struct spe_decode_ctx *);
+
 #define	SPE_HEADER_SKIP_PADDING	0x01
 bool spe_packet_peek_header(struct spe_decode_ctx *, uint16_t *, int *);
 bool spe_packet_get_header(struct spe_decode_ctx *, int, uint16_t *, int *);
@@ -72,6 +152,46 @@ bool spe_packet_decode_set_callback(struct spe_decode_ctx *, spe_packet_type,
 #define	SPE_PACKET_DECODE_SKIP_PADDING	0x01
 bool spe_packet_decode_next(struct spe_decode_ctx *, int flags);
 
+/*
+ * Structure of arrays filled by spe_packet_decode_batch. Each array must
+ * have space for at least the number of packets requested. The offset is
+ * the position of the packet header counted from the first byte added to
+ * the context.
+ */
+struct spe_packet_batch {
+	uint8_t *type;		/* spe_packet_type */
+	uint16_t *header;
+	uint64_t *data;
+	uint64_t *offset;
+};
+
+size_t spe_packet_decode_batch(struct spe_decode_ctx *, int flags,
+    struct spe_packet_batch *, size_t);
+
+/*
+ * Counters kept by the context when the library is built with SPE_STATS.
+ * Packets are counted when their header is read, padding skipped by the
+ * decoder is only counted in padding_bytes.
+ */
+struct spe_decode_stats {
+	uint64_t packets[SPE_PKT_MAX];	/* By spe_packet_type */
+	uint64_t padding_bytes;		/* Padding skipped between packets */
+	uint64_t records;		/* Records from spe_record_decode_* */
+	uint64_t bytes_added;		/* Passed to spe_decode_ctx_add */
+	uint64_t bytes_decoded;		/* Bytes before the current offset */
+	uint64_t copies;		/* Buffers copied by the context */
+	uint64_t copy_bytes;
+	uint64_t stitches;		/* Packets spanning two buffers */
+	uint64_t stitch_bytes;
+	uint64_t resyncs;		/* Corrupt records skipped */
+	uint64_t skipped_bytes;
+};
+
+bool spe_decode_ctx_get_stats(struct spe_decode_ctx *,
+    struct spe_decode_stats *);
+void spe_decode_stats_merge(struct spe_decode_stats *,
+    const struct spe_decode_stats *);
+
 static inline uint16_t
 SPE_ADDRESS_INDEX(uint16_t header)
 {
@@ -109,7 +229,206 @@ SPE_COUNTER_INDEX(uint16_t header)
 	return (((header & 0x0300) >> 5) | (header & 0x0007));
 }
 
+/* Bits in the events packet */
+#define	SPE_EVENT_EXCEPTION		0
+#define	SPE_EVENT_RETIRED		1
+#define	SPE_EVENT_L1D_ACCESS		2
+#define	SPE_EVENT_L1D_REFILL		3
+#define	SPE_EVENT_TLB_ACCESS		4
+#define	SPE_EVENT_TLB_WALK		5
+#define	SPE_EVENT_NOT_TAKEN		6
+#define	SPE_EVENT_MISPREDICTED		7
+#define	SPE_EVENT_LLC_ACCESS		8
+#define	SPE_EVENT_LLC_MISS		9
+#define	SPE_EVENT_REMOTE_ACCESS		10
+#define	SPE_EVENT_ALIGNMENT		11
+#define	SPE_EVENT_TRANSACTIONAL		16
+#define	SPE_EVENT_PARTIAL_PRED		17
+#define	SPE_EVENT_EMPTY_PRED		18
+#define	SPE_EVENTS(e, bit)		(((e) >> (bit)) & 0x1)
+
+#define	SPE_COUNTER_IDX_TOTAL_LAT	0x00
+#define	SPE_COUNTER_IDX_ISSUE_LAT	0x01
+#define	SPE_COUNTER_IDX_TRANS_LAT	0x02
+
 #define	SPE_OPERATION_TYPE_CLASS(h)	(uint16_t)((h) & 0x3)
 #define	SPE_OPERATION_TYPE_OTHER	0x0
 #define	SPE_OPERATION_TYPE_LOAD_STORE	0x1
 #define	SPE_OPERATION_TYPE_BRANCH	0x2
+
+/*
+ * A complete sample record. A record ends with an end or timestamp packet.
+ * Only fields with their bit set in present are valid, all others are
+ * zero. The fields most analysis uses are in the first 64 bytes. The
+ * source isn't from the data, it's set by the caller to tell records from
+ * different buffers apart, e.g. with the CPU they were recorded on.
+ */
+#define	SPE_RECORD_ADDR_MAX		5
+#define	SPE_RECORD_COUNTER_MAX		3
+struct spe_record {
+	uint32_t present;
+#define	SPE_RECORD_ADDR(idx)		(0x1u << (idx))
+#define	SPE_RECORD_COUNTER(idx)		(0x100u << (idx))
+#define	SPE_RECORD_EVENTS		0x10000u
+#define	SPE_RECORD_DATA_SOURCE		0x20000u
+#define	SPE_RECORD_OPERATION_TYPE	0x40000u
+#define	SPE_RECORD_CONTEXT		0x80000u
+#define	SPE_RECORD_TIMESTAMP		0x100000u
+#define	SPE_RECORD_END			0x200000u
+#define	SPE_RECORD_SOURCE		0x400000u
+	uint8_t op_class;	/* SPE_OPERATION_TYPE_CLASS of the header */
+	uint8_t op_subclass;
+	uint16_t counter[SPE_RECORD_COUNTER_MAX];	/* SPE_COUNTER_IDX_* */
+	uint32_t context;
+	uint64_t addr[SPE_RECORD_ADDR_MAX];	/* SPE_ADDRESS_IDX_* */
+	uint64_t events;
+	uint64_t data_source;
+	uint64_t timestamp;
+	uint32_t source;
+};
+
+bool spe_record_decode_next(struct spe_decode_ctx *, struct spe_record *);
+size_t spe_record_decode_batch(struct spe_decode_ctx *, struct spe_record *,
+    size_t);
+bool spe_record_decode_flush(struct spe_decode_ctx *, struct spe_record *);
+
+/*
+ * Recovery from corrupt data when decoding records. When a callback is set
+ * records that can't be valid are dropped and the decoder skips to the
+ * next record boundary. The callback is passed the data set with
+ * spe_packet_decode_set_callback_data and the stream offsets of the start
+ * and end of each range of bytes skipped.
+ */
+typedef void (spe_resync_cb)(struct spe_decode_ctx *, void *, uint64_t,
+    uint64_t);
+void spe_decode_ctx_set_resync_cb(struct spe_decode_ctx *, spe_resync_cb *);
+
+/*
+ * Filter records with an expression over their fields, see filter.c for
+ * the syntax.
+ */
+struct spe_filter;
+
+struct spe_filter *spe_filter_compile(const char *, char *, size_t);
+void spe_filter_free(struct spe_filter *);
+bool spe_filter_match(const struct spe_filter *, const struct spe_record *);
+
+/*
+ * Find record boundaries in a buffer without decoding it. These return the
+ * offset of the first packet in a record, just after the end or timestamp
+ * packet of the previous record.
+ */
+size_t spe_scan_record_next(const void *, size_t, size_t);
+size_t spe_scan_records(const void *, size_t, size_t, size_t *, size_t);
+
+/*
+ * A columnar file of records, see recfile.c for the layout. The writer
+ * passes the file to the callback in order, this returns false on error.
+ * The reader works on the file in memory and returns the columns of each
+ * block, these are arrays of count values.
+ */
+#define	SPE_RECFILE_COL_PRESENT		0
+#define	SPE_RECFILE_COL_ADDR(idx)	(1 + (idx))
+#define	SPE_RECFILE_COL_COUNTER(idx)	(6 + (idx))
+#define	SPE_RECFILE_COL_EVENTS		9
+#define	SPE_RECFILE_COL_DATA_SOURCE	10
+#define	SPE_RECFILE_COL_OP_CLASS	11
+#define	SPE_RECFILE_COL_OP_SUBCLASS	12
+#define	SPE_RECFILE_COL_CONTEXT		13
+#define	SPE_RECFILE_COL_TIMESTAMP	14
+#define	SPE_RECFILE_COL_SOURCE		15
+#define	SPE_RECFILE_COLS		16
+#define	SPE_RECFILE_BLOCK_RECORDS	65536
+
+struct spe_recfile_writer;
+typedef bool (spe_recfile_write_cb)(void *, const void *, size_t);
+
+struct spe_recfile_writer *spe_recfile_writer_alloc(spe_recfile_write_cb *,
+    void *);
+bool spe_recfile_write(struct spe_recfile_writer *, const struct spe_record *);
+bool spe_recfile_writer_free(struct spe_recfile_writer *);
+
+struct spe_recfile {
+	const void *buf;
+	size_t len;
+	size_t off;
+	bool error;
+};
+
+struct spe_recfile_block {
+	size_t count;
+	const uint32_t *present;	/* SPE_RECORD_* bits */
+	const uint64_t *addr[SPE_RECORD_ADDR_MAX];
+	const uint16_t *counter[SPE_RECORD_COUNTER_MAX];
+	const uint64_t *events;
+	const uint64_t *data_source;
+	const uint8_t *op_class;
+	const uint8_t *op_subclass;
+	const uint32_t *context;
+	const uint64_t *timestamp;
+	const uint32_t *source;
+};
+
+bool spe_recfile_open(struct spe_recfile *, const void *, size_t);
+bool spe_recfile_next_block(struct spe_recfile *, struct spe_recfile_block *);
+void spe_recfile_block_record(const struct spe_recfile_block *, size_t,
+    struct spe_record *);
+
+/*
+ * Read the AUX data recorded by perf record -e arm_spe// from a perf.data
+ * file in memory. The cpu is UINT32_MAX when perf was tracing a task
+ * rather than the CPUs.
+ */
+struct spe_perf {
+	const void *buf;
+	size_t off;
+	size_t end;
+	uint64_t truncated;	/* AUX records marked as truncated */
+	bool error;
+};
+
+struct spe_perf_aux_data {
+	const void *data;
+	size_t size;
+	uint64_t offset;	/* Offset in the AUX buffer */
+	uint32_t idx;		/* The AUX buffer */
+	uint32_t tid;
+	uint32_t cpu;
+};
+
+bool spe_perf_open(struct spe_perf *, const void *, size_t);
+bool spe_perf_next_aux(struct spe_perf *, struct spe_perf_aux_data *);
+
+/*
+ * Decode the data in a context using multiple threads. See
+ * spe_decode_parallel for how the operations are used.
+ */
+struct spe_parallel_ops {
+	void *(*chunk_start)(struct spe_decode_ctx *, void *, size_t);
+	void (*chunk_done)(void *, size_t, void *);
+	void (*chunk_discard)(void *, size_t, void *);
+	bool (*decode_next)(struct spe_decode_ctx *, void *);
+};
+
+bool spe_decode_parallel(struct spe_decode_ctx *, int, unsigned int,
+    const struct spe_parallel_ops *, void *);
+
+/*
+ * Log-linear histograms, e.g. for latency counters. These are a fixed size
+ * so can be allocated up front and merged across threads.
+ */
+#define	SPE_HIST_SUB_BITS	5
+#define	SPE_HIST_BUCKETS	((64 - SPE_HIST_SUB_BITS + 2) << \
+				    (SPE_HIST_SUB_BITS - 1))
+struct spe_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[SPE_HIST_BUCKETS];
+};
+
+void spe_hist_init(struct spe_hist *);
+void spe_hist_add(struct spe_hist *, uint64_t);
+void spe_hist_merge(struct spe_hist *, const struct spe_hist *);
+uint64_t spe_hist_percentile(const struct spe_hist *, double);
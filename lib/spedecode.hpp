@@ -0,0 +1,432 @@
+/*-
+ * Copyright (c) 2022 The FreeBSD Foundation
+ *
+ * This software was developed by Andrew Turner under sponsorship from
+ * the FreeBSD Foundation.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SPEDECODE_HPP_
+#define	_SPEDECODE_HPP_
+
+/*
+ * A C++17 wrapper around the decode context. The packets are read in
+ * batches with spe_packet_decode_batch so the code handling them is in the
+ * caller and can be inlined, rather than called through spe_packet_cb
+ * pointers. spedecode.h is included here, don't include it separately.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include <spedecode.h>
+}
+
+namespace spe {
+
+/* A packet, the type is known from the packet class. */
+template <spe_packet_type Type>
+struct packet {
+	static constexpr spe_packet_type type = Type;
+	uint16_t header;
+	uint64_t data;
+	uint64_t offset;	/* Stream offset of the header */
+};
+
+using invalid_packet = packet<SPE_PKT_INVALID>;
+using unknown_packet = packet<SPE_PKT_UNKNOWN>;
+using address_packet = packet<SPE_PKT_ADDRESS>;
+using context_packet = packet<SPE_PKT_CONTEXT>;
+using counter_packet = packet<SPE_PKT_COUNTER>;
+using data_source_packet = packet<SPE_PKT_DATA_SOURCE>;
+using end_packet = packet<SPE_PKT_END>;
+using events_packet = packet<SPE_PKT_EVENTS>;
+using operation_type_packet = packet<SPE_PKT_OPERATION_TYPE>;
+using padding_packet = packet<SPE_PKT_PADDING>;
+using timestamp_packet = packet<SPE_PKT_TIMESTAMP>;
+
+/* A packet of any type, as returned by the packet iterator. */
+struct any_packet {
+	spe_packet_type type;
+	uint16_t header;
+	uint64_t data;
+	uint64_t offset;
+};
+
+namespace detail {
+
+/* Packets are decoded this many at a time */
+constexpr size_t batch_size = 256;
+
+struct packet_batch {
+	uint8_t type[batch_size];
+	uint16_t header[batch_size];
+	uint64_t data[batch_size];
+	uint64_t offset[batch_size];
+	size_t count = 0;
+
+	size_t
+	fill(spe_decode_ctx *ctx, int flags)
+	{
+		spe_packet_batch batch = { type, header, data, offset };
+
+		count = spe_packet_decode_batch(ctx, flags, &batch,
+		    batch_size);
+		return (count);
+	}
+};
+
+/* Call the visitor if it handles this packet type, otherwise skip it */
+template <spe_packet_type Type, class Visitor>
+inline void
+visit(Visitor &visitor, const packet_batch &batch, size_t i)
+{
+	if constexpr (std::is_invocable_v<Visitor &, const packet<Type> &>) {
+		visitor(packet<Type>{ batch.header[i], batch.data[i],
+		    batch.offset[i] });
+	}
+}
+
+} /* namespace detail */
+
+struct end_iterator {};
+
+/*
+ * Iterates over the packets in a decoder, see decoder::packets. This holds
+ * a batch of packets so isn't copied, C++17 range-for doesn't need to.
+ */
+class packet_iterator {
+public:
+	packet_iterator(spe_decode_ctx *ctx, int flags)
+	    : ctx_(ctx), flags_(flags)
+	{
+		batch_.fill(ctx_, flags_);
+	}
+	packet_iterator(const packet_iterator &) = delete;
+	packet_iterator &operator=(const packet_iterator &) = delete;
+
+	any_packet
+	operator*() const
+	{
+		return (any_packet{
+		    static_cast<spe_packet_type>(batch_.type[idx_]),
+		    batch_.header[idx_], batch_.data[idx_],
+		    batch_.offset[idx_] });
+	}
+
+	packet_iterator &
+	operator++()
+	{
+		if (++idx_ == batch_.count) {
+			idx_ = 0;
+			batch_.fill(ctx_, flags_);
+		}
+		return (*this);
+	}
+
+	bool
+	operator!=(end_iterator) const
+	{
+		return (idx_ < batch_.count);
+	}
+
+private:
+	spe_decode_ctx *ctx_;
+	int flags_;
+	detail::packet_batch batch_;
+	size_t idx_ = 0;
+};
+
+class packet_range {
+public:
+	packet_range(spe_decode_ctx *ctx, int flags)
+	    : ctx_(ctx), flags_(flags)
+	{
+	}
+
+	packet_iterator
+	begin() const
+	{
+		return (packet_iterator(ctx_, flags_));
+	}
+
+	end_iterator
+	end() const
+	{
+		return (end_iterator{});
+	}
+
+private:
+	spe_decode_ctx *ctx_;
+	int flags_;
+};
+
+/* Iterates over the records in a decoder, see decoder::records */
+class record_iterator {
+public:
+	explicit record_iterator(spe_decode_ctx *ctx)
+	    : ctx_(ctx)
+	{
+		valid_ = spe_record_decode_next(ctx_, &rec_);
+	}
+
+	const spe_record &
+	operator*() const
+	{
+		return (rec_);
+	}
+
+	const spe_record *
+	operator->() const
+	{
+		return (&rec_);
+	}
+
+	record_iterator &
+	operator++()
+	{
+		valid_ = spe_record_decode_next(ctx_, &rec_);
+		return (*this);
+	}
+
+	bool
+	operator!=(end_iterator) const
+	{
+		return (valid_);
+	}
+
+private:
+	spe_decode_ctx *ctx_;
+	spe_record rec_;
+	bool valid_;
+};
+
+class record_range {
+public:
+	explicit record_range(spe_decode_ctx *ctx)
+	    : ctx_(ctx)
+	{
+	}
+
+	record_iterator
+	begin() const
+	{
+		return (record_iterator(ctx_));
+	}
+
+	end_iterator
+	end() const
+	{
+		return (end_iterator{});
+	}
+
+private:
+	spe_decode_ctx *ctx_;
+};
+
+/*
+ * Owns a decode context. As with the C API the data added must stay valid
+ * until the context has finished with it unless SPE_FLAG_MUST_COPY is
+ * used.
+ */
+class decoder {
+public:
+	decoder()
+	    : ctx_(spe_decode_ctx_alloc())
+	{
+		if (ctx_ == nullptr) {
+			throw std::bad_alloc();
+		}
+	}
+	decoder(decoder &&other) noexcept
+	    : ctx_(other.ctx_)
+	{
+		other.ctx_ = nullptr;
+	}
+	decoder &
+	operator=(decoder &&other) noexcept
+	{
+		std::swap(ctx_, other.ctx_);
+		return (*this);
+	}
+	decoder(const decoder &) = delete;
+	decoder &operator=(const decoder &) = delete;
+	~decoder()
+	{
+		spe_decode_ctx_free(ctx_);
+	}
+
+	spe_decode_ctx *
+	get() const
+	{
+		return (ctx_);
+	}
+
+	bool
+	add(const void *data, size_t len, uint32_t flags = 0)
+	{
+		return (spe_decode_ctx_add(ctx_, flags,
+		    const_cast<void *>(data), len));
+	}
+
+	bool
+	release(const void *data)
+	{
+		return (spe_decode_ctx_release(ctx_,
+		    const_cast<void *>(data)));
+	}
+
+	/* Start decoding a new stream, keeping the callbacks */
+	void
+	reset()
+	{
+		spe_decode_ctx_reset(ctx_);
+	}
+
+	void
+	set_log_level(int level)
+	{
+		spe_decode_ctx_set_log_level(ctx_, level);
+	}
+
+	/* for (spe::any_packet pkt : dec.packets()) */
+	packet_range
+	packets(int flags = SPE_PACKET_DECODE_SKIP_PADDING)
+	{
+		return (packet_range(ctx_, flags));
+	}
+
+	/* for (const spe_record &rec : dec.records()) */
+	record_range
+	records()
+	{
+		return (record_range(ctx_));
+	}
+
+	/*
+	 * The records left at the end of the data, call until it returns
+	 * false. The last may have no end or timestamp packet.
+	 */
+	bool
+	flush(spe_record &rec)
+	{
+		return (spe_record_decode_flush(ctx_, &rec));
+	}
+
+	/*
+	 * Decode the packets calling visitor(const spe::address_packet &),
+	 * etc. Packet types the visitor has no overload for are skipped.
+	 * Returns the number of packets decoded.
+	 */
+	template <class Visitor>
+	size_t
+	decode(Visitor &&visitor, int flags = SPE_PACKET_DECODE_SKIP_PADDING)
+	{
+		detail::packet_batch batch;
+		size_t total = 0;
+
+		while (batch.fill(ctx_, flags) > 0) {
+			for (size_t i = 0; i < batch.count; i++) {
+				dispatch(visitor, batch, i);
+			}
+			total += batch.count;
+		}
+		return (total);
+	}
+
+	/* Decode the records calling visitor(const spe_record &) */
+	template <class Visitor>
+	size_t
+	decode_records(Visitor &&visitor)
+	{
+		spe_record recs[64];
+		size_t count, total = 0;
+
+		while ((count = spe_record_decode_batch(ctx_, recs,
+		    sizeof(recs) / sizeof(recs[0]))) > 0) {
+			for (size_t i = 0; i < count; i++) {
+				const spe_record &rec = recs[i];
+
+				visitor(rec);
+			}
+			total += count;
+		}
+		return (total);
+	}
+
+private:
+	template <class Visitor>
+	static inline void
+	dispatch(Visitor &visitor, const detail::packet_batch &batch, size_t i)
+	{
+		using detail::visit;
+
+		switch (batch.type[i]) {
+		case SPE_PKT_INVALID:
+			visit<SPE_PKT_INVALID>(visitor, batch, i);
+			break;
+		case SPE_PKT_UNKNOWN:
+			visit<SPE_PKT_UNKNOWN>(visitor, batch, i);
+			break;
+		case SPE_PKT_ADDRESS:
+			visit<SPE_PKT_ADDRESS>(visitor, batch, i);
+			break;
+		case SPE_PKT_CONTEXT:
+			visit<SPE_PKT_CONTEXT>(visitor, batch, i);
+			break;
+		case SPE_PKT_COUNTER:
+			visit<SPE_PKT_COUNTER>(visitor, batch, i);
+			break;
+		case SPE_PKT_DATA_SOURCE:
+			visit<SPE_PKT_DATA_SOURCE>(visitor, batch, i);
+			break;
+		case SPE_PKT_END:
+			visit<SPE_PKT_END>(visitor, batch, i);
+			break;
+		case SPE_PKT_EVENTS:
+			visit<SPE_PKT_EVENTS>(visitor, batch, i);
+			break;
+		case SPE_PKT_OPERATION_TYPE:
+			visit<SPE_PKT_OPERATION_TYPE>(visitor, batch, i);
+			break;
+		case SPE_PKT_PADDING:
+			visit<SPE_PKT_PADDING>(visitor, batch, i);
+			break;
+		case SPE_PKT_TIMESTAMP:
+			visit<SPE_PKT_TIMESTAMP>(visitor, batch, i);
+			break;
+		default:
+			break;
+		}
+	}
+
+	spe_decode_ctx *ctx_;
+};
+
+} /* namespace spe */
+
+#endif /* _SPEDECODE_HPP_ */
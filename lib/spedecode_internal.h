@@ -26,31 +26,299 @@
  * SUCH DAMAGE.
  */
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
-#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Precomputed information about a packet header. The tables are indexed by
+ * the header so a packet only needs to be classified once.
+ */
+struct spe_header_info {
+	uint8_t type;		/* spe_packet_type */
+	uint8_t data_len;	/* Payload length in bytes */
+	uint8_t index;		/* Address or counter index */
+};
+
+extern const struct spe_header_info spe_header_short[256];
+extern const struct spe_header_info spe_header_long[1024];
+extern const struct spe_header_info spe_header_long_unknown[4];
+
+static inline const struct spe_header_info *
+spe_header_lookup(uint16_t header, int header_len)
+{
+	if (header_len == 1) {
+		return (&spe_header_short[header & 0xff]);
+	}
+	if ((header & 0xfc00) == 0x2000) {
+		return (&spe_header_long[header & 0x3ff]);
+	}
+	return (&spe_header_long_unknown[(header >> 4) & 3]);
+}
+
+/* A buffer added with spe_decode_ctx_add */
+struct spe_segment {
+	void *data;
+	size_t len;
+	uint64_t pos;		/* Stream offset of the start of data */
+	bool own;		/* We own data so must free it */
+};
+
+/* Large enough for the longest packet */
+#define	SPE_STITCH_SIZE		16
+
+/* The most packets expected in a record before the end or timestamp */
+#define	SPE_RECORD_MAX_PACKETS	32
 
 struct spe_decode_ctx {
+	/* The buffer being read, either a segment or the stitch buffer */
 	void *buf;
 	size_t off;
 	size_t len;
-#define	SPE_OWN_BUF	0x01	/* We own buf so can realloc */
-	int flags;
+	uint64_t buf_pos;	/* Stream offset of the start of buf */
 	bool header;
 	bool have_header;
 	uint16_t last_header;
 	int last_header_len;
+	struct spe_header_info last_info;
+	uint64_t last_header_pos;	/* Stream offset of last_header */
 	int log_level;
+	spe_log_cb *log_cb;
+	void *log_cb_data;
+	struct spe_record record;	/* The record being decoded */
+	uint64_t record_pos;		/* Where the record started */
+	uint32_t record_packets;	/* Packets in the record so far */
+	struct spe_decode_stats record_stats;	/* Counters before the record */
+	spe_resync_cb *resync_cb;
+	bool resync;			/* Looking for a record boundary */
+	uint64_t resync_start;		/* The start of the bytes skipped */
+	uint64_t resync_scan;		/* Where to look for a boundary */
 	void *packet_cb_data;
 	spe_packet_cb *packet_cb[SPE_PKT_MAX];
+
+	/*
+	 * Data not yet fully decoded. Segments before the current offset are
+	 * kept while they may be scanned for a record boundary.
+	 */
+	struct spe_segment *segs;
+	size_t nsegs;
+	size_t segs_size;
+	uint64_t end_pos;	/* Stream offset of the end of the last segment */
+	bool final;		/* No more data will be added */
+	spe_release_cb *release_cb;
+	void *release_cb_data;
+	uint8_t stitch[SPE_STITCH_SIZE];
+
+	struct spe_allocator allocator;	/* For the internal buffers */
+	bool allocated;			/* From spe_decode_ctx_alloc */
+
+	struct spe_decode_stats stats;
 };
 
+/* Allocate from the context allocator */
+static inline void *
+spe_alloc(const struct spe_allocator *a, size_t size)
+{
+	return (a->alloc_cb(a->data, size));
+}
+
+/* Allocate an array of n items, failing if the size overflows */
+static inline void *
+spe_alloc_array(const struct spe_allocator *a, size_t n, size_t size)
+{
+	if (size != 0 && n > SIZE_MAX / size) {
+		return (NULL);
+	}
+	return (spe_alloc(a, n * size));
+}
+
+static inline void *
+spe_realloc(const struct spe_allocator *a, void *ptr, size_t size)
+{
+	if (ptr == NULL) {
+		return (a->alloc_cb(a->data, size));
+	}
+	return (a->realloc_cb(a->data, ptr, size));
+}
+
+static inline void
+spe_free(const struct spe_allocator *a, void *ptr)
+{
+	if (ptr != NULL) {
+		a->free_cb(a->data, ptr);
+	}
+}
+
+/* The counters are only updated when built with SPE_STATS */
+#if defined(SPE_STATS)
+#define	SPE_STATS_ADD(ctx, field, n)	((ctx)->stats.field += (n))
+#else
+#define	SPE_STATS_ADD(ctx, field, n)	do {} while (0)
+#endif
+#define	SPE_STATS_INC(ctx, field)	SPE_STATS_ADD(ctx, field, 1)
+
+void spe_record_resync_end(struct spe_decode_ctx *, uint64_t);
+
+/* The result of checking a possible record boundary */
+enum spe_scan_result {
+	SPE_SCAN_NONE,
+	SPE_SCAN_BOUNDARY,
+	SPE_SCAN_MORE,		/* Needs data that hasn't been added */
+};
+
+size_t spe_scan_find(const uint8_t *, size_t, size_t);
+size_t spe_scan_skip_padding(const uint8_t *, size_t, size_t);
+size_t spe_scan_record_next_partial(const void *, size_t, size_t, bool *);
+enum spe_scan_result spe_scan_ctx_boundary(const struct spe_decode_ctx *,
+    size_t, uint64_t, uint64_t *);
+
+bool spe_decode_ctx_fill(struct spe_decode_ctx *, size_t);
+void spe_decode_ctx_seek(struct spe_decode_ctx *, uint64_t);
+void spe_decode_ctx_trim(struct spe_decode_ctx *);
+
+/*
+ * Ensure there are at least len bytes from the current offset in the
+ * current buffer. Returns false if there is not enough data.
+ */
+static inline bool
+spe_decode_ctx_need(struct spe_decode_ctx *ctx, size_t len)
+{
+	assert(ctx->off <= ctx->len);
+	if (ctx->len - ctx->off >= len) {
+		return (true);
+	}
+	return (spe_decode_ctx_fill(ctx, len));
+}
+
+/* A packet read by spe_packet_next */
+struct spe_packet {
+	uint64_t data;
+	uint64_t offset;	/* Stream offset of the header */
+	uint16_t header;
+	struct spe_header_info info;
+};
+
+bool spe_packet_next_slow(struct spe_decode_ctx *, bool, struct spe_packet *);
+
+/* The longest packet, a two byte header and 8 bytes of data */
+#define	SPE_PACKET_MAX_LEN	10
+
+extern const uint64_t spe_payload_mask[9];
+
+/* Load 8 little-endian bytes from a possibly unaligned address */
+static inline uint64_t
+spe_load_le64(const uint8_t *p)
+{
+	uint64_t val;
+
+	memcpy(&val, p, sizeof(val));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	val = __builtin_bswap64(val);
+#endif
+	return (val);
+}
+
+/*
+ * Skip any padding and find the next packet header when there is room for
+ * the longest packet in the current buffer, so only one bounds check is
+ * needed. The payload can then be read with spe_packet_payload. Returns
+ * NULL when the slow path is needed, e.g. at the end of a buffer or when
+ * spe_packet_get_header has been called.
+ */
+static inline const struct spe_header_info *
+spe_packet_header_fast(struct spe_decode_ctx *ctx, bool skip_padding,
+    uint16_t *headerp, int *header_lenp)
+{
+	const uint8_t *buf;
+	size_t off, len;
+	uint16_t header;
+
+	if (!ctx->header) {
+		return (NULL);
+	}
+
+	buf = ctx->buf;
+	off = ctx->off;
+	len = ctx->len;
+	assert(off <= len);
+
+	while (off < len && buf[off] == 0 && skip_padding) {
+		off++;
+	}
+	SPE_STATS_ADD(ctx, padding_bytes, off - ctx->off);
+	ctx->off = off;
+	if (len - off < SPE_PACKET_MAX_LEN) {
+		return (NULL);
+	}
+
+	header = buf[off];
+	*header_lenp = 1;
+	if (header >= 0x20 && header < 0x40) {
+		header = (uint16_t)(header << 8) | buf[off + 1];
+		*header_lenp = 2;
+	}
+	*headerp = header;
+	return (spe_header_lookup(header, *header_lenp));
+}
+
+/* The payload of the packet found by spe_packet_header_fast */
+static inline uint64_t
+spe_packet_payload(struct spe_decode_ctx *ctx, int header_len,
+    const struct spe_header_info *info)
+{
+	return (spe_load_le64((const uint8_t *)ctx->buf + ctx->off +
+	    header_len) & spe_payload_mask[info->data_len]);
+}
+
+/*
+ * Read the next packet if all of it has been added. Unlike
+ * spe_packet_get_header and spe_packet_get_data nothing is consumed when
+ * the packet is incomplete so it can be read again after more data has
+ * been added.
+ */
+static inline bool
+spe_packet_next(struct spe_decode_ctx *ctx, bool skip_padding,
+    struct spe_packet *pkt)
+{
+	const struct spe_header_info *info;
+	uint16_t header;
+	int header_len;
+
+	info = spe_packet_header_fast(ctx, skip_padding, &header,
+	    &header_len);
+	if (info == NULL) {
+		return (spe_packet_next_slow(ctx, skip_padding, pkt));
+	}
+
+	pkt->data = spe_packet_payload(ctx, header_len, info);
+	pkt->offset = ctx->buf_pos + ctx->off;
+	pkt->header = header;
+	pkt->info = *info;
+	ctx->off += header_len + info->data_len;
+	SPE_STATS_INC(ctx, packets[info->type]);
+
+	return (true);
+}
+
+/*
+ * The highest log level built in, messages above this are removed by the
+ * compiler so cost nothing.
+ */
+#if !defined(SPE_LOG_LEVEL)
+#define	SPE_LOG_LEVEL	0
+#endif
+
+void spe_log(struct spe_decode_ctx *, int, const char *, int, const char *,
+    ...);
+
 #define	SPE_LOG(ctx, level, ...)					\
 	do {								\
-		if ((ctx)->log_level >= (level)) {			\
-			fprintf(stderr, "%s:%d ", __func__, __LINE__);	\
-			fprintf(stderr, __VA_ARGS__);			\
-			fprintf(stderr, "\n");				\
+		if ((level) <= SPE_LOG_LEVEL &&				\
+		    (ctx)->log_level >= (level)) {			\
+			spe_log((ctx), (level), __func__, __LINE__,	\
+			    __VA_ARGS__);				\
 		}							\
 	} while (0)
 